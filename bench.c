@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Decode throughput / latency statistics for --bench
+//
+// decode time is the interval between successive frames coming out of the
+// decoder; packet-to-frame latency is from a packet being sent to the frame
+// with the same pts being received; frame-to-flip latency (--bench-display)
+// is from the frame being received to the flip that put it on screen.
+// Peak RSS is the process's; peak CMA is how far CmaFree fell below where
+// it was at the start, sampled every few frames.
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "bench.h"
+#include "tune.h"
+
+// pts -> send time for packets that haven't come out yet.  Needs to cover
+// the decoder's reorder depth + whatever it has queued internally.
+#define PKT_SLOTS 64
+
+// pts -> receive time for frames on their way to the screen: the display
+// queue + what it has waiting for a flip
+#define SHOW_SLOTS 64
+
+// Frames between looks at CmaFree
+#define CMA_SAMPLE_FRAMES 16
+
+typedef struct sample_buf_s
+{
+    size_t n;
+    size_t alloc;
+    int64_t *v;
+} sample_buf_t;
+
+typedef struct bench_env_s
+{
+    int64_t start_time;
+    int64_t end_time;
+    int64_t start_cpu;
+    int64_t end_cpu;
+
+    int64_t last_frame;
+    uint64_t frames;
+    uint64_t packets;
+
+    unsigned int pkt_n;
+    struct {
+        int64_t pts;
+        int64_t time;
+    } pkts[PKT_SLOTS];
+
+    sample_buf_t decode;
+    sample_buf_t pkt2frame;
+
+    // Shown from the display thread so under the lock
+    pthread_mutex_t show_lock;
+    unsigned int show_n;
+    struct {
+        int64_t pts;
+        int64_t time;
+    } shows[SHOW_SLOTS];
+    sample_buf_t frame2flip;
+    uint64_t shown;
+    uint64_t dropped;
+
+    int64_t cma_start;          // kB, -1 if unknown
+    int64_t cma_min;
+} bench_env_t;
+
+static int64_t time_us(const clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sample_add(sample_buf_t *const sb, const int64_t v)
+{
+    if (sb->n == sb->alloc) {
+        const size_t n = sb->alloc == 0 ? 4096 : sb->alloc * 2;
+        int64_t *const p = realloc(sb->v, n * sizeof(*p));
+        if (p == NULL)
+            return;
+        sb->v = p;
+        sb->alloc = n;
+    }
+    sb->v[sb->n++] = v;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct pctl_s
+{
+    double p50, p90, p99, max;
+} pctl_t;
+
+// In ms
+static pctl_t sample_pctl(sample_buf_t *const sb)
+{
+    pctl_t p = {0};
+
+    if (sb->n == 0)
+        return p;
+    qsort(sb->v, sb->n, sizeof(*sb->v), cmp_i64);
+    p.p50 = sb->v[(sb->n - 1) * 50 / 100] / 1000.0;
+    p.p90 = sb->v[(sb->n - 1) * 90 / 100] / 1000.0;
+    p.p99 = sb->v[(sb->n - 1) * 99 / 100] / 1000.0;
+    p.max = sb->v[sb->n - 1] / 1000.0;
+    return p;
+}
+
+// Quote a string for JSON or CSV
+static void put_str(FILE *const f, const char *s, const enum bench_format_e fmt)
+{
+    fputc('"', f);
+    for (; *s != 0; ++s) {
+        if (*s == '"')
+            fputs(fmt == BENCH_FORMAT_CSV ? "\"\"" : "\\\"", f);
+        else if (*s == '\\' && fmt == BENCH_FORMAT_JSON)
+            fputs("\\\\", f);
+        else if ((unsigned char)*s < 0x20 && fmt == BENCH_FORMAT_JSON)
+            fprintf(f, "\\u%04x", *s);
+        else if ((unsigned char)*s < 0x20)
+            fputc(' ', f);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+void bench_packet_in(bench_env_t *const be, const int64_t pts)
+{
+    ++be->packets;
+    if (pts == INT64_MIN)   // AV_NOPTS_VALUE
+        return;
+    be->pkts[be->pkt_n].pts = pts;
+    be->pkts[be->pkt_n].time = time_us(CLOCK_MONOTONIC);
+    be->pkt_n = (be->pkt_n + 1) % PKT_SLOTS;
+}
+
+void bench_frame_out(bench_env_t *const be, const int64_t pts)
+{
+    const int64_t now = time_us(CLOCK_MONOTONIC);
+    unsigned int i;
+
+    if (be->cma_start >= 0 && be->frames % CMA_SAMPLE_FRAMES == 0) {
+        const int64_t kb = tune_cma_free_kb();
+        if (kb >= 0 && kb < be->cma_min)
+            be->cma_min = kb;
+    }
+
+    // First frame includes decoder startup so isn't a decode time
+    if (be->frames++ != 0)
+        sample_add(&be->decode, now - be->last_frame);
+    be->last_frame = now;
+
+    if (pts == INT64_MIN)
+        return;
+
+    pthread_mutex_lock(&be->show_lock);
+    be->shows[be->show_n].pts = pts;
+    be->shows[be->show_n].time = now;
+    be->show_n = (be->show_n + 1) % SHOW_SLOTS;
+    pthread_mutex_unlock(&be->show_lock);
+
+    for (i = 0; i != PKT_SLOTS; ++i) {
+        if (be->pkts[i].time != 0 && be->pkts[i].pts == pts) {
+            sample_add(&be->pkt2frame, now - be->pkts[i].time);
+            be->pkts[i].time = 0;
+            break;
+        }
+    }
+}
+
+void bench_frame_shown(bench_env_t *const be, const int64_t pts, const int64_t flip_time)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&be->show_lock);
+    if (flip_time == 0)
+        ++be->dropped;
+    else
+        ++be->shown;
+    // Clones report the same pts: the first flip counts
+    for (i = 0; pts != INT64_MIN && i != SHOW_SLOTS; ++i) {
+        if (be->shows[i].time != 0 && be->shows[i].pts == pts) {
+            if (flip_time != 0)
+                sample_add(&be->frame2flip, flip_time - be->shows[i].time);
+            be->shows[i].time = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&be->show_lock);
+}
+
+void bench_report(bench_env_t *const be, FILE *const f, const enum bench_format_e fmt, const char *const name)
+{
+    pctl_t dec, p2f, f2f;
+    double wall, cpu;
+    struct rusage ru;
+    long rss_kb = 0;
+    const int64_t cma_kb = be->cma_start < 0 ? 0 : be->cma_start - be->cma_min;
+
+    if (be->end_time == 0) {
+        be->end_time = time_us(CLOCK_MONOTONIC);
+        be->end_cpu = time_us(CLOCK_PROCESS_CPUTIME_ID);
+    }
+
+    wall = (be->end_time - be->start_time) / 1000000.0;
+    cpu = (be->end_cpu - be->start_cpu) / 1000000.0;
+    dec = sample_pctl(&be->decode);
+    p2f = sample_pctl(&be->pkt2frame);
+    pthread_mutex_lock(&be->show_lock);
+    f2f = sample_pctl(&be->frame2flip);
+    pthread_mutex_unlock(&be->show_lock);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        rss_kb = ru.ru_maxrss;
+
+    if (fmt == BENCH_FORMAT_CSV) {
+        fprintf(f, "name,frames,packets,wall_s,fps,cpu_pct,cpu_ms_per_frame,"
+                "decode_p50_ms,decode_p90_ms,decode_p99_ms,decode_max_ms,"
+                "p2f_p50_ms,p2f_p90_ms,p2f_p99_ms,p2f_max_ms,"
+                "shown,display_dropped,f2flip_p50_ms,f2flip_p90_ms,f2flip_p99_ms,f2flip_max_ms,"
+                "peak_rss_kb,peak_cma_kb\n");
+        put_str(f, name, fmt);
+        fprintf(f, ",%" PRIu64 ",%" PRIu64 ",%.3f,%.2f,%.1f,%.3f,"
+                "%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,"
+                "%" PRIu64 ",%" PRIu64 ",%.3f,%.3f,%.3f,%.3f,%ld,%" PRId64 "\n",
+                be->frames, be->packets, wall,
+                wall > 0 ? be->frames / wall : 0.0,
+                wall > 0 ? cpu * 100.0 / wall : 0.0,
+                be->frames ? cpu * 1000.0 / be->frames : 0.0,
+                dec.p50, dec.p90, dec.p99, dec.max,
+                p2f.p50, p2f.p90, p2f.p99, p2f.max,
+                be->shown, be->dropped, f2f.p50, f2f.p90, f2f.p99, f2f.max, rss_kb, cma_kb);
+    }
+    else {
+        fputs("{\n  \"name\": ", f);
+        put_str(f, name, fmt);
+        fprintf(f, ",\n"
+                "  \"frames\": %" PRIu64 ",\n"
+                "  \"packets\": %" PRIu64 ",\n"
+                "  \"wall_s\": %.3f,\n"
+                "  \"fps\": %.2f,\n"
+                "  \"cpu_pct\": %.1f,\n"
+                "  \"cpu_ms_per_frame\": %.3f,\n"
+                "  \"decode_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n"
+                "  \"pkt_to_frame_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n"
+                "  \"shown\": %" PRIu64 ",\n"
+                "  \"display_dropped\": %" PRIu64 ",\n"
+                "  \"frame_to_flip_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n"
+                "  \"peak_rss_kb\": %ld,\n"
+                "  \"peak_cma_kb\": %" PRId64 "\n"
+                "}\n",
+                be->frames, be->packets, wall,
+                wall > 0 ? be->frames / wall : 0.0,
+                wall > 0 ? cpu * 100.0 / wall : 0.0,
+                be->frames ? cpu * 1000.0 / be->frames : 0.0,
+                dec.p50, dec.p90, dec.p99, dec.max,
+                p2f.p50, p2f.p90, p2f.p99, p2f.max,
+                be->shown, be->dropped, f2f.p50, f2f.p90, f2f.p99, f2f.max, rss_kb, cma_kb);
+    }
+    fflush(f);
+}
+
+void bench_delete(bench_env_t *const be)
+{
+    if (be == NULL)
+        return;
+    free(be->decode.v);
+    free(be->pkt2frame.v);
+    free(be->frame2flip.v);
+    pthread_mutex_destroy(&be->show_lock);
+    free(be);
+}
+
+bench_env_t *bench_new(void)
+{
+    bench_env_t *const be = calloc(1, sizeof(*be));
+
+    if (be == NULL)
+        return NULL;
+    pthread_mutex_init(&be->show_lock, NULL);
+    be->cma_start = tune_cma_free_kb();
+    be->cma_min = be->cma_start;
+    be->start_time = time_us(CLOCK_MONOTONIC);
+    be->start_cpu = time_us(CLOCK_PROCESS_CPUTIME_ID);
+    return be;
+}
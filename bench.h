@@ -0,0 +1,24 @@
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct bench_env_s bench_env_t;
+
+enum bench_format_e {
+    BENCH_FORMAT_JSON = 0,
+    BENCH_FORMAT_CSV,
+};
+
+// Call just before the packet goes to the decoder
+void bench_packet_in(bench_env_t * be, int64_t pts);
+// Call for every frame the decoder gives back
+void bench_frame_out(bench_env_t * be, int64_t pts);
+// Call from the display's presented callback: flip_time 0 if dropped.  May
+// be called from any thread.
+void bench_frame_shown(bench_env_t * be, int64_t pts, int64_t flip_time);
+
+// Stop the clocks and write the results
+void bench_report(bench_env_t * be, FILE * f, enum bench_format_e fmt, const char * name);
+void bench_delete(bench_env_t * be);
+// Starts the clocks
+bench_env_t * bench_new(void);
+
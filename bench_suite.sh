@@ -0,0 +1,116 @@
+#!/bin/sh
+# Regression benchmark: run the bench_scenarios.txt scenarios with --bench
+# (decode only) and --bench-display, record fps, CPU, packet to frame
+# latency, peak RSS / CMA and (--bench-display) frame to flip latency for
+# each, and compare with the stored
+# baseline.  Fails if anything is more than BENCH_THRESHOLD percent worse.
+#
+#   ./bench_suite.sh             run & compare with BENCH_BASELINE
+#   ./bench_suite.sh --baseline  run & store the results as the baseline
+#
+# Environment:
+#   BENCH_MEDIA      directory the scenario files are in (default .)
+#   BENCH_FRAMES     frames to play per run (default 600)
+#   BENCH_THRESHOLD  percent worse that counts as a regression (default 10)
+#   BENCH_BASELINE   baseline file (default bench_baseline.txt)
+#   BENCH_RESULTS    where this run's results go (default bench_results.txt)
+#   BENCH_SCENARIOS  scenario list (default bench_scenarios.txt)
+
+PROG=${PROG:-./hello_drmprime}
+MEDIA=${BENCH_MEDIA:-.}
+FRAMES=${BENCH_FRAMES:-600}
+THRESHOLD=${BENCH_THRESHOLD:-10}
+BASELINE=${BENCH_BASELINE:-bench_baseline.txt}
+RESULTS=${BENCH_RESULTS:-bench_results.txt}
+SCENARIOS=${BENCH_SCENARIOS:-bench_scenarios.txt}
+TMP=${TMPDIR:-/tmp}/bench_suite.$$
+
+record=false
+[ "$1" = "--baseline" ] && record=true
+
+# Value of a "key": number from the --bench JSON; for the latency object
+# the p50 / p99 member
+json_num() {
+    sed -n "s/.*\"$2\": *\([-0-9.]*\).*/\1/p" "$1" | head -n 1
+}
+json_pctl() {
+    sed -n "s/.*\"$2\": *{.*\"$3\": *\([-0-9.]*\).*/\1/p" "$1" | head -n 1
+}
+
+: > "$RESULTS"
+echo "# name mode fps cpu_pct p2f_p50_ms p2f_p99_ms peak_rss_kb peak_cma_kb f2flip_p50_ms f2flip_p99_ms" >> "$RESULTS"
+
+grep -v '^[[:space:]]*#' "$SCENARIOS" | grep -v '^[[:space:]]*$' |
+while IFS='|' read -r name files args; do
+    name=$(echo $name)
+    inputs=
+    missing=
+    for f in $files; do
+        [ -f "$MEDIA/$f" ] || missing="$missing $f"
+        inputs="$inputs $MEDIA/$f"
+    done
+    if [ -n "$missing" ]; then
+        echo "SKIP $name: missing$missing" >&2
+        continue
+    fi
+
+    for mode in bench bench-display; do
+        # shellcheck disable=SC2086
+        if ! $PROG --$mode --bench-format json --bench-out "$TMP" -f "$FRAMES" \
+                $args $inputs > /dev/null 2> "$TMP.err"; then
+            echo "FAIL $name $mode: hello_drmprime failed" >&2
+            tail -n 5 "$TMP.err" >&2
+            echo "$name $mode 0 0 0 0 0 0 0 0" >> "$RESULTS"
+            continue
+        fi
+        line="$name $mode $(json_num "$TMP" fps) $(json_num "$TMP" cpu_pct)"
+        line="$line $(json_pctl "$TMP" pkt_to_frame_ms p50) $(json_pctl "$TMP" pkt_to_frame_ms p99)"
+        line="$line $(json_num "$TMP" peak_rss_kb) $(json_num "$TMP" peak_cma_kb)"
+        line="$line $(json_pctl "$TMP" frame_to_flip_ms p50) $(json_pctl "$TMP" frame_to_flip_ms p99)"
+        echo "$line" >> "$RESULTS"
+        echo "$line" >&2
+    done
+done
+rm -f "$TMP" "$TMP.err"
+
+# The loop is in a subshell so count what it wrote
+if [ "$(grep -vc '^#' "$RESULTS")" -eq 0 ]; then
+    echo "No scenarios ran: are the files in BENCH_MEDIA ($MEDIA)?" >&2
+    exit 1
+fi
+
+if $record; then
+    cp "$RESULTS" "$BASELINE"
+    echo "Baseline stored in $BASELINE" >&2
+    exit 0
+fi
+
+if [ ! -f "$BASELINE" ]; then
+    echo "No baseline ($BASELINE): run make bench-baseline first" >&2
+    exit 1
+fi
+
+# fps must not fall, the rest must not rise, by more than THRESHOLD
+# percent.  Latency (1ms) & memory (1MB) get some slack for small values.
+awk -v t="$THRESHOLD" '
+    /^#/ { next }
+    FNR == NR { base[$1 " " $2] = $0; next }
+    {
+        key = $1 " " $2
+        if (!(key in base)) { print "NEW  " key; next }
+        split(base[key], b, " ")
+        bad = ""
+        if ($3 < b[3] * (1 - t / 100)) bad = bad " fps " b[3] "->" $3
+        if ($4 > b[4] * (1 + t / 100) + 1) bad = bad " cpu% " b[4] "->" $4
+        if ($5 > b[5] * (1 + t / 100) + 1) bad = bad " p50 " b[5] "->" $5
+        if ($6 > b[6] * (1 + t / 100) + 1) bad = bad " p99 " b[6] "->" $6
+        if ($7 > b[7] * (1 + t / 100) + 1024) bad = bad " rss " b[7] "->" $7
+        if ($8 > b[8] * (1 + t / 100) + 1024) bad = bad " cma " b[8] "->" $8
+        # Baselines from before frame to flip was recorded have none
+        if (b[9] != "" && $9 > b[9] * (1 + t / 100) + 1) bad = bad " flip p50 " b[9] "->" $9
+        if (b[10] != "" && $10 > b[10] * (1 + t / 100) + 1) bad = bad " flip p99 " b[10] "->" $10
+        if (bad != "") { print "FAIL " key ":" bad; failed = 1 }
+        else print "PASS " key
+    }
+    END { exit failed }
+' "$BASELINE" "$RESULTS"
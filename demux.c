@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Input with a read-ahead thread so that file / network stalls are
+// absorbed by a packet queue rather than turning into decode stalls.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include <libavformat/avformat.h>
+
+#include "demux.h"
+#include "trace.h"
+
+// Cap on packets queued regardless of size - stops a stream of tiny
+// packets (or a silly byte budget) making the queue huge
+#define DEMUX_MAX_PACKETS 1024
+
+typedef struct key_ent_s
+{
+    int64_t ts;                 // Stream time base
+    int64_t pos;                // Byte position (-1 if unknown)
+} key_ent_t;
+
+typedef struct demux_env_s
+{
+    AVFormatContext *ctx;
+    atomic_int abort;
+    int stream_index;
+
+    int thread_running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    size_t max_bytes;
+    size_t q_bytes;
+    unsigned int q_head;
+    unsigned int q_n;
+    int q_err;                  // Reader stopped with this (incl EOF)
+    AVPacket q[DEMUX_MAX_PACKETS];
+    int64_t q_time[DEMUX_MAX_PACKETS];
+    int64_t last_time;          // Receive time of the last packet got
+
+    // Keyframe index for seeking, built on the first seek, in ts order
+    int keys_built;
+    int keys_scanned;           // Made by reading the file - seek by pos
+    unsigned int n_keys;
+    unsigned int keys_size;
+    key_ent_t *keys;
+} demux_env_t;
+
+static int64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int interrupt_cb(void *v)
+{
+    demux_env_t *const dme = v;
+    return atomic_load(&dme->abort);
+}
+
+// Next packet for our stream, straight from the container.  *ptime is set
+// to when it came in.
+static int read_packet(demux_env_t *const dme, AVPacket *const pkt, int64_t *const ptime)
+{
+    for (;;) {
+        int rv;
+        TRACE_BEGIN(t_demux);
+        rv = av_read_frame(dme->ctx, pkt);
+        TRACE_END(TRACE_EV_DEMUX, t_demux, rv < 0 ? 0 : pkt->pts);
+        if (rv < 0)
+            return rv;
+        if (pkt->stream_index == dme->stream_index) {
+            *ptime = time_now_us();
+            return 0;
+        }
+        av_packet_unref(pkt);
+    }
+}
+
+static int q_full(const demux_env_t *const dme, const size_t size)
+{
+    // Always allow one packet whatever its size
+    return dme->q_n != 0 &&
+        (dme->q_n == DEMUX_MAX_PACKETS || dme->q_bytes + size > dme->max_bytes);
+}
+
+static void *demux_thread(void *v)
+{
+    demux_env_t *const dme = v;
+    AVPacket pkt;
+    int64_t time;
+    int rv;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    for (;;) {
+        if ((rv = read_packet(dme, &pkt, &time)) < 0)
+            break;
+
+        pthread_mutex_lock(&dme->lock);
+        while (q_full(dme, pkt.size) && !atomic_load(&dme->abort))
+            pthread_cond_wait(&dme->cond, &dme->lock);
+        if (atomic_load(&dme->abort)) {
+            pthread_mutex_unlock(&dme->lock);
+            av_packet_unref(&pkt);
+            rv = AVERROR_EXIT;
+            break;
+        }
+        av_packet_move_ref(dme->q + (dme->q_head + dme->q_n) % DEMUX_MAX_PACKETS, &pkt);
+        dme->q_time[(dme->q_head + dme->q_n) % DEMUX_MAX_PACKETS] = time;
+        ++dme->q_n;
+        dme->q_bytes += dme->q[(dme->q_head + dme->q_n - 1) % DEMUX_MAX_PACKETS].size;
+        pthread_cond_broadcast(&dme->cond);
+        pthread_mutex_unlock(&dme->lock);
+    }
+
+    pthread_mutex_lock(&dme->lock);
+    dme->q_err = rv;
+    pthread_cond_broadcast(&dme->cond);
+    pthread_mutex_unlock(&dme->lock);
+    return NULL;
+}
+
+struct AVFormatContext *demux_format_ctx(demux_env_t *const dme)
+{
+    return dme->ctx;
+}
+
+int demux_get(demux_env_t *const dme, AVPacket *const pkt)
+{
+    int rv = 0;
+
+    if (!dme->thread_running)
+        return read_packet(dme, pkt, &dme->last_time);
+
+    pthread_mutex_lock(&dme->lock);
+    while (dme->q_n == 0 && dme->q_err == 0)
+        pthread_cond_wait(&dme->cond, &dme->lock);
+    if (dme->q_n == 0) {
+        rv = dme->q_err;
+    }
+    else {
+        AVPacket *const src = dme->q + dme->q_head;
+        dme->q_bytes -= src->size;
+        av_packet_move_ref(pkt, src);
+        dme->last_time = dme->q_time[dme->q_head];
+        dme->q_head = (dme->q_head + 1) % DEMUX_MAX_PACKETS;
+        --dme->q_n;
+        pthread_cond_broadcast(&dme->cond);
+    }
+    pthread_mutex_unlock(&dme->lock);
+    return rv;
+}
+
+int64_t demux_packet_time(const demux_env_t *const dme)
+{
+    return dme->last_time;
+}
+
+int demux_start(demux_env_t *const dme, const int stream_index, const size_t max_bytes)
+{
+    dme->stream_index = stream_index;
+    if (max_bytes == 0)
+        return 0;
+
+    dme->max_bytes = max_bytes;
+    if (pthread_create(&dme->thread, NULL, demux_thread, dme) != 0) {
+        fprintf(stderr, "Failed to create demux thread\n");
+        return AVERROR(errno);
+    }
+    dme->thread_running = 1;
+    return 0;
+}
+
+static void demux_stop(demux_env_t *const dme)
+{
+    if (!dme->thread_running)
+        return;
+
+    pthread_mutex_lock(&dme->lock);
+    atomic_store(&dme->abort, 1);
+    pthread_cond_broadcast(&dme->cond);
+    pthread_mutex_unlock(&dme->lock);
+    pthread_join(dme->thread, NULL);
+    dme->thread_running = 0;
+
+    while (dme->q_n != 0) {
+        av_packet_unref(dme->q + dme->q_head);
+        dme->q_head = (dme->q_head + 1) % DEMUX_MAX_PACKETS;
+        --dme->q_n;
+    }
+    dme->q_bytes = 0;
+    dme->q_err = 0;
+    atomic_store(&dme->abort, 0);
+}
+
+static int key_add(demux_env_t *const dme, const int64_t ts, const int64_t pos)
+{
+    if (dme->n_keys >= dme->keys_size) {
+        const unsigned int n = dme->keys_size < 64 ? 64 : dme->keys_size * 2;
+        key_ent_t *const keys = realloc(dme->keys, n * sizeof(*keys));
+        if (keys == NULL)
+            return AVERROR(ENOMEM);
+        dme->keys = keys;
+        dme->keys_size = n;
+    }
+    dme->keys[dme->n_keys++] = (key_ent_t){ts, pos};
+    return 0;
+}
+
+// Use the container's own index if it has one
+static int keys_from_container(demux_env_t *const dme)
+{
+    AVStream *const st = dme->ctx->streams[dme->stream_index];
+    int i;
+
+    for (i = 0; i != st->nb_index_entries; ++i) {
+        const AVIndexEntry *const ie = st->index_entries + i;
+        if ((ie->flags & AVINDEX_KEYFRAME) != 0 && key_add(dme, ie->timestamp, ie->pos) != 0)
+            return AVERROR(ENOMEM);
+    }
+    return dme->n_keys == 0 ? -1 : 0;
+}
+
+// No index in the container (e.g. elementary streams): read the whole
+// stream once noting where the keyframes are
+static int keys_scan(demux_env_t *const dme)
+{
+    AVPacket pkt;
+    int64_t t;
+    int rv;
+
+    if (av_seek_frame(dme->ctx, dme->stream_index, 0, AVSEEK_FLAG_BYTE) < 0)
+        return -1;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    while ((rv = read_packet(dme, &pkt, &t)) >= 0) {
+        const int64_t ts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+        if ((pkt.flags & AV_PKT_FLAG_KEY) != 0 && pkt.pos >= 0 && ts != AV_NOPTS_VALUE &&
+            (dme->n_keys == 0 || ts > dme->keys[dme->n_keys - 1].ts))
+            rv = key_add(dme, ts, pkt.pos);
+        av_packet_unref(&pkt);
+        if (rv != 0)
+            return rv;
+    }
+    if (dme->n_keys == 0)
+        return -1;
+    dme->keys_scanned = 1;
+    return 0;
+}
+
+int demux_seek(demux_env_t *const dme, const int64_t ts)
+{
+    const int restart = dme->thread_running;
+    const key_ent_t *key = NULL;
+    unsigned int i;
+    int rv;
+
+    demux_stop(dme);
+
+    if (!dme->keys_built) {
+        dme->keys_built = 1;
+        if (keys_from_container(dme) != 0 && keys_scan(dme) != 0)
+            fprintf(stderr, "No keyframe index - seeking by timestamp only\n");
+    }
+
+    // Last keyframe at or before ts
+    for (i = 0; i != dme->n_keys && dme->keys[i].ts <= ts; ++i)
+        key = dme->keys + i;
+
+    if (key != NULL && dme->keys_scanned)
+        rv = av_seek_frame(dme->ctx, dme->stream_index, key->pos, AVSEEK_FLAG_BYTE);
+    else
+        rv = av_seek_frame(dme->ctx, dme->stream_index, key != NULL ? key->ts : ts,
+                           AVSEEK_FLAG_BACKWARD);
+    if (rv < 0)
+        fprintf(stderr, "Seek to %" PRId64 " failed: %s\n", ts, av_err2str(rv));
+
+    if (restart) {
+        const int rv2 = demux_start(dme, dme->stream_index, dme->max_bytes);
+        if (rv2 != 0)
+            return rv2;
+    }
+    return rv < 0 ? rv : 0;
+}
+
+void demux_close(demux_env_t **const pdme)
+{
+    demux_env_t *const dme = *pdme;
+
+    if (dme == NULL)
+        return;
+    *pdme = NULL;
+
+    demux_stop(dme);
+    avformat_close_input(&dme->ctx);
+    free(dme->keys);
+    pthread_cond_destroy(&dme->cond);
+    pthread_mutex_destroy(&dme->lock);
+    free(dme);
+}
+
+demux_env_t *demux_open(const char *const url, AVDictionary **const options)
+{
+    demux_env_t *const dme = calloc(1, sizeof(*dme));
+
+    if (dme == NULL)
+        return NULL;
+
+    atomic_init(&dme->abort, 0);
+    dme->stream_index = -1;
+    pthread_mutex_init(&dme->lock, NULL);
+    pthread_cond_init(&dme->cond, NULL);
+
+    // The interrupt callback is copied into the I/O context on open so it
+    // has to be there first
+    if ((dme->ctx = avformat_alloc_context()) == NULL)
+        goto fail;
+    dme->ctx->interrupt_callback.callback = interrupt_cb;
+    dme->ctx->interrupt_callback.opaque = dme;
+
+    // Frees ctx on failure
+    if (avformat_open_input(&dme->ctx, url, NULL, options) != 0) {
+        fprintf(stderr, "Cannot open input file '%s'\n", url);
+        goto fail;
+    }
+
+    return dme;
+
+fail:
+    pthread_cond_destroy(&dme->cond);
+    pthread_mutex_destroy(&dme->lock);
+    free(dme);
+    return NULL;
+}
@@ -0,0 +1,36 @@
+#include <stddef.h>
+#include <stdint.h>
+
+struct AVFormatContext;
+struct AVPacket;
+struct AVDictionary;
+typedef struct demux_env_s demux_env_t;
+
+// Format context for stream selection, codec params etc.  Still owned by
+// the demux env.
+struct AVFormatContext * demux_format_ctx(demux_env_t * dme);
+
+// Select the stream to read and start reading its packets ahead of the
+// decoder on a separate thread, queueing at most max_bytes of packet data.
+// Packets for other streams are dropped.  If max_bytes is 0 then no thread
+// is started and demux_get reads synchronously.
+int demux_start(demux_env_t * dme, int stream_index, size_t max_bytes);
+
+// Get the next packet for the stream passed to demux_start.
+// Returns 0, AVERROR_EOF or another error from av_read_frame.
+int demux_get(demux_env_t * dme, struct AVPacket * pkt);
+// When the packet last returned by demux_get was read from the input
+// (CLOCK_MONOTONIC us) - includes any time spent in the readahead queue
+int64_t demux_packet_time(const demux_env_t * dme);
+
+// Seek so that the next packet is from the keyframe at or before ts
+// (stream time base).  Uses the container index if there is one, otherwise
+// the stream is scanned for keyframes on the first seek.  Packets already
+// read ahead are discarded.
+int demux_seek(demux_env_t * dme, int64_t ts);
+
+// Stops the reader (interrupting any blocked I/O) and closes the input
+void demux_close(demux_env_t ** pdme);
+// Open url (avformat_open_input), options passed through
+demux_env_t * demux_open(const char * url, struct AVDictionary ** options);
+
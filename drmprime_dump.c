@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Dump DRM_PRIME frames to a file without going via system memory frames.
+// The dma-bufs are mmapped (and the mappings kept) and the rows are handed
+// straight to writev from the writer thread.
+//
+// Linear formats are written as packed rows, plane after plane, which is
+// the same as the -o output for the same format.  Anything with a
+// non-linear modifier (e.g. SAND) is written as whole objects as we can't
+// sensibly unpick the layout.
+
+#define _GNU_SOURCE     // O_DIRECT
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <linux/dma-buf.h>
+#include <drm_fourcc.h>
+
+#include "libavutil/frame.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/hwcontext_drm.h"
+
+#include "drmprime_dump.h"
+
+#define ERRSTR strerror(errno)
+
+// Frames the writer may fall behind by.  Each one pins a decoder buffer so
+// keep it small.
+#define DUMP_QUEUE_SIZE 4
+
+// Mappings kept - as with the FB cache the decoder only has a small pool
+#define MAP_CACHE_SIZE 32
+
+// O_DIRECT bounce buffer.  Must be a multiple of the block size.
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF_SIZE (4 << 20)
+
+#define IOV_BATCH 256
+
+typedef struct dump_map_s
+{
+    const void *pool;
+    dev_t dev;
+    ino_t ino;
+    size_t size;
+    void *ptr;                  // NULL => slot empty
+    unsigned int last_used;
+} dump_map_t;
+
+typedef struct drmprime_dump_env_s
+{
+    int fd;
+    int direct;
+    int err;                    // Sticky write error
+
+    const void *pool;
+    unsigned int map_seq;
+    dump_map_t maps[MAP_CACHE_SIZE];
+
+    uint8_t *dbuf;              // O_DIRECT bounce buffer
+    size_t dbuf_n;
+
+    unsigned int n_iov;
+    struct iovec iov[IOV_BATCH];
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int terminate;
+    unsigned int q_head;
+    unsigned int q_n;
+    AVFrame *q[DUMP_QUEUE_SIZE];
+} drmprime_dump_env_t;
+
+// Packed row layout of the linear formats we know about
+typedef struct dump_fmt_s
+{
+    uint32_t fourcc;
+    unsigned int n_planes;
+    struct {
+        unsigned int bpp;       // Bytes per (subsampled) pixel
+        unsigned int hshift;
+        unsigned int vshift;
+    } p[3];
+} dump_fmt_t;
+
+static const dump_fmt_t dump_fmts[] = {
+    {DRM_FORMAT_NV12,     2, {{1, 0, 0}, {2, 1, 1}}},
+    {DRM_FORMAT_NV21,     2, {{1, 0, 0}, {2, 1, 1}}},
+    {DRM_FORMAT_NV16,     2, {{1, 0, 0}, {2, 1, 0}}},
+    {DRM_FORMAT_YUV420,   3, {{1, 0, 0}, {1, 1, 1}, {1, 1, 1}}},
+    {DRM_FORMAT_YVU420,   3, {{1, 0, 0}, {1, 1, 1}, {1, 1, 1}}},
+    {DRM_FORMAT_P010,     2, {{2, 0, 0}, {4, 1, 1}}},
+    {DRM_FORMAT_RGB565,   1, {{2, 0, 0}}},
+    {DRM_FORMAT_XRGB8888, 1, {{4, 0, 0}}},
+    {DRM_FORMAT_ARGB8888, 1, {{4, 0, 0}}},
+    {DRM_FORMAT_XBGR8888, 1, {{4, 0, 0}}},
+    {DRM_FORMAT_ABGR8888, 1, {{4, 0, 0}}},
+};
+
+static const dump_fmt_t *find_fmt(const uint32_t fourcc)
+{
+    unsigned int i;
+    for (i = 0; i != sizeof(dump_fmts) / sizeof(dump_fmts[0]); ++i) {
+        if (dump_fmts[i].fourcc == fourcc)
+            return dump_fmts + i;
+    }
+    return NULL;
+}
+
+static void map_free(dump_map_t *const m)
+{
+    if (m->ptr == NULL)
+        return;
+    munmap(m->ptr, m->size);
+    m->ptr = NULL;
+}
+
+// Get a read mapping of the whole object
+static dump_map_t *map_get(drmprime_dump_env_t *const dde, const void *const pool,
+                           const AVDRMObjectDescriptor *const obj)
+{
+    struct stat st;
+    dump_map_t *victim = NULL;
+    size_t size = obj->size;
+    unsigned int i;
+
+    if (fstat(obj->fd, &st) != 0) {
+        fprintf(stderr, "fstat(%d) failed: %s\n", obj->fd, ERRSTR);
+        return NULL;
+    }
+
+    // New pool - old buffers are gone so drop their mappings
+    if (pool != dde->pool) {
+        dde->pool = pool;
+        for (i = 0; i != MAP_CACHE_SIZE; ++i)
+            map_free(dde->maps + i);
+    }
+
+    for (i = 0; i != MAP_CACHE_SIZE; ++i) {
+        dump_map_t *const m = dde->maps + i;
+        if (m->ptr == NULL) {
+            if (victim == NULL || victim->ptr != NULL)
+                victim = m;
+            continue;
+        }
+        if (m->dev == st.st_dev && m->ino == st.st_ino) {
+            m->last_used = ++dde->map_seq;
+            return m;
+        }
+        if (victim == NULL || (victim->ptr != NULL && victim->last_used > m->last_used))
+            victim = m;
+    }
+
+    map_free(victim);
+
+    // Not every exporter fills in the size
+    if (size == 0) {
+        off_t end = lseek(obj->fd, 0, SEEK_END);
+        if (end <= 0) {
+            fprintf(stderr, "Can't get size of dma-buf %d\n", obj->fd);
+            return NULL;
+        }
+        size = end;
+    }
+
+    victim->ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, obj->fd, 0);
+    if (victim->ptr == MAP_FAILED) {
+        fprintf(stderr, "mmap(%d) failed: %s\n", obj->fd, ERRSTR);
+        victim->ptr = NULL;
+        return NULL;
+    }
+    victim->pool = pool;
+    victim->dev = st.st_dev;
+    victim->ino = st.st_ino;
+    victim->size = size;
+    victim->last_used = ++dde->map_seq;
+    return victim;
+}
+
+static int write_all(const int fd, const void *buf, size_t len)
+{
+    while (len != 0) {
+        const ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int writev_all(const int fd, struct iovec *iov, unsigned int n_iov)
+{
+    while (n_iov != 0) {
+        ssize_t n = writev(fd, iov, n_iov);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        while (n_iov != 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --n_iov;
+        }
+        if (n_iov != 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int iov_flush(drmprime_dump_env_t *const dde)
+{
+    unsigned int i;
+    int rv = 0;
+
+    if (!dde->direct) {
+        rv = writev_all(dde->fd, dde->iov, dde->n_iov);
+        dde->n_iov = 0;
+        return rv;
+    }
+
+    // O_DIRECT: pack into the bounce buffer and write whole buffers
+    for (i = 0; i != dde->n_iov && rv == 0; ++i) {
+        const uint8_t *p = dde->iov[i].iov_base;
+        size_t len = dde->iov[i].iov_len;
+
+        while (len != 0) {
+            const size_t n = len < DIRECT_BUF_SIZE - dde->dbuf_n ? len : DIRECT_BUF_SIZE - dde->dbuf_n;
+            memcpy(dde->dbuf + dde->dbuf_n, p, n);
+            dde->dbuf_n += n;
+            p += n;
+            len -= n;
+            if (dde->dbuf_n == DIRECT_BUF_SIZE) {
+                if ((rv = write_all(dde->fd, dde->dbuf, DIRECT_BUF_SIZE)) != 0)
+                    break;
+                dde->dbuf_n = 0;
+            }
+        }
+    }
+    dde->n_iov = 0;
+    return rv;
+}
+
+static int iov_add(drmprime_dump_env_t *const dde, const void *const p, const size_t len)
+{
+    if (dde->n_iov == IOV_BATCH) {
+        int rv = iov_flush(dde);
+        if (rv != 0)
+            return rv;
+    }
+    dde->iov[dde->n_iov++] = (struct iovec){ .iov_base = (void *)p, .iov_len = len };
+    return 0;
+}
+
+static int dma_sync(const int fd, const uint64_t flags)
+{
+    struct dma_buf_sync sync = {.flags = flags};
+    while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) != 0) {
+        if (errno != EINTR)
+            return -errno;
+    }
+    return 0;
+}
+
+static int dump_frame(drmprime_dump_env_t *const dde, const AVFrame *const frame)
+{
+    const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
+    const void *const pool = frame->hw_frames_ctx == NULL ? NULL : frame->hw_frames_ctx->data;
+    const dump_fmt_t *const fmt = find_fmt(desc->layers[0].format);
+    dump_map_t *maps[AV_DRM_MAX_PLANES] = {NULL};
+    int linear = fmt != NULL;
+    int rv = 0;
+    int i, j, n;
+
+    for (i = 0; i < desc->nb_objects; ++i) {
+        if (desc->objects[i].format_modifier != DRM_FORMAT_MOD_LINEAR &&
+            desc->objects[i].format_modifier != DRM_FORMAT_MOD_INVALID)
+            linear = 0;
+        if ((maps[i] = map_get(dde, pool, desc->objects + i)) == NULL)
+            return AVERROR(ENOMEM);
+    }
+
+    for (i = 0; i < desc->nb_objects; ++i)
+        dma_sync(desc->objects[i].fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+
+    if (!linear) {
+        for (i = 0; i < desc->nb_objects && rv == 0; ++i)
+            rv = iov_add(dde, maps[i]->ptr, maps[i]->size);
+    }
+    else {
+        n = 0;
+        for (i = 0; i < desc->nb_layers && rv == 0; ++i) {
+            for (j = 0; j < desc->layers[i].nb_planes && n < (int)fmt->n_planes && rv == 0; ++j, ++n) {
+                const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
+                const uint8_t *row = (const uint8_t *)maps[p->object_index]->ptr + p->offset;
+                const size_t row_len = (size_t)(frame->width >> fmt->p[n].hshift) * fmt->p[n].bpp;
+                const int rows = frame->height >> fmt->p[n].vshift;
+                int y;
+
+                // Rows packed already => one iov for the plane
+                if ((size_t)p->pitch == row_len) {
+                    rv = iov_add(dde, row, row_len * rows);
+                    continue;
+                }
+                for (y = 0; y < rows && rv == 0; ++y, row += p->pitch)
+                    rv = iov_add(dde, row, row_len);
+            }
+        }
+    }
+
+    if (rv == 0)
+        rv = iov_flush(dde);
+    dde->n_iov = 0;
+
+    for (i = 0; i < desc->nb_objects; ++i)
+        dma_sync(desc->objects[i].fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+    if (rv != 0)
+        fprintf(stderr, "Failed to write dump: %s\n", strerror(-rv));
+    return rv;
+}
+
+static void *dump_thread(void *v)
+{
+    drmprime_dump_env_t *const dde = v;
+
+    pthread_mutex_lock(&dde->lock);
+    for (;;) {
+        AVFrame *frame;
+        int rv;
+
+        while (dde->q_n == 0 && !dde->terminate)
+            pthread_cond_wait(&dde->cond, &dde->lock);
+        if (dde->q_n == 0)
+            break;
+
+        frame = dde->q[dde->q_head];
+        dde->q[dde->q_head] = NULL;
+        dde->q_head = (dde->q_head + 1) % DUMP_QUEUE_SIZE;
+        --dde->q_n;
+        pthread_cond_broadcast(&dde->cond);
+        pthread_mutex_unlock(&dde->lock);
+
+        // Keep draining after an error so the decoder gets its buffers back
+        rv = dde->err != 0 ? 0 : dump_frame(dde, frame);
+        av_frame_free(&frame);
+
+        pthread_mutex_lock(&dde->lock);
+        if (rv != 0 && dde->err == 0)
+            dde->err = rv;
+    }
+    pthread_mutex_unlock(&dde->lock);
+    return NULL;
+}
+
+int drmprime_dump_frame(drmprime_dump_env_t *const dde, struct AVFrame *const src_frame)
+{
+    AVFrame *frame;
+    int rv;
+
+    if (src_frame->format != AV_PIX_FMT_DRM_PRIME) {
+        fprintf(stderr, "Frame (format=%d) not DRM_PRIME - can't dump\n", src_frame->format);
+        return AVERROR(EINVAL);
+    }
+
+    if ((frame = av_frame_clone(src_frame)) == NULL)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&dde->lock);
+    while (dde->q_n == DUMP_QUEUE_SIZE)
+        pthread_cond_wait(&dde->cond, &dde->lock);
+    dde->q[(dde->q_head + dde->q_n) % DUMP_QUEUE_SIZE] = frame;
+    ++dde->q_n;
+    pthread_cond_broadcast(&dde->cond);
+    rv = dde->err;
+    pthread_mutex_unlock(&dde->lock);
+
+    return rv;
+}
+
+void drmprime_dump_delete(drmprime_dump_env_t *const dde)
+{
+    unsigned int i;
+
+    if (dde == NULL)
+        return;
+
+    pthread_mutex_lock(&dde->lock);
+    dde->terminate = 1;
+    pthread_cond_broadcast(&dde->cond);
+    pthread_mutex_unlock(&dde->lock);
+    pthread_join(dde->thread, NULL);
+
+    // Tail of an O_DIRECT file won't be a whole block
+    if (dde->direct && dde->dbuf_n != 0 && dde->err == 0) {
+        fcntl(dde->fd, F_SETFL, fcntl(dde->fd, F_GETFL) & ~O_DIRECT);
+        if (write_all(dde->fd, dde->dbuf, dde->dbuf_n) != 0)
+            fprintf(stderr, "Failed to write dump: %s\n", ERRSTR);
+    }
+
+    for (i = 0; i != MAP_CACHE_SIZE; ++i)
+        map_free(dde->maps + i);
+
+    close(dde->fd);
+    free(dde->dbuf);
+    pthread_cond_destroy(&dde->cond);
+    pthread_mutex_destroy(&dde->lock);
+    free(dde);
+}
+
+drmprime_dump_env_t *drmprime_dump_new(const char *const filename, const int direct)
+{
+    drmprime_dump_env_t *const dde = calloc(1, sizeof(*dde));
+
+    if (dde == NULL)
+        return NULL;
+
+    dde->direct = direct;
+    if (direct && posix_memalign((void **)&dde->dbuf, DIRECT_ALIGN, DIRECT_BUF_SIZE) != 0) {
+        fprintf(stderr, "Failed to alloc O_DIRECT buffer\n");
+        goto fail_free;
+    }
+
+    if ((dde->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0666)) < 0) {
+        fprintf(stderr, "Failed to open dump file %s: %s\n", filename, ERRSTR);
+        goto fail_free;
+    }
+
+    pthread_mutex_init(&dde->lock, NULL);
+    pthread_cond_init(&dde->cond, NULL);
+    if (pthread_create(&dde->thread, NULL, dump_thread, dde) != 0) {
+        fprintf(stderr, "Failed to create dump thread: %s\n", ERRSTR);
+        goto fail_close;
+    }
+
+    return dde;
+
+fail_close:
+    pthread_cond_destroy(&dde->cond);
+    pthread_mutex_destroy(&dde->lock);
+    close(dde->fd);
+fail_free:
+    free(dde->dbuf);
+    free(dde);
+    return NULL;
+}
@@ -0,0 +1,12 @@
+struct AVFrame;
+typedef struct drmprime_dump_env_s drmprime_dump_env_t;
+
+// Queue a DRM_PRIME frame to be written to the dump file.  The frame is
+// ref'd so the caller keeps ownership of its own.  Blocks if the writer has
+// fallen too far behind.  Returns any error the writer has hit so far.
+int drmprime_dump_frame(drmprime_dump_env_t * dde, struct AVFrame * frame);
+// Flushes anything still queued and closes the file
+void drmprime_dump_delete(drmprime_dump_env_t * dde);
+// direct: use O_DIRECT (data is copied into an aligned bounce buffer)
+drmprime_dump_env_t * drmprime_dump_new(const char * filename, int direct);
+
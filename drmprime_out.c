@@ -22,52 +22,504 @@
 // *** This module is a work in progress and its utility is strictly
 //     limited to testing.
 
+#define _GNU_SOURCE     // ppoll
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 
+#include <drm_fourcc.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include <linux/dma-buf.h>
+#include <linux/sync_file.h>
+
 #include "libavutil/frame.h"
 #include "libavutil/hwcontext.h"
 #include "libavutil/hwcontext_drm.h"
+#include "libavutil/mastering_display_metadata.h"
+#include "libavutil/mathematics.h"
 #include "libavutil/pixdesc.h"
 
+#include "drmprime_out.h"
+#include "frame_pool.h"
+#include "trace.h"
 
-#define TRACE_ALL 0
 
 #define DRM_MODULE "vc4"
 
 #define ERRSTR strerror(errno)
 
+typedef struct drm_rect_s
+{
+    int x, y, width, height;
+} drm_rect_t;
+
 struct drm_setup
 {
     int conId;
     uint32_t crtcId;
     int crtcIdx;
-    uint32_t planeId;
-    unsigned int out_fourcc;
-    struct
-    {
-        int x, y, width, height;
-    } compose;
+    drm_rect_t compose;     // Whole CRTC
+    int64_t vbl_period;     // us, 0 if unknown
 };
 
-typedef struct drm_aux_s
+// Identity of an imported dma-buf set + the layout we built the FB with.
+// A dma-buf is its dev/inode: fd numbers change from map to map (VAAPI
+// exports new ones every time) and our GEM import holds the dma-buf so
+// the inode can't be reused while the entry lives.  Zeroed before filling
+// so it can be compared with memcmp.
+typedef struct fb_key_s
 {
-    unsigned int fb_handle;
+    const void *pool;           // hw_frames_ctx data (NULL if none)
+    unsigned int nb_objects;
+    struct {
+        dev_t dev;
+        ino_t ino;
+    } objects[AV_DRM_MAX_PLANES];
+    uint32_t format;
+    unsigned int width;
+    unsigned int height;
+    uint32_t pitches[4];
+    uint32_t offsets[4];
+    uint64_t modifiers[4];
+} fb_key_t;
+
+typedef struct fb_ent_s
+{
+    fb_key_t key;
+    unsigned int fb_handle;     // 0 => slot empty
     uint32_t bo_handles[AV_DRM_MAX_PLANES];
+    unsigned int ref_count;     // Number of aux slots holding this FB
+    unsigned int last_used;
+} fb_ent_t;
+
+// The V4L2 decoders (and the DRM hwaccel) cycle through a small fixed pool
+// of capture buffers so in the steady state every frame should hit.  This
+// needs to be comfortably bigger than any decoder pool + AUX_MAX.
+// Scaled by the number of ports.
+#define FB_CACHE_SIZE 32
+// Max streams in a mosaic
+#define PORTS_MAX 16
+// Max overlay planes leased out to other outputs
+#define LEASED_MAX 16
+
+// Atomic property ids for the plane we are using
+typedef struct plane_props_s
+{
+    uint32_t fb_id;
+    uint32_t crtc_id;
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t src_w;
+    uint32_t src_h;
+    uint32_t crtc_x;
+    uint32_t crtc_y;
+    uint32_t crtc_w;
+    uint32_t crtc_h;
+} plane_props_t;
+
+static const struct {
+    const char *name;
+    size_t offset;
+} plane_prop_names[] = {
+    {"FB_ID",   offsetof(plane_props_t, fb_id)},
+    {"CRTC_ID", offsetof(plane_props_t, crtc_id)},
+    {"SRC_X",   offsetof(plane_props_t, src_x)},
+    {"SRC_Y",   offsetof(plane_props_t, src_y)},
+    {"SRC_W",   offsetof(plane_props_t, src_w)},
+    {"SRC_H",   offsetof(plane_props_t, src_h)},
+    {"CRTC_X",  offsetof(plane_props_t, crtc_x)},
+    {"CRTC_Y",  offsetof(plane_props_t, crtc_y)},
+    {"CRTC_W",  offsetof(plane_props_t, crtc_w)},
+    {"CRTC_H",  offsetof(plane_props_t, crtc_h)},
+};
+
+// YCbCr to RGB conversion props of a plane: ids 0 if it hasn't got them,
+// values -1 if that enum isn't offered
+enum {
+    COLOR_ENC_BT601 = 0,
+    COLOR_ENC_BT709,
+    COLOR_ENC_BT2020,
+    COLOR_ENC_COUNT
+};
+typedef struct plane_color_s
+{
+    uint32_t encoding_id;       // COLOR_ENCODING
+    uint32_t range_id;          // COLOR_RANGE
+    int64_t encoding[COLOR_ENC_COUNT];
+    int64_t range[2];           // Limited, full
+} plane_color_t;
+
+static const char *const color_encoding_names[COLOR_ENC_COUNT] = {
+    "ITU-R BT.601 YCbCr",
+    "ITU-R BT.709 YCbCr",
+    "ITU-R BT.2020 YCbCr",
+};
+
+// What a plane can do - read once at init
+typedef struct plane_cap_s
+{
+    uint32_t plane_id;
+    uint64_t type;              // DRM_PLANE_TYPE_xxx
+    int zpos;                   // -1 if no zpos prop
+    int can_scale;
+    plane_props_t props;        // Atomic only
+    plane_color_t color;
+    uint32_t in_fence_id;       // IN_FENCE_FD prop, 0 if none
+    unsigned int n_fmts;
+    struct {
+        uint32_t format;
+        uint64_t modifier;      // DRM_FORMAT_MOD_INVALID if not known
+    } *fmts;
+} plane_cap_t;
+
+#define PLANE_CAPS_MAX 32
+
+// Planes that can take a format+modifier, best first
+typedef struct plane_memo_s
+{
+    uint32_t format;
+    uint64_t modifier;
+    unsigned int n;
+    uint8_t idx[PLANE_CAPS_MAX];    // into plane_caps
+} plane_memo_t;
+
+#define PLANE_MEMO_SIZE 8
+
+typedef struct drm_aux_s
+{
+    fb_ent_t *fb;
 
     AVFrame *frame;
 } drm_aux_t;
 
+// Single producer (decode thread) / single consumer (display thread) frame
+// queue.  head is only ever written by the producer.  tail is advanced by
+// CAS so that the producer can also take the oldest frame off the queue
+// when the policy is drop-oldest; whoever wins the CAS owns the frame.
+// Slots are a power of 2 so the free-running indices can wrap; depth is
+// the logical size.  Each slot also holds the flush generation its frame
+// was put in and the pts the caller gave it (for the presented callback:
+// the frame's own has been converted for pacing).
+typedef struct frame_ring_s
+{
+    unsigned int depth;
+    unsigned int mask;
+    _Atomic(AVFrame *) *slots;
+    atomic_uint *gens;
+    _Atomic(int64_t) *ptss;
+    atomic_uint head;
+    atomic_uint tail;
+
+    atomic_int prod_waiting;
+    sem_t prod_sem;
+    // Owned by the env - shared by all rings so one display thread can
+    // poll for all of them
+    atomic_int *cons_waiting;
+    int cons_efd;
+    frame_pool_t *pool;         // Where dropped frames go (the env's)
+} frame_ring_t;
+
+static int do_sem_wait(sem_t *const sem, const int nowait)
+{
+    while (nowait ? sem_trywait(sem) : sem_wait(sem)) {
+        if (errno != EINTR) return -errno;
+    }
+    return 0;
+}
+
+static int ring_init(frame_ring_t *const r, const unsigned int depth,
+                     atomic_int *const cons_waiting, const int cons_efd,
+                     frame_pool_t *const pool)
+{
+    unsigned int n = 1;
+
+    while (n < depth)
+        n <<= 1;
+
+    r->depth = depth;
+    r->mask = n - 1;
+    if ((r->slots = calloc(n, sizeof(*r->slots))) == NULL ||
+        (r->gens = calloc(n, sizeof(*r->gens))) == NULL ||
+        (r->ptss = calloc(n, sizeof(*r->ptss))) == NULL) {
+        free(r->slots);
+        free(r->gens);
+        r->slots = NULL;
+        r->gens = NULL;
+        return -ENOMEM;
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->prod_waiting, 0);
+    sem_init(&r->prod_sem, 0, 0);
+    r->cons_waiting = cons_waiting;
+    r->cons_efd = cons_efd;
+    r->pool = pool;
+    return 0;
+}
+
+static int ring_empty(frame_ring_t *const r)
+{
+    return atomic_load(&r->tail) == atomic_load(&r->head);
+}
+
+// Take the oldest frame, NULL if empty.  pgen (if not NULL) gets the
+// generation the frame was put with and ppts its caller's pts.
+static AVFrame *ring_take(frame_ring_t *const r, unsigned int *const pgen, int64_t *const ppts)
+{
+    unsigned int t = atomic_load(&r->tail);
+
+    for (;;) {
+        AVFrame *frame;
+        unsigned int gen;
+        int64_t pts;
+
+        if (t == atomic_load(&r->head))
+            return NULL;
+        // The producer can't reuse this slot until tail has moved past it
+        frame = atomic_load(&r->slots[t & r->mask]);
+        gen = atomic_load(&r->gens[t & r->mask]);
+        pts = atomic_load(&r->ptss[t & r->mask]);
+        if (atomic_compare_exchange_weak(&r->tail, &t, t + 1)) {
+            if (pgen != NULL)
+                *pgen = gen;
+            *ppts = pts;
+            return frame;
+        }
+    }
+}
+
+static void ring_uninit(frame_ring_t *const r)
+{
+    AVFrame *frame;
+    int64_t pts;
+
+    if (r->slots == NULL)
+        return;
+    while ((frame = ring_take(r, NULL, &pts)) != NULL)
+        frame_pool_put(r->pool, &frame);
+    sem_destroy(&r->prod_sem);
+    free(r->slots);
+    free(r->gens);
+    free(r->ptss);
+    r->slots = NULL;
+    r->gens = NULL;
+    r->ptss = NULL;
+}
+
+// Wake the other side if it said it was going to sleep
+static void ring_kick(atomic_int *const waiting, sem_t *const sem)
+{
+    if (atomic_exchange(waiting, 0))
+        sem_post(sem);
+}
+
+// Wake the display thread if it is (about to be) in poll
+static void ring_kick_cons(frame_ring_t *const r)
+{
+    if (atomic_exchange(r->cons_waiting, 0))
+        eventfd_write(r->cons_efd, 1);
+}
+
+// Sleep until cond(r) might have changed. The flag is set before cond is
+// rechecked so a kick between the two can't be lost.
+static void ring_sleep(frame_ring_t *const r, atomic_int *const waiting, sem_t *const sem,
+                       int (*const cond)(frame_ring_t *))
+{
+    atomic_store(waiting, 1);
+    if (cond(r))
+        do_sem_wait(sem, 0);
+    else
+        atomic_store(waiting, 0);
+}
+
+static int ring_full(frame_ring_t *const r)
+{
+    return atomic_load(&r->head) - atomic_load(&r->tail) >= r->depth;
+}
+
+// Producer: returns the frame dropped to make room (the new one with
+// DROP_NEWEST) for the caller to dispose of, or NULL, with its pts in
+// *pdropped_pts.  gen is the flush generation the frame belongs to & pts
+// the caller's.
+static AVFrame *ring_put(frame_ring_t *const r, AVFrame *frame, const unsigned int gen,
+                         const int64_t pts, const enum drmprime_out_policy_e policy,
+                         int64_t *const pdropped_pts)
+{
+    AVFrame *dropped = NULL;
+
+    while (ring_full(r)) {
+        switch (policy) {
+            case DRMPRIME_OUT_POLICY_DROP_NEWEST:
+                *pdropped_pts = pts;
+                return frame;
+            case DRMPRIME_OUT_POLICY_DROP_OLDEST:
+                // Only ever the one: we are the only producer
+                if (dropped == NULL)
+                    dropped = ring_take(r, NULL, pdropped_pts);
+                break;
+            case DRMPRIME_OUT_POLICY_BLOCK:
+            default:
+                ring_sleep(r, &r->prod_waiting, &r->prod_sem, ring_full);
+                break;
+        }
+    }
+
+    {
+        const unsigned int h = atomic_load(&r->head);
+        atomic_store(&r->slots[h & r->mask], frame);
+        atomic_store(&r->gens[h & r->mask], gen);
+        atomic_store(&r->ptss[h & r->mask], pts);
+        atomic_store(&r->head, h + 1);
+    }
+    ring_kick_cons(r);
+    return dropped;
+}
+
 // Aux size should only need to be 2, but on a few streams (Hobbit) under FKMS
 // we get initial flicker probably due to dodgy drm timing
 #define AUX_SIZE 3
+// Upper limit on user requested retention
+#define AUX_MAX 8
+// Everything about a frame that the plane rects depend on
+typedef struct geom_key_s
+{
+    unsigned int width, height;
+    unsigned int crop_left, crop_top, crop_right, crop_bottom;
+    AVRational sar;
+} geom_key_t;
+
+// One stream of frames on one plane.  fields marked "decode thread" are
+// only touched by whoever calls drmprime_out_display for this port.
+typedef struct drm_port_s
+{
+    uint32_t plane_id;
+    unsigned int out_fourcc;
+    uint64_t out_modifier;
+    plane_props_t plane_props;
+    plane_color_t color;
+    uint32_t old_plane_id;      // Plane to turn off on next commit (0 = none)
+    // Colour prop values the current frame wants (-1 = leave alone) and
+    // those last set on the plane (-1 = unknown)
+    int64_t enc_want, range_want;
+    int64_t enc_cur, range_cur;
+    uint32_t in_fence_id;       // Plane IN_FENCE_FD prop (0 = none)
+    int in_fence;               // sync_file in the commit being built, -1 if none
+    drm_rect_t compose;         // Our cell of the CRTC
+
+    // Plane rects for the current frame geometry
+    geom_key_t geom;
+    drm_rect_t src;
+    drm_rect_t dst;
+
+    AVRational time_base;       // Decode thread, converted on entry
+    int in_discontinuity;       // Decode thread: next pts starts a new timeline
+    int64_t in_pts_offset;      // us, added to incoming pts
+    int64_t in_last_pts;        // us, after offset
+    int64_t in_last_delta;      // us, last frame to frame pts step
+
+    int anchored;
+    int64_t anchor_pts;         // us
+    int64_t anchor_time;        // us
+
+    unsigned int ano;
+    drm_aux_t aux[AUX_MAX];
+    drm_aux_t *aux_cur;         // On screen (adaptive)
+    drm_aux_t *aux_pending;     // Committed, flip not yet done (adaptive)
+
+    const void *fb_pool;        // Pool of the last frame we imported
+
+    AVFrame *next;              // Taken from q, waiting for its vblank
+    unsigned int next_gen;      // flush_gen when next was put
+    int64_t next_pts;           // Caller's pts of next
+    atomic_uint flush_gen;      // Bumped by drmprime_out_flush_port
+    frame_ring_t q;
+
+    int64_t rx_pending;         // Receive time of the frame in the flip in flight (0 = none)
+    int shown_pending;          // A frame of ours is in the flip in flight...
+    int64_t pts_pending;        // ...with this (caller's) pts
+} drm_port_t;
+
+// Receive to display latency, 1ms buckets
+#define LATENCY_BUCKETS 1000
+typedef struct latency_stats_s
+{
+    unsigned int n;
+    unsigned int dropped;       // Stale frames not shown
+    int64_t sum;
+    int64_t max;
+    unsigned int hist[LATENCY_BUCKETS];
+} latency_stats_t;
+
+// On screen display: a screen sized ARGB plane above the video, double
+// buffered in dumb buffers.  Updates go into the back buffer, which is
+// first brought up to date with whatever the last flip changed in the
+// front, and the back goes up with the next commit.
+typedef struct osd_buf_s
+{
+    uint32_t handle;            // Dumb buffer
+    uint32_t fb_id;
+    uint32_t pitch;
+    size_t size;
+    uint8_t *map;
+} osd_buf_t;
+
+typedef struct osd_s
+{
+    uint32_t plane_id;
+    const plane_props_t *props;
+    unsigned int width, height;
+    osd_buf_t bufs[2];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // Signalled when a flip of back completes
+    unsigned int back;          // Buffer updates go into
+    int dirty;                  // Back has changes not yet committed
+    int in_flight;              // Back is in the flip in flight
+    drm_rect_t damage;          // Changed in back since it was last committed
+    drm_rect_t stale;           // Newer in front than in back
+} osd_t;
+
+// Connector colour state: what the stream wants or what was last committed
+typedef struct hdr_state_s
+{
+    int64_t colorspace;         // Colorspace enum value (-1 = no prop)
+    int on;                     // HDR_OUTPUT_METADATA set
+    struct hdr_output_metadata md;
+} hdr_state_t;
+
+// Counters behind drmprime_out_get_stats; bumped from both the display
+// thread and the callers'
+typedef struct out_stats_s
+{
+    atomic_ullong received;
+    atomic_ullong displayed;
+    atomic_ullong dropped_policy;
+    atomic_ullong dropped_late;
+    atomic_ullong dropped_corrupt;
+    atomic_ullong dropped_flush;
+    atomic_ullong dropped_error;
+    atomic_ullong late_flips;
+    atomic_ullong missed_vblanks;
+    atomic_ullong vblank_wait_failures;
+    atomic_ullong import_failures;
+} out_stats_t;
+
 typedef struct drmprime_out_env_s
 {
     AVClass *class;
@@ -76,254 +528,2136 @@ typedef struct drmprime_out_env_s
     uint32_t con_id;
     struct drm_setup setup;
     enum AVPixelFormat avfmt;
-    int show_all;
-
-    unsigned int ano;
-    drm_aux_t aux[AUX_SIZE];
-
+    enum drmprime_out_policy_e policy;
+    enum drmprime_out_aspect_e aspect;
+    int no_flip;
+
+    // Atomic state
+    int use_atomic;
+    int flip_pending;
+
+    // Pacing
+    int pace;
+    int monotonic_ts;           // Flip event timestamps are CLOCK_MONOTONIC
+    drmprime_out_clock_fn *clock_fn;
+    void *clock_v;
+    int64_t last_vbl;           // us, time of last flip (0 = unknown)
+    int64_t commit_time;        // us, time of last atomic commit
+
+    // Low latency: frame->reordered_opaque is its receive time
+    int64_t latency_max;        // us, drop frames older than this (0 = off)
+    latency_stats_t latency;
+
+    unsigned int aux_size;
+    // Adaptive retention: frames are released as soon as the flip that
+    // replaces them completes rather than when the ring comes round
+    int aux_adaptive;
+
+    unsigned int fb_seq;
+    unsigned int fb_cache_size;
+    fb_ent_t *fb_cache;
+
+    unsigned int n_plane_caps;
+    plane_cap_t plane_caps[PLANE_CAPS_MAX];
+    unsigned int n_plane_memo;
+    plane_memo_t plane_memo[PLANE_MEMO_SIZE];
+
+    unsigned int nports;
+    drm_port_t *ports;
+
+    // Overlay planes leased to other outputs (drmprime_out_new_output)
+    pthread_mutex_t lease_lock;
+    unsigned int n_leased;
+    uint32_t leased_planes[LEASED_MAX];
+    // A lessee's lessor & the planes to give back to it on delete
+    drmprime_out_env_t *lessor;
+    unsigned int n_lent;
+    uint32_t lent_planes[LEASED_MAX];
+
+    // Display thread event loop: it polls the DRM fd for flip events,
+    // cons_efd for new frames and quit_efd for shutdown
     pthread_t q_thread;
-    sem_t q_sem_in;
-    sem_t q_sem_out;
-    int q_terminate;
-    AVFrame *q_next;
+    int quit_efd;
+    atomic_int cons_waiting;
+    int cons_efd;
+    int64_t hold_until;         // us, don't commit before this (after a failure)
+
+    // Our AVFrame shells, shared by all ports
+    frame_pool_t *frame_pool;
+
+    drmprime_out_presented_fn *presented_fn;
+    void *presented_v;
+
+    out_stats_t stats;
+    int64_t stats_period;       // us between reports (0 = none)
+    int64_t stats_next;         // us, time of the next report
+    int stats_json;
+    uint32_t forced_plane;      // Port 0 always uses this plane (0 = pick)
+
+    osd_t *osd;                 // NULL if none
+
+    // HDR metadata & output colorspace on the connector, taken from port 0's
+    // frames and committed only when they change.  Atomic only; prop ids
+    // 0 if the connector hasn't got them.
+    uint32_t hdr_md_id;         // HDR_OUTPUT_METADATA
+    uint32_t colorspace_id;     // Colorspace
+    int64_t colorspace_default;
+    int64_t colorspace_bt2020;
+    int hdr_failed;             // The driver turned it down - stop trying
+
+    // Explicit fencing (opts.fences)
+    int fences;
+    int fence_export;           // dma-buf sync_file export works
+    int fence_import;           // ...and import
+    uint32_t out_fence_id;      // CRTC OUT_FENCE_PTR prop, 0 if none
+    int32_t out_fence;          // Written by the commit, -1 if none
+    hdr_state_t hdr_want;
+    hdr_state_t hdr_cur;
+    uint32_t hdr_blob;          // Holding hdr_cur.md (0 = none)
 
 } drmprime_out_env_t;
 
 
-static int find_plane(const int drmfd, const int crtcidx, const uint32_t format,
-                      uint32_t *const pplane_id)
+// Find a property by name on a KMS object, returning its id and current value
+static int find_prop(const int drmfd, const uint32_t obj_id, const uint32_t obj_type,
+                     const char *const name, uint32_t *const pprop_id, uint64_t *const pvalue)
 {
-    drmModePlaneResPtr planes;
-    drmModePlanePtr plane;
+    drmModeObjectPropertiesPtr props;
     unsigned int i;
-    unsigned int j;
-    int ret = 0;
+    int ret = -1;
 
-    planes = drmModeGetPlaneResources(drmfd);
-    if (!planes) {
-        fprintf(stderr, "drmModeGetPlaneResources failed: %s\n", ERRSTR);
+    props = drmModeObjectGetProperties(drmfd, obj_id, obj_type);
+    if (!props) {
+        fprintf(stderr, "drmModeObjectGetProperties failed: %s\n", ERRSTR);
         return -1;
     }
 
-    for (i = 0; i < planes->count_planes; ++i) {
-        plane = drmModeGetPlane(drmfd, planes->planes[i]);
-        if (!planes) {
-            fprintf(stderr, "drmModeGetPlane failed: %s\n", ERRSTR);
+    for (i = 0; i != props->count_props; ++i) {
+        drmModePropertyPtr prop = drmModeGetProperty(drmfd, props->props[i]);
+        if (!prop)
+            continue;
+        if (strcmp(prop->name, name) == 0) {
+            if (pprop_id)
+                *pprop_id = prop->prop_id;
+            if (pvalue)
+                *pvalue = props->prop_values[i];
+            ret = 0;
+        }
+        drmModeFreeProperty(prop);
+        if (ret == 0)
+            break;
+    }
+
+    drmModeFreeObjectProperties(props);
+    return ret;
+}
+
+static int get_plane_props(const int drmfd, const uint32_t plane_id, plane_props_t *const pp)
+{
+    unsigned int i;
+
+    for (i = 0; i != FF_ARRAY_ELEMS(plane_prop_names); ++i) {
+        uint32_t *const pid = (uint32_t *)((char *)pp + plane_prop_names[i].offset);
+        if (find_prop(drmfd, plane_id, DRM_MODE_OBJECT_PLANE, plane_prop_names[i].name, pid, NULL) != 0) {
+            fprintf(stderr, "Plane %d has no %s property\n", plane_id, plane_prop_names[i].name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Value of the enum called name of a property, -1 if it hasn't got one
+static int64_t prop_enum_value(const int drmfd, const uint32_t prop_id, const char *const name)
+{
+    drmModePropertyPtr prop = drmModeGetProperty(drmfd, prop_id);
+    int64_t rv = -1;
+    int i;
+
+    if (prop == NULL)
+        return -1;
+    for (i = 0; i != prop->count_enums; ++i) {
+        if (strcmp(prop->enums[i].name, name) == 0) {
+            rv = prop->enums[i].value;
             break;
         }
+    }
+    drmModeFreeProperty(prop);
+    return rv;
+}
 
-        if (!(plane->possible_crtcs & (1 << crtcidx))) {
-            drmModeFreePlane(plane);
-            continue;
+static void plane_color_init(const int drmfd, const uint32_t plane_id, plane_color_t *const pc)
+{
+    unsigned int i;
+
+    memset(pc, 0, sizeof(*pc));
+    if (find_prop(drmfd, plane_id, DRM_MODE_OBJECT_PLANE, "COLOR_ENCODING", &pc->encoding_id, NULL) == 0) {
+        for (i = 0; i != COLOR_ENC_COUNT; ++i)
+            pc->encoding[i] = prop_enum_value(drmfd, pc->encoding_id, color_encoding_names[i]);
+    }
+    if (find_prop(drmfd, plane_id, DRM_MODE_OBJECT_PLANE, "COLOR_RANGE", &pc->range_id, NULL) == 0) {
+        pc->range[0] = prop_enum_value(drmfd, pc->range_id, "YCbCr limited range");
+        pc->range[1] = prop_enum_value(drmfd, pc->range_id, "YCbCr full range");
+    }
+}
+
+// Is the plane used by another port or leased to another output?
+static int plane_in_use(drmprime_out_env_t *const de, const drm_port_t *const port,
+                        const uint32_t plane_id)
+{
+    unsigned int i;
+    int rv = 0;
+
+    for (i = 0; i != de->nports; ++i) {
+        if (de->ports + i != port && de->ports[i].plane_id == plane_id)
+            return 1;
+    }
+    if (plane_id == de->forced_plane && port != de->ports)
+        return 1;
+
+    pthread_mutex_lock(&de->lease_lock);
+    for (i = 0; i != de->n_leased; ++i) {
+        if (de->leased_planes[i] == plane_id) {
+            rv = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&de->lease_lock);
+    return rv;
+}
+
+static void plane_caps_uninit(drmprime_out_env_t *const de)
+{
+    unsigned int i;
+
+    for (i = 0; i != de->n_plane_caps; ++i)
+        free(de->plane_caps[i].fmts);
+    de->n_plane_caps = 0;
+    de->n_plane_memo = 0;
+}
+
+// Read the format/modifier pairs from the IN_FORMATS blob, if there is one
+static int plane_cap_in_formats(const int drmfd, plane_cap_t *const pc)
+{
+    drmModePropertyBlobPtr blob;
+    const struct drm_format_modifier_blob *fmb;
+    const uint32_t *formats;
+    const struct drm_format_modifier *mods;
+    uint64_t blob_id;
+    unsigned int i, j, n = 0;
+
+    if (find_prop(drmfd, pc->plane_id, DRM_MODE_OBJECT_PLANE, "IN_FORMATS", NULL, &blob_id) != 0 ||
+        (blob = drmModeGetPropertyBlob(drmfd, blob_id)) == NULL)
+        return -1;
+
+    fmb = blob->data;
+    formats = (const uint32_t *)((const char *)fmb + fmb->formats_offset);
+    mods = (const struct drm_format_modifier *)((const char *)fmb + fmb->modifiers_offset);
+
+    for (i = 0; i != fmb->count_modifiers; ++i)
+        n += __builtin_popcountll(mods[i].formats);
+    if ((pc->fmts = calloc(n, sizeof(*pc->fmts))) == NULL) {
+        drmModeFreePropertyBlob(blob);
+        return -1;
+    }
+
+    // Each modifier has a 64-bit mask of formats starting at offset
+    for (i = 0; i != fmb->count_modifiers; ++i) {
+        for (j = 0; j != 64; ++j) {
+            if ((mods[i].formats & (1ULL << j)) == 0 || mods[i].offset + j >= fmb->count_formats)
+                continue;
+            pc->fmts[pc->n_fmts].format = formats[mods[i].offset + j];
+            pc->fmts[pc->n_fmts].modifier = mods[i].modifier;
+            ++pc->n_fmts;
         }
+    }
+    drmModeFreePropertyBlob(blob);
+    return 0;
+}
+
+// Build the table of what each plane on our CRTC can do.  Done once at init
+// so a format change on the display thread doesn't go to the kernel.
+static int plane_caps_init(drmprime_out_env_t *const de)
+{
+    drmModePlaneResPtr planes;
+    unsigned int i, j;
+
+    if ((planes = drmModeGetPlaneResources(de->drm_fd)) == NULL) {
+        fprintf(stderr, "drmModeGetPlaneResources failed: %s\n", ERRSTR);
+        return -1;
+    }
+
+    for (i = 0; i != planes->count_planes && de->n_plane_caps != PLANE_CAPS_MAX; ++i) {
+        drmModePlanePtr plane = drmModeGetPlane(de->drm_fd, planes->planes[i]);
+        plane_cap_t *const pc = de->plane_caps + de->n_plane_caps;
+        uint64_t val;
 
-        for (j = 0; j < plane->count_formats; ++j) {
-            if (plane->formats[j] == format) break;
+        if (plane == NULL) {
+            fprintf(stderr, "drmModeGetPlane failed: %s\n", ERRSTR);
+            continue;
+        }
+        if (!(plane->possible_crtcs & (1 << de->setup.crtcIdx))) {
+            drmModeFreePlane(plane);
+            continue;
         }
 
-        if (j == plane->count_formats) {
+        memset(pc, 0, sizeof(*pc));
+        pc->plane_id = plane->plane_id;
+
+        // No type prop => legacy => only overlays are listed
+        pc->type = DRM_PLANE_TYPE_OVERLAY;
+        if (find_prop(de->drm_fd, pc->plane_id, DRM_MODE_OBJECT_PLANE, "type", NULL, &val) == 0)
+            pc->type = val;
+        pc->zpos = -1;
+        if (find_prop(de->drm_fd, pc->plane_id, DRM_MODE_OBJECT_PLANE, "zpos", NULL, &val) == 0)
+            pc->zpos = val;
+        // KMS has no generic "can scale" - cursors are the ones that don't
+        pc->can_scale = pc->type != DRM_PLANE_TYPE_CURSOR;
+        plane_color_init(de->drm_fd, pc->plane_id, &pc->color);
+        if (de->use_atomic)
+            find_prop(de->drm_fd, pc->plane_id, DRM_MODE_OBJECT_PLANE, "IN_FENCE_FD", &pc->in_fence_id, NULL);
+
+        if (de->use_atomic &&
+            get_plane_props(de->drm_fd, pc->plane_id, &pc->props) != 0) {
             drmModeFreePlane(plane);
             continue;
         }
 
-        *pplane_id = plane->plane_id;
+        // Without IN_FORMATS we know the formats but nothing of modifiers
+        if (plane_cap_in_formats(de->drm_fd, pc) != 0) {
+            if ((pc->fmts = calloc(plane->count_formats, sizeof(*pc->fmts))) == NULL) {
+                drmModeFreePlane(plane);
+                continue;
+            }
+            for (j = 0; j != plane->count_formats; ++j) {
+                pc->fmts[j].format = plane->formats[j];
+                pc->fmts[j].modifier = DRM_FORMAT_MOD_INVALID;
+            }
+            pc->n_fmts = plane->count_formats;
+        }
+
         drmModeFreePlane(plane);
-        break;
+        ++de->n_plane_caps;
     }
 
-    if (i == planes->count_planes) ret = -1;
-
     drmModeFreePlaneResources(planes);
-    return ret;
+    return 0;
 }
 
-static void da_uninit(drmprime_out_env_t *const de, drm_aux_t *da)
+// How well does the plane fit format+modifier: 0 not at all, 1 format
+// listed but not with this modifier, 2 exact.  1 is still worth a try as
+// some modifiers carry parameters (e.g. SAND column height) that the
+// IN_FORMATS list only has one example of.
+static int plane_cap_match(const plane_cap_t *const pc, const uint32_t format, const uint64_t modifier)
+{
+    unsigned int i;
+    int rv = 0;
+
+    for (i = 0; i != pc->n_fmts; ++i) {
+        if (pc->fmts[i].format != format)
+            continue;
+        if (pc->fmts[i].modifier == modifier)
+            return 2;
+        rv = 1;
+    }
+    return rv;
+}
+
+// plane_cap_match, with planes that can be told the YCbCr encoding & range
+// ahead of those that can't (which would guess, typically BT.601 limited)
+static int plane_rank(const plane_cap_t *const pc, const uint32_t format, const uint64_t modifier)
+{
+    const int q = plane_cap_match(pc, format, modifier);
+    return q == 0 ? 0 : q * 2 + (pc->color.encoding_id != 0);
+}
+
+// Candidate planes for format+modifier best first.  Worked out once per
+// format and remembered.
+static const plane_memo_t *plane_memo_get(drmprime_out_env_t *const de,
+                                         const uint32_t format, const uint64_t modifier)
+{
+    plane_memo_t *pm;
+    unsigned int i, j;
+
+    for (i = 0; i != de->n_plane_memo; ++i) {
+        pm = de->plane_memo + i;
+        if (pm->format == format && pm->modifier == modifier)
+            return pm;
+    }
+
+    // Full - start again
+    if (de->n_plane_memo == PLANE_MEMO_SIZE)
+        de->n_plane_memo = 0;
+    pm = de->plane_memo + de->n_plane_memo++;
+    pm->format = format;
+    pm->modifier = modifier;
+    pm->n = 0;
+
+    for (i = 0; i != de->n_plane_caps; ++i) {
+        const plane_cap_t *const pc = de->plane_caps + i;
+        const int q = plane_rank(pc, format, modifier);
+
+        // With universal planes (implied by atomic) we also see the primary &
+        // cursor planes.  Stick to overlays so we don't take the primary's FB
+        // away from whoever owns it.
+        if (q == 0 || !pc->can_scale ||
+            (de->use_atomic && pc->type != DRM_PLANE_TYPE_OVERLAY))
+            continue;
+
+        // Insertion sort: better match first, then lowest zpos so the
+        // planes above are left for anything drawn over the video
+        for (j = pm->n; j != 0; --j) {
+            const plane_cap_t *const pc2 = de->plane_caps + pm->idx[j - 1];
+            const int q2 = plane_rank(pc2, format, modifier);
+            if (q2 > q || (q2 == q && pc2->zpos <= pc->zpos))
+                break;
+            pm->idx[j] = pm->idx[j - 1];
+        }
+        pm->idx[j] = i;
+        ++pm->n;
+    }
+    return pm;
+}
+
+static const plane_cap_t *find_plane(drmprime_out_env_t *const de, const drm_port_t *const port,
+                                     const uint32_t format, const uint64_t modifier)
 {
+    const plane_memo_t *const pm = plane_memo_get(de, format, modifier);
     unsigned int i;
 
-    if (da->fb_handle != 0) {
-        drmModeRmFB(de->drm_fd, da->fb_handle);
-        da->fb_handle = 0;
+    for (i = 0; i != pm->n; ++i) {
+        const plane_cap_t *const pc = de->plane_caps + pm->idx[i];
+        if (!plane_in_use(de, port, pc->plane_id))
+            return pc;
     }
+    return NULL;
+}
+
+static void fb_ent_close_bos(drmprime_out_env_t *const de, fb_ent_t *const fbe)
+{
+    unsigned int i, j, k;
 
+    // prime import gives the same GEM handle for the same dma-buf so another
+    // entry (same buffer, different geometry) may share our handles
     for (i = 0; i != AV_DRM_MAX_PLANES; ++i) {
-        if (da->bo_handles[i]) {
-            struct drm_gem_close gem_close = {.handle = da->bo_handles[i]};
+        const uint32_t h = fbe->bo_handles[i];
+
+        if (h == 0)
+            continue;
+        fbe->bo_handles[i] = 0;
+
+        for (j = 0; j != de->fb_cache_size; ++j) {
+            const fb_ent_t *const e = de->fb_cache + j;
+            if (e == fbe || e->fb_handle == 0)
+                continue;
+            for (k = 0; k != AV_DRM_MAX_PLANES; ++k) {
+                if (e->bo_handles[k] == h)
+                    break;
+            }
+            if (k != AV_DRM_MAX_PLANES)
+                break;
+        }
+
+        if (j == de->fb_cache_size) {
+            struct drm_gem_close gem_close = {.handle = h};
             drmIoctl(de->drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-            da->bo_handles[i] = 0;
         }
     }
+}
+
+static void fb_ent_free(drmprime_out_env_t *const de, fb_ent_t *const fbe)
+{
+    if (fbe->fb_handle == 0)
+        return;
+
+    drmModeRmFB(de->drm_fd, fbe->fb_handle);
+    fbe->fb_handle = 0;
+    fb_ent_close_bos(de, fbe);
+}
+
+// Is pool the current pool of any port?
+static int fb_pool_live(const drmprime_out_env_t *const de, const void *const pool)
+{
+    unsigned int i;
+
+    for (i = 0; i != de->nports; ++i) {
+        if (de->ports[i].fb_pool == pool)
+            return 1;
+    }
+    return 0;
+}
+
+// Free every unreferenced entry that doesn't belong to a current pool.
+// Entries still held by an aux slot go when that slot is released.
+static void fb_cache_evict_stale(drmprime_out_env_t *const de)
+{
+    unsigned int i;
+
+    for (i = 0; i != de->fb_cache_size; ++i) {
+        fb_ent_t *const fbe = de->fb_cache + i;
+        if (fbe->fb_handle != 0 && fbe->ref_count == 0 && !fb_pool_live(de, fbe->key.pool))
+            fb_ent_free(de, fbe);
+    }
+}
+
+static void fb_cache_flush(drmprime_out_env_t *const de)
+{
+    unsigned int i;
 
-    av_frame_free(&da->frame);
+    for (i = 0; i != de->fb_cache_size; ++i)
+        fb_ent_free(de, de->fb_cache + i);
 }
 
-static int do_display(drmprime_out_env_t *const de, AVFrame *frame)
+static int fb_key_make(fb_key_t *const key, const AVFrame *const frame)
 {
     const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
-    drm_aux_t *da = de->aux + de->ano;
-    const uint32_t format = desc->layers[0].format;
-    int ret = 0;
+    int i, j, n;
+
+    memset(key, 0, sizeof(*key));
 
-#if TRACE_ALL
-    fprintf(stderr, "<<< %s: fd=%d\n", __func__, desc->objects[0].fd);
-#endif
+    key->pool = frame->hw_frames_ctx == NULL ? NULL : frame->hw_frames_ctx->data;
+    key->format = desc->layers[0].format;
+    // Crop left & top are done with the plane src rect
+    key->width = frame->width - frame->crop_right;
+    key->height = frame->height - frame->crop_bottom;
 
-    if (de->setup.out_fourcc != format) {
-        if (find_plane(de->drm_fd, de->setup.crtcIdx, format, &de->setup.planeId)) {
-            av_frame_free(&frame);
-            fprintf(stderr, "No plane for format: %#x\n", format);
+    key->nb_objects = desc->nb_objects;
+    for (i = 0; i < desc->nb_objects; ++i) {
+        struct stat st;
+        if (fstat(desc->objects[i].fd, &st) != 0) {
+            fprintf(stderr, "fstat[%d](%d) failed: %s\n", i, desc->objects[i].fd, ERRSTR);
             return -1;
         }
-        de->setup.out_fourcc = format;
+        key->objects[i].dev = st.st_dev;
+        key->objects[i].ino = st.st_ino;
     }
 
-    {
-        drmVBlank vbl = {
-            .request = {
-                .type = DRM_VBLANK_RELATIVE,
-                .sequence = 0
+    n = 0;
+    for (i = 0; i < desc->nb_layers; ++i) {
+        for (j = 0; j < desc->layers[i].nb_planes; ++j) {
+            const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
+            const AVDRMObjectDescriptor *const obj = desc->objects + p->object_index;
+            if (n >= 4) {
+                fprintf(stderr, "Too many planes in DRM descriptor\n");
+                return -1;
             }
-        };
+            key->pitches[n] = p->pitch;
+            key->offsets[n] = p->offset;
+            key->modifiers[n] = obj->format_modifier;
+            ++n;
+        }
+    }
+    return 0;
+}
 
-        while (drmWaitVBlank(de->drm_fd, &vbl)) {
-            if (errno != EINTR) {
-// This always fails - don't know why
-//                fprintf(stderr, "drmWaitVBlank failed: %s\n", ERRSTR);
-                break;
+static int fb_ent_import(drmprime_out_env_t *const de, fb_ent_t *const fbe,
+                         const fb_key_t *const key, const AVFrame *const frame)
+{
+    const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
+    uint32_t bo_handles[4] = { 0 };
+    int i, j, n;
+
+    fbe->key = *key;
+    memset(fbe->bo_handles, 0, sizeof(fbe->bo_handles));
+    for (i = 0; i < desc->nb_objects; ++i) {
+        if (drmPrimeFDToHandle(de->drm_fd, desc->objects[i].fd, fbe->bo_handles + i) != 0) {
+            fprintf(stderr, "drmPrimeFDToHandle[%d](%d) failed: %s\n", i, desc->objects[i].fd, ERRSTR);
+            goto fail;
+        }
+    }
+
+    n = 0;
+    for (i = 0; i < desc->nb_layers; ++i) {
+        for (j = 0; j < desc->layers[i].nb_planes; ++j)
+            bo_handles[n++] = fbe->bo_handles[desc->layers[i].planes[j].object_index];
+    }
+
+    if (drmModeAddFB2WithModifiers(de->drm_fd,
+                                   key->width, key->height,
+                                   key->format, bo_handles,
+                                   key->pitches, key->offsets, key->modifiers,
+                                   &fbe->fb_handle, DRM_MODE_FB_MODIFIERS /** 0 if no mods */) != 0) {
+        fprintf(stderr, "drmModeAddFB2WithModifiers failed: %s\n", ERRSTR);
+        fbe->fb_handle = 0;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    fb_ent_close_bos(de, fbe);
+    return -1;
+}
+
+// Find the FB for this frame, importing it if we haven't seen it before
+static fb_ent_t *fb_cache_get(drmprime_out_env_t *const de, drm_port_t *const port,
+                              const AVFrame *const frame)
+{
+    fb_key_t key;
+    fb_ent_t *victim = NULL;
+    unsigned int i;
+
+    if (fb_key_make(&key, frame) != 0)
+        return NULL;
+
+    // New buffer pool (resolution change, new decoder etc.) - the old
+    // buffers will never come back so let go of them
+    if (key.pool != port->fb_pool) {
+        port->fb_pool = key.pool;
+        fb_cache_evict_stale(de);
+    }
+
+    for (i = 0; i != de->fb_cache_size; ++i) {
+        fb_ent_t *const fbe = de->fb_cache + i;
+
+        if (fbe->fb_handle == 0) {
+            if (victim == NULL || victim->fb_handle != 0)
+                victim = fbe;
+            continue;
+        }
+        if (memcmp(&fbe->key, &key, sizeof(key)) == 0) {
+            fbe->last_used = ++de->fb_seq;
+            return fbe;
+        }
+        if (fbe->ref_count == 0 &&
+            (victim == NULL || (victim->fb_handle != 0 && victim->last_used > fbe->last_used)))
+            victim = fbe;
+    }
+
+    if (victim == NULL) {
+        fprintf(stderr, "FB cache full\n");
+        return NULL;
+    }
+
+    fb_ent_free(de, victim);
+    if (fb_ent_import(de, victim, &key, frame) != 0)
+        return NULL;
+
+    victim->ref_count = 0;
+    victim->last_used = ++de->fb_seq;
+    return victim;
+}
+
+static void da_uninit(drmprime_out_env_t *const de, drm_aux_t *da)
+{
+    if (da->fb != NULL) {
+        fb_ent_t *const fbe = da->fb;
+        da->fb = NULL;
+        if (--fbe->ref_count == 0 && !fb_pool_live(de, fbe->key.pool))
+            fb_ent_free(de, fbe);
+    }
+
+    frame_pool_put(de->frame_pool, &da->frame);
+}
+
+static int64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Number of vblanks between the first one the commit could have made and
+// the one it actually landed on
+static int vbl_misses(const drmprime_out_env_t *const de, const int64_t vbl_time)
+{
+    const int64_t period = de->setup.vbl_period;
+    int64_t expected;
+
+    if (period <= 0 || de->last_vbl == 0 || vbl_time == 0 || de->commit_time < de->last_vbl)
+        return 0;
+    expected = de->last_vbl + ((de->commit_time - de->last_vbl) / period + 1) * period;
+    return vbl_time > expected + period / 2 ? (vbl_time - expected + period / 2) / period : 0;
+}
+
+// Give up on a flip event after this long
+#define FLIP_TIMEOUT_US 1000000
+
+static void latency_add(drmprime_out_env_t *const de, const int64_t rx, const int64_t shown)
+{
+    latency_stats_t *const ls = &de->latency;
+    const int64_t t = shown - rx;
+
+    if (de->latency_max == 0 || rx <= 0 || t < 0)
+        return;
+    ++ls->n;
+    ls->sum += t;
+    if (t > ls->max)
+        ls->max = t;
+    ++ls->hist[t / 1000 >= LATENCY_BUCKETS ? LATENCY_BUCKETS - 1 : t / 1000];
+}
+
+// Latency (ms) that per_mille of the shown frames were at or under
+static unsigned int latency_centile(const latency_stats_t *const ls, const unsigned int per_mille)
+{
+    const uint64_t want = ((uint64_t)ls->n * per_mille + 999) / 1000;
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i != LATENCY_BUCKETS - 1; ++i) {
+        if ((total += ls->hist[i]) >= want)
+            break;
+    }
+    return i + 1;
+}
+
+static void latency_report(const drmprime_out_env_t *const de)
+{
+    const latency_stats_t *const ls = &de->latency;
+
+    if (de->latency_max == 0)
+        return;
+    if (ls->n == 0) {
+        fprintf(stderr, "Latency: no frames with a receive time shown\n");
+        return;
+    }
+    fprintf(stderr, "Latency (receive to display): %u frames, mean %.1fms, "
+            "p50 <%ums, p95 <%ums, p99 <%ums, max %.1fms; %u stale frames dropped\n",
+            ls->n, (double)ls->sum / ls->n / 1000.0,
+            latency_centile(ls, 500), latency_centile(ls, 950), latency_centile(ls, 990),
+            (double)ls->max / 1000.0, ls->dropped);
+}
+
+static void stats_get(const drmprime_out_env_t *const de, drmprime_out_stats_t *const st)
+{
+    const out_stats_t *const os = &de->stats;
+
+    *st = (drmprime_out_stats_t) {
+        .received = atomic_load(&os->received),
+        .displayed = atomic_load(&os->displayed),
+        .dropped_policy = atomic_load(&os->dropped_policy),
+        .dropped_late = atomic_load(&os->dropped_late),
+        .dropped_corrupt = atomic_load(&os->dropped_corrupt),
+        .dropped_flush = atomic_load(&os->dropped_flush),
+        .dropped_error = atomic_load(&os->dropped_error),
+        .late_flips = atomic_load(&os->late_flips),
+        .missed_vblanks = atomic_load(&os->missed_vblanks),
+        .vblank_wait_failures = atomic_load(&os->vblank_wait_failures),
+        .import_failures = atomic_load(&os->import_failures),
+    };
+}
+
+// One line to stderr: text or a JSON object
+static void stats_report(const drmprime_out_env_t *const de, const int64_t now)
+{
+    drmprime_out_stats_t st;
+
+    stats_get(de, &st);
+    if (de->stats_json) {
+        fprintf(stderr, "{\"time_us\":%" PRId64 ",\"connector\":%u,\"received\":%" PRIu64
+                ",\"displayed\":%" PRIu64 ",\"dropped_policy\":%" PRIu64
+                ",\"dropped_late\":%" PRIu64 ",\"dropped_corrupt\":%" PRIu64
+                ",\"dropped_flush\":%" PRIu64 ",\"dropped_error\":%" PRIu64
+                ",\"late_flips\":%" PRIu64 ",\"missed_vblanks\":%" PRIu64
+                ",\"vblank_wait_failures\":%" PRIu64 ",\"import_failures\":%" PRIu64 "}\n",
+                now, de->con_id, st.received, st.displayed, st.dropped_policy,
+                st.dropped_late, st.dropped_corrupt, st.dropped_flush, st.dropped_error,
+                st.late_flips, st.missed_vblanks, st.vblank_wait_failures, st.import_failures);
+    }
+    else {
+        fprintf(stderr, "Display %u: received %" PRIu64 ", displayed %" PRIu64
+                ", dropped %" PRIu64 " policy %" PRIu64 " late %" PRIu64 " corrupt %" PRIu64
+                " flush %" PRIu64 " error; %" PRIu64 " late flips (%" PRIu64
+                " vblanks missed), %" PRIu64 " vblank wait fails, %" PRIu64 " import fails\n",
+                de->con_id, st.received, st.displayed, st.dropped_policy,
+                st.dropped_late, st.dropped_corrupt, st.dropped_flush, st.dropped_error,
+                st.late_flips, st.missed_vblanks, st.vblank_wait_failures, st.import_failures);
+    }
+}
+
+static int rect_empty(const drm_rect_t *const r)
+{
+    return r->width <= 0 || r->height <= 0;
+}
+
+// Smallest rect holding both a & b into a
+static void rect_union(drm_rect_t *const a, const drm_rect_t *const b)
+{
+    int x1, y1;
+
+    if (rect_empty(b))
+        return;
+    if (rect_empty(a)) {
+        *a = *b;
+        return;
+    }
+    x1 = FFMAX(a->x + a->width, b->x + b->width);
+    y1 = FFMAX(a->y + a->height, b->y + b->height);
+    a->x = FFMIN(a->x, b->x);
+    a->y = FFMIN(a->y, b->y);
+    a->width = x1 - a->x;
+    a->height = y1 - a->y;
+}
+
+static void osd_buf_uninit(drmprime_out_env_t *const de, osd_buf_t *const ob)
+{
+    if (ob->map != NULL)
+        munmap(ob->map, ob->size);
+    if (ob->fb_id != 0)
+        drmModeRmFB(de->drm_fd, ob->fb_id);
+    if (ob->handle != 0) {
+        struct drm_mode_destroy_dumb dreq = {.handle = ob->handle};
+        drmIoctl(de->drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+    }
+    memset(ob, 0, sizeof(*ob));
+}
+
+// A cleared (transparent) ARGB8888 dumb buffer with an FB
+static int osd_buf_init(drmprime_out_env_t *const de, osd_buf_t *const ob,
+                        const unsigned int width, const unsigned int height)
+{
+    struct drm_mode_create_dumb creq = {.width = width, .height = height, .bpp = 32};
+    struct drm_mode_map_dumb mreq = {0};
+    uint32_t handles[4] = {0};
+    uint32_t pitches[4] = {0};
+    uint32_t offsets[4] = {0};
+    void *map;
+
+    if (drmIoctl(de->drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) != 0) {
+        fprintf(stderr, "Failed to create OSD buffer: %s\n", ERRSTR);
+        return -1;
+    }
+    ob->handle = creq.handle;
+    ob->pitch = creq.pitch;
+    ob->size = creq.size;
+
+    handles[0] = ob->handle;
+    pitches[0] = ob->pitch;
+    if (drmModeAddFB2(de->drm_fd, width, height, DRM_FORMAT_ARGB8888,
+                      handles, pitches, offsets, &ob->fb_id, 0) != 0) {
+        fprintf(stderr, "drmModeAddFB2 failed for OSD: %s\n", ERRSTR);
+        goto fail;
+    }
+
+    mreq.handle = ob->handle;
+    if (drmIoctl(de->drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq) != 0 ||
+        (map = mmap(NULL, ob->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    de->drm_fd, mreq.offset)) == MAP_FAILED) {
+        fprintf(stderr, "Failed to map OSD buffer: %s\n", ERRSTR);
+        goto fail;
+    }
+    ob->map = map;
+    memset(ob->map, 0, ob->size);
+    return 0;
+
+fail:
+    osd_buf_uninit(de, ob);
+    return -1;
+}
+
+static void osd_uninit(drmprime_out_env_t *const de)
+{
+    osd_t *const osd = de->osd;
+
+    if (osd == NULL)
+        return;
+    osd_buf_uninit(de, osd->bufs + 0);
+    osd_buf_uninit(de, osd->bufs + 1);
+    pthread_cond_destroy(&osd->cond);
+    pthread_mutex_destroy(&osd->lock);
+    free(osd);
+    de->osd = NULL;
+}
+
+// Take the highest free overlay that can do ARGB so it is above the video
+// planes, which go for the lowest (see plane_memo_get).  Must be done
+// before any port takes a plane.
+static int osd_init(drmprime_out_env_t *const de)
+{
+    const plane_cap_t *best = NULL;
+    osd_t *osd;
+    unsigned int i;
+
+    for (i = 0; i != de->n_plane_caps; ++i) {
+        const plane_cap_t *const pc = de->plane_caps + i;
+
+        if (pc->type != DRM_PLANE_TYPE_OVERLAY ||
+            plane_cap_match(pc, DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_LINEAR) == 0 ||
+            plane_in_use(de, NULL, pc->plane_id))
+            continue;
+        if (best == NULL || pc->zpos >= best->zpos)
+            best = pc;
+    }
+    if (best == NULL) {
+        fprintf(stderr, "No free ARGB overlay plane for the OSD\n");
+        return -1;
+    }
+
+    if ((osd = calloc(1, sizeof(*osd))) == NULL)
+        return -1;
+    osd->plane_id = best->plane_id;
+    osd->props = &best->props;
+    osd->width = de->setup.compose.width;
+    osd->height = de->setup.compose.height;
+    pthread_mutex_init(&osd->lock, NULL);
+    pthread_cond_init(&osd->cond, NULL);
+    de->osd = osd;
+
+    if (osd_buf_init(de, osd->bufs + 0, osd->width, osd->height) != 0 ||
+        osd_buf_init(de, osd->bufs + 1, osd->width, osd->height) != 0) {
+        osd_uninit(de);
+        return -1;
+    }
+    return 0;
+}
+
+// Add the OSD to req if it has changed and isn't already on its way.
+// Returns 1 if it was added; pass that to osd_committed.
+static int osd_add(drmprime_out_env_t *const de, drmModeAtomicReqPtr req)
+{
+    osd_t *const osd = de->osd;
+    const plane_props_t *pp;
+    int add;
+
+    if (osd == NULL)
+        return 0;
+
+    // Updates wait while in_flight so back is ours until the flip is done
+    pthread_mutex_lock(&osd->lock);
+    if ((add = osd->dirty && !osd->in_flight) != 0) {
+        osd->dirty = 0;
+        osd->in_flight = 1;
+    }
+    pthread_mutex_unlock(&osd->lock);
+    if (!add)
+        return 0;
+
+    pp = osd->props;
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->fb_id, osd->bufs[osd->back].fb_id);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->crtc_id, de->setup.crtcId);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->src_x, 0);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->src_y, 0);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->src_w, osd->width << 16);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->src_h, osd->height << 16);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->crtc_x, de->setup.compose.x);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->crtc_y, de->setup.compose.y);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->crtc_w, osd->width);
+    drmModeAtomicAddProperty(req, osd->plane_id, pp->crtc_h, osd->height);
+    return 1;
+}
+
+// If the commit that osd_add added to failed try again with the next one
+static void osd_committed(drmprime_out_env_t *const de, const int added, const int ok)
+{
+    osd_t *const osd = de->osd;
+
+    if (!added || ok)
+        return;
+    pthread_mutex_lock(&osd->lock);
+    osd->dirty = 1;
+    osd->in_flight = 0;
+    pthread_cond_broadcast(&osd->cond);
+    pthread_mutex_unlock(&osd->lock);
+}
+
+// Back is on screen: swap
+static void osd_flip_done(drmprime_out_env_t *const de)
+{
+    osd_t *const osd = de->osd;
+
+    if (osd == NULL)
+        return;
+    pthread_mutex_lock(&osd->lock);
+    if (osd->in_flight) {
+        osd->in_flight = 0;
+        osd->back ^= 1;
+        osd->stale = osd->damage;
+        osd->damage = (drm_rect_t){0};
+        pthread_cond_broadcast(&osd->cond);
+    }
+    pthread_mutex_unlock(&osd->lock);
+}
+
+
+// Tell the owner what became of a frame: flip_time 0 if it was dropped
+static void presented(drmprime_out_env_t *const de, const drm_port_t *const port,
+                      const int64_t pts, const int64_t flip_time)
+{
+    drmprime_out_presented_t p;
+
+    if (de->presented_fn == NULL)
+        return;
+    p = (drmprime_out_presented_t) {
+        .port = port - de->ports,
+        .pts = pts,
+        .flip_time = flip_time,
+        .dropped = flip_time == 0,
+    };
+    de->presented_fn(de->presented_v, &p);
+}
+
+// Free a frame that will never be shown, counting it in *count.  pts is
+// the caller's.
+static void frame_dropped(drmprime_out_env_t *const de, const drm_port_t *const port,
+                          AVFrame **const pframe, const int64_t pts, atomic_ullong *const count)
+{
+    if (*pframe == NULL)
+        return;
+    atomic_fetch_add(count, 1);
+    presented(de, port, pts, 0);
+    frame_pool_put(de->frame_pool, pframe);
+}
+
+// The last commit is now on screen so whatever it replaced can go
+static void flip_done(drmprime_out_env_t *const de, const int64_t vbl_time)
+{
+    const int misses = vbl_misses(de, vbl_time);
+    const int64_t shown = vbl_time != 0 ? vbl_time : time_now_us();
+    unsigned int i;
+
+    for (i = 0; i != de->nports; ++i) {
+        drm_port_t *const port = de->ports + i;
+
+        latency_add(de, port->rx_pending, shown);
+        port->rx_pending = 0;
+        if (port->shown_pending) {
+            atomic_fetch_add(&de->stats.displayed, 1);
+            presented(de, port, port->pts_pending, shown);
+        }
+        port->shown_pending = 0;
+    }
+
+    if (misses != 0) {
+        atomic_fetch_add(&de->stats.late_flips, 1);
+        atomic_fetch_add(&de->stats.missed_vblanks, misses);
+        TRACE_INSTANT(TRACE_EV_VBLANK_MISS, misses);
+    }
+
+    de->flip_pending = 0;
+    osd_flip_done(de);
+    if (de->aux_adaptive) {
+        for (i = 0; i != de->nports; ++i) {
+            drm_port_t *const port = de->ports + i;
+
+            // Ports that weren't in the commit keep their current frame
+            if (port->aux_pending == NULL)
+                continue;
+            if (port->aux_cur != NULL)
+                da_uninit(de, port->aux_cur);
+            port->aux_cur = port->aux_pending;
+            port->aux_pending = NULL;
+        }
+    }
+    if (vbl_time != 0)
+        de->last_vbl = vbl_time;
+}
+
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+                              unsigned int tv_usec, void *user_data)
+{
+    drmprime_out_env_t *const de = user_data;
+    flip_done(de, de->monotonic_ts ?
+              (int64_t)tv_sec * 1000000 + tv_usec : time_now_us());
+}
+
+static int handle_drm_events(drmprime_out_env_t *const de)
+{
+    drmEventContext evctx = {
+        .version = 2,
+        .page_flip_handler = page_flip_handler,
+    };
+
+    if (drmHandleEvent(de->drm_fd, &evctx) != 0) {
+        fprintf(stderr, "drmHandleEvent failed: %s\n", ERRSTR);
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the last atomic commit to hit the screen
+static int wait_flip_done(drmprime_out_env_t *const de)
+{
+    while (de->flip_pending) {
+        struct pollfd pfd = {.fd = de->drm_fd, .events = POLLIN};
+        int rv = poll(&pfd, 1, FLIP_TIMEOUT_US / 1000);
+
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "poll failed: %s\n", ERRSTR);
+            return -1;
+        }
+        if (rv == 0) {
+            fprintf(stderr, "Timeout waiting for page flip\n");
+            flip_done(de, 0);
+            return -1;
+        }
+        if (handle_drm_events(de) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int frame_color_encoding(const AVFrame *const frame)
+{
+    switch (frame->colorspace) {
+        case AVCOL_SPC_BT709:
+            return COLOR_ENC_BT709;
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+            return COLOR_ENC_BT601;
+        case AVCOL_SPC_BT2020_NCL:
+        case AVCOL_SPC_BT2020_CL:
+            return COLOR_ENC_BT2020;
+        default:
+            break;
+    }
+    // Unspecified: guess from the size as players generally do
+    return frame->height > 576 ? COLOR_ENC_BT709 : COLOR_ENC_BT601;
+}
+
+// Work out the plane colour props for the frame about to go on port
+static void port_color_want(drm_port_t *const port, const AVFrame *const frame)
+{
+    const plane_color_t *const pc = &port->color;
+
+    port->enc_want = pc->encoding_id == 0 ? -1 : pc->encoding[frame_color_encoding(frame)];
+    port->range_want = pc->range_id == 0 ? -1 : pc->range[frame->color_range == AVCOL_RANGE_JPEG];
+}
+
+// Set whatever colour props have changed; in req if atomic, directly if
+// not.  Atomic failures are dealt with by atomic_commit.
+static void port_color_update(drmprime_out_env_t *const de, drmModeAtomicReqPtr req,
+                              drm_port_t *const port)
+{
+    if (port->enc_want >= 0 && port->enc_want != port->enc_cur) {
+        if (req != NULL)
+            drmModeAtomicAddProperty(req, port->plane_id, port->color.encoding_id, port->enc_want);
+        else if (drmModeObjectSetProperty(de->drm_fd, port->plane_id, DRM_MODE_OBJECT_PLANE,
+                                          port->color.encoding_id, port->enc_want) != 0)
+            fprintf(stderr, "Failed to set COLOR_ENCODING: %s\n", ERRSTR);
+        port->enc_cur = port->enc_want;
+    }
+    if (port->range_want >= 0 && port->range_want != port->range_cur) {
+        if (req != NULL)
+            drmModeAtomicAddProperty(req, port->plane_id, port->color.range_id, port->range_want);
+        else if (drmModeObjectSetProperty(de->drm_fd, port->plane_id, DRM_MODE_OBJECT_PLANE,
+                                          port->color.range_id, port->range_want) != 0)
+            fprintf(stderr, "Failed to set COLOR_RANGE: %s\n", ERRSTR);
+        port->range_cur = port->range_want;
+    }
+}
+
+// Read what the connector is set to now so that a stream that wants the
+// same never touches it
+static void hdr_init(drmprime_out_env_t *const de)
+{
+    uint64_t val = 0;
+
+    memset(&de->hdr_cur, 0, sizeof(de->hdr_cur));
+    de->hdr_cur.colorspace = -1;
+    if (find_prop(de->drm_fd, de->con_id, DRM_MODE_OBJECT_CONNECTOR, "Colorspace",
+                  &de->colorspace_id, &val) == 0 &&
+        (de->colorspace_default = prop_enum_value(de->drm_fd, de->colorspace_id, "Default")) >= 0) {
+        de->colorspace_bt2020 = prop_enum_value(de->drm_fd, de->colorspace_id, "BT2020_RGB");
+        if (de->colorspace_bt2020 < 0)
+            de->colorspace_bt2020 = de->colorspace_default;
+        de->hdr_cur.colorspace = val;
+    }
+    else
+        de->colorspace_id = 0;
+
+    // What is in a blob already there is unknown - it gets replaced by the
+    // first HDR frame or cleared by the first SDR one
+    if (find_prop(de->drm_fd, de->con_id, DRM_MODE_OBJECT_CONNECTOR, "HDR_OUTPUT_METADATA",
+                  &de->hdr_md_id, &val) == 0)
+        de->hdr_cur.on = val != 0;
+    de->hdr_want = de->hdr_cur;
+}
+
+// q in units of 1/scale
+static unsigned int q_scale(const AVRational q, const int64_t scale)
+{
+    return q.den == 0 ? 0 : av_rescale(q.num, scale, q.den);
+}
+
+// CTA-861.3 static metadata from the frame's transfer function & side data
+static void hdr_want_frame(drmprime_out_env_t *const de, const AVFrame *const frame)
+{
+    hdr_state_t *const h = &de->hdr_want;
+    struct hdr_metadata_infoframe *const inf = &h->md.hdmi_metadata_type1;
+    const AVFrameSideData *sd;
+    unsigned int i;
+
+    memset(h, 0, sizeof(*h));
+    h->colorspace = de->colorspace_id == 0 ? -1 :
+        frame->color_primaries == AVCOL_PRI_BT2020 ? de->colorspace_bt2020 : de->colorspace_default;
+
+    if (de->hdr_md_id == 0)
+        return;
+    if (frame->color_trc == AVCOL_TRC_SMPTE2084)
+        inf->eotf = 2;          // SMPTE ST 2084 (PQ)
+    else if (frame->color_trc == AVCOL_TRC_ARIB_STD_B67)
+        inf->eotf = 3;          // HLG
+    else
+        return;
+    h->on = 1;
+    h->md.metadata_type = 0;    // Static metadata type 1
+    inf->metadata_type = 0;
+
+    if ((sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA)) != NULL) {
+        const AVMasteringDisplayMetadata *const mdm = (const AVMasteringDisplayMetadata *)sd->data;
+        // The infoframe (like the HEVC SEI) has them G, B, R; we have R, G, B
+        static const unsigned int order[3] = {1, 2, 0};
+
+        if (mdm->has_primaries) {
+            for (i = 0; i != 3; ++i) {
+                inf->display_primaries[i].x = q_scale(mdm->display_primaries[order[i]][0], 50000);
+                inf->display_primaries[i].y = q_scale(mdm->display_primaries[order[i]][1], 50000);
+            }
+            inf->white_point.x = q_scale(mdm->white_point[0], 50000);
+            inf->white_point.y = q_scale(mdm->white_point[1], 50000);
+        }
+        if (mdm->has_luminance) {
+            inf->max_display_mastering_luminance = q_scale(mdm->max_luminance, 1);
+            inf->min_display_mastering_luminance = q_scale(mdm->min_luminance, 10000);
+        }
+    }
+    if ((sd = av_frame_get_side_data(frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL)) != NULL) {
+        const AVContentLightMetadata *const clm = (const AVContentLightMetadata *)sd->data;
+        inf->max_cll = FFMIN(clm->MaxCLL, 0xffff);
+        inf->max_fall = FFMIN(clm->MaxFALL, 0xffff);
+    }
+}
+
+// Add the connector props to req if they have changed.  Returns 1 if they
+// have (so the commit needs ALLOW_MODESET) with *pblob the new metadata
+// blob, if any.
+static int hdr_add(drmprime_out_env_t *const de, drmModeAtomicReqPtr req, uint32_t *const pblob)
+{
+    const hdr_state_t *const h = &de->hdr_want;
+
+    *pblob = 0;
+    if (de->hdr_failed || memcmp(h, &de->hdr_cur, sizeof(*h)) == 0)
+        return 0;
+
+    if (h->on && drmModeCreatePropertyBlob(de->drm_fd, &h->md, sizeof(h->md), pblob) != 0) {
+        fprintf(stderr, "Failed to create HDR metadata blob: %s\n", ERRSTR);
+        de->hdr_failed = 1;
+        return 0;
+    }
+    if (de->hdr_md_id != 0)
+        drmModeAtomicAddProperty(req, de->con_id, de->hdr_md_id, *pblob);
+    if (h->colorspace >= 0)
+        drmModeAtomicAddProperty(req, de->con_id, de->colorspace_id, h->colorspace);
+    return 1;
+}
+
+// A sync_file that signals once everything writing the frame's buffers
+// (e.g. the GPU) has finished, -1 if none can be had
+static int frame_in_fence(drmprime_out_env_t *const de, const AVFrame *const frame)
+{
+    const AVDRMFrameDescriptor *const desc = (const AVDRMFrameDescriptor *)frame->data[0];
+    int fence = -1;
+    int i;
+
+    for (i = 0; i != desc->nb_objects; ++i) {
+        struct dma_buf_export_sync_file es = {.flags = DMA_BUF_SYNC_READ, .fd = -1};
+        struct sync_merge_data md = {.name = "drmprime_out"};
+
+        if (ioctl(desc->objects[i].fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &es) != 0) {
+            if (errno == ENOTTY) {
+                fprintf(stderr, "dma-buf fence export not supported - no IN_FENCE_FD\n");
+                de->fence_export = 0;
+            }
+            goto fail;
+        }
+        if (fence == -1) {
+            fence = es.fd;
+            continue;
+        }
+        // One fence for all the objects
+        md.fd2 = es.fd;
+        md.fence = -1;
+        ioctl(fence, SYNC_IOC_MERGE, &md);
+        close(es.fd);
+        close(fence);
+        if ((fence = md.fence) == -1)
+            goto fail;
+    }
+    return fence;
+
+fail:
+    if (fence != -1)
+        close(fence);
+    return -1;
+}
+
+// Attach fence to the frame's buffers as a write so that whoever writes
+// them next waits for it
+static int frame_out_fence(drmprime_out_env_t *const de, const AVFrame *const frame, const int fence)
+{
+    const AVDRMFrameDescriptor *const desc = (const AVDRMFrameDescriptor *)frame->data[0];
+    int i;
+
+    for (i = 0; i != desc->nb_objects; ++i) {
+        struct dma_buf_import_sync_file is = {.flags = DMA_BUF_SYNC_WRITE, .fd = fence};
+
+        if (ioctl(desc->objects[i].fd, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &is) != 0) {
+            if (errno == ENOTTY) {
+                fprintf(stderr, "dma-buf fence import not supported - frames held until flip\n");
+                de->fence_import = 0;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// After a commit: the frames it takes off screen go back to their producer
+// now, rather than when the flip completes, with the commit's OUT_FENCE to
+// wait on before reusing them.  Their FBs are kept until the flip as usual.
+static void fences_release(drmprime_out_env_t *const de)
+{
+    unsigned int i;
+
+    if (de->out_fence == -1)
+        return;
+    for (i = 0; i != de->nports && de->fence_import; ++i) {
+        drm_port_t *const port = de->ports + i;
+        drm_aux_t *const da = port->aux_cur;
+
+        if (port->aux_pending == NULL || da == NULL || da->frame == NULL)
+            continue;
+        if (frame_out_fence(de, da->frame, de->out_fence) == 0)
+            frame_pool_put(de->frame_pool, &da->frame);
+    }
+    close(de->out_fence);
+    de->out_fence = -1;
+}
+
+// Add the plane update for one port to an atomic request
+static void atomic_add_port(drmprime_out_env_t *const de, drmModeAtomicReqPtr req,
+                            drm_port_t *const port, const uint32_t fb_handle,
+                            const AVFrame *const frame)
+{
+    const plane_props_t *const pp = &port->plane_props;
+    const uint32_t plane_id = port->plane_id;
+
+    if (port->old_plane_id != 0) {
+        plane_props_t opp;
+        if (get_plane_props(de->drm_fd, port->old_plane_id, &opp) == 0) {
+            drmModeAtomicAddProperty(req, port->old_plane_id, opp.fb_id, 0);
+            drmModeAtomicAddProperty(req, port->old_plane_id, opp.crtc_id, 0);
+        }
+    }
+
+    drmModeAtomicAddProperty(req, plane_id, pp->fb_id, fb_handle);
+    drmModeAtomicAddProperty(req, plane_id, pp->crtc_id, de->setup.crtcId);
+    drmModeAtomicAddProperty(req, plane_id, pp->src_x, port->src.x << 16);
+    drmModeAtomicAddProperty(req, plane_id, pp->src_y, port->src.y << 16);
+    drmModeAtomicAddProperty(req, plane_id, pp->src_w, port->src.width << 16);
+    drmModeAtomicAddProperty(req, plane_id, pp->src_h, port->src.height << 16);
+    drmModeAtomicAddProperty(req, plane_id, pp->crtc_x, port->dst.x);
+    drmModeAtomicAddProperty(req, plane_id, pp->crtc_y, port->dst.y);
+    drmModeAtomicAddProperty(req, plane_id, pp->crtc_w, port->dst.width);
+    drmModeAtomicAddProperty(req, plane_id, pp->crtc_h, port->dst.height);
+    port_color_update(de, req, port);
+
+    // Don't let the plane at the frame until it has been written
+    if (de->fence_export && port->in_fence_id != 0 &&
+        (port->in_fence = frame_in_fence(de, frame)) != -1)
+        drmModeAtomicAddProperty(req, plane_id, port->in_fence_id, port->in_fence);
+}
+
+// Commit everything in req in one go.  On success every port that had its
+// old plane turned off in req has that forgotten.
+static int atomic_commit(drmprime_out_env_t *const de, drmModeAtomicReqPtr req)
+{
+    uint32_t blob;
+    const int hdr = hdr_add(de, req, &blob);
+    unsigned int i;
+    int ret;
+
+    de->out_fence = -1;
+    if (de->out_fence_id != 0)
+        drmModeAtomicAddProperty(req, de->setup.crtcId, de->out_fence_id,
+                                 (uint64_t)(uintptr_t)&de->out_fence);
+
+    de->commit_time = time_now_us();
+    // Changing the infoframes may need the link retraining
+    ret = drmModeAtomicCommit(de->drm_fd, req,
+                              DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT |
+                              (hdr ? DRM_MODE_ATOMIC_ALLOW_MODESET : 0), de);
+    // The commit has its own refs to the in fences
+    for (i = 0; i != de->nports; ++i) {
+        if (de->ports[i].in_fence != -1) {
+            close(de->ports[i].in_fence);
+            de->ports[i].in_fence = -1;
+        }
+    }
+    if (ret != 0) {
+        ret = -errno;
+        fprintf(stderr, "drmModeAtomicCommit failed: %s\n", ERRSTR);
+        de->out_fence = -1;
+        if (blob != 0)
+            drmModeDestroyPropertyBlob(de->drm_fd, blob);
+        if (hdr) {
+            fprintf(stderr, "Leaving the connector HDR / colorspace alone\n");
+            de->hdr_failed = 1;
+        }
+        // Don't know what stuck
+        for (i = 0; i != de->nports; ++i) {
+            de->ports[i].enc_cur = -1;
+            de->ports[i].range_cur = -1;
+        }
+        return ret;
+    }
+
+    if (hdr) {
+        if (de->hdr_blob != 0)
+            drmModeDestroyPropertyBlob(de->drm_fd, de->hdr_blob);
+        de->hdr_blob = blob;
+        de->hdr_cur = de->hdr_want;
+    }
+    de->flip_pending = 1;
+    for (i = 0; i != de->nports; ++i)
+        de->ports[i].old_plane_id = 0;
+    return 0;
+}
+
+// Commit just the OSD when there is no frame to go with it.  Returns 1 if
+// a commit was made.
+static int osd_display(drmprime_out_env_t *const de, const int64_t now)
+{
+    drmModeAtomicReqPtr req;
+    int dirty;
+    int added;
+    int ret = -1;
+
+    if (de->osd == NULL)
+        return 0;
+    pthread_mutex_lock(&de->osd->lock);
+    dirty = de->osd->dirty && !de->osd->in_flight;
+    pthread_mutex_unlock(&de->osd->lock);
+    if (!dirty || (req = drmModeAtomicAlloc()) == NULL)
+        return 0;
+
+    if ((added = osd_add(de, req)) != 0)
+        ret = atomic_commit(de, req);
+    osd_committed(de, added, ret == 0);
+    fences_release(de);
+    drmModeAtomicFree(req);
+
+    if (added && ret != 0)
+        de->hold_until = now + (de->setup.vbl_period > 0 ? de->setup.vbl_period : 16667);
+    return added;
+}
+
+// Get the aux slot for the next frame.  Only valid once any previous flip
+// has completed.
+static drm_aux_t *aux_next(drmprime_out_env_t *const de, drm_port_t *const port)
+{
+    drm_aux_t *da;
+
+    if (de->aux_adaptive) {
+        unsigned int i;
+        // Only aux_cur can be in use here
+        for (i = 0; i != de->aux_size; ++i) {
+            if (port->aux + i != port->aux_cur)
+                return port->aux + i;
+        }
+    }
+
+    da = port->aux + port->ano;
+    port->ano = port->ano + 1 >= de->aux_size ? 0 : port->ano + 1;
+    return da;
+}
+
+// Hold frame (and its FB) in the next aux slot of port
+static drm_aux_t *aux_attach(drmprime_out_env_t *const de, drm_port_t *const port,
+                             AVFrame *const frame, fb_ent_t *const fbe)
+{
+    drm_aux_t *const da = aux_next(de, port);
+
+    da_uninit(de, da);
+    da->fb = fbe;
+    ++fbe->ref_count;
+    da->frame = frame;
+    return da;
+}
+
+// Make sure the port has a plane that can take format+modifier
+static int port_set_format(drmprime_out_env_t *const de, drm_port_t *const port,
+                           const uint32_t format, const uint64_t modifier)
+{
+    const uint32_t old_plane = port->plane_id;
+    const plane_cap_t *pc;
+
+    if (port->out_fourcc == format && port->out_modifier == modifier)
+        return 0;
+
+    if (port == de->ports && de->forced_plane != 0) {
+        unsigned int i;
+
+        pc = NULL;
+        for (i = 0; i != de->n_plane_caps; ++i) {
+            if (de->plane_caps[i].plane_id == de->forced_plane &&
+                plane_cap_match(de->plane_caps + i, format, modifier) != 0)
+                pc = de->plane_caps + i;
+        }
+        if (pc == NULL) {
+            fprintf(stderr, "Plane %u can't show format %#x, modifier %#" PRIx64 "\n",
+                    de->forced_plane, format, modifier);
+            return -1;
+        }
+    }
+    else if ((pc = find_plane(de, port, format, modifier)) == NULL) {
+        fprintf(stderr, "No plane for format: %#x, modifier %#" PRIx64 "\n", format, modifier);
+        return -1;
+    }
+    port->plane_id = pc->plane_id;
+    port->plane_props = pc->props;
+    port->color = pc->color;
+    port->in_fence_id = pc->in_fence_id;
+    port->enc_cur = -1;
+    port->range_cur = -1;
+    if (old_plane != 0 && old_plane != port->plane_id)
+        port->old_plane_id = old_plane;
+    port->out_fourcc = format;
+    port->out_modifier = modifier;
+    return 0;
+}
+
+// Work out the source & dest rects for the plane.  Only redone when the
+// frame geometry changes.
+static void port_geometry(drmprime_out_env_t *const de, drm_port_t *const port,
+                          const AVFrame *const frame)
+{
+    const drm_rect_t *const c = &port->compose;
+    geom_key_t key;
+    drm_rect_t src, dst;
+    int64_t dw, dh;     // Display size of the cropped frame in square pixels
+
+    memset(&key, 0, sizeof(key));
+    key.width = frame->width;
+    key.height = frame->height;
+    key.crop_left = frame->crop_left;
+    key.crop_top = frame->crop_top;
+    key.crop_right = frame->crop_right;
+    key.crop_bottom = frame->crop_bottom;
+    key.sar = frame->sample_aspect_ratio;
+    if (memcmp(&key, &port->geom, sizeof(key)) == 0)
+        return;
+    port->geom = key;
+
+    src = (drm_rect_t){
+        .x = frame->crop_left,
+        .y = frame->crop_top,
+        .width = av_frame_cropped_width(frame),
+        .height = av_frame_cropped_height(frame)
+    };
+    dst = *c;
+
+    dw = src.width;
+    dh = src.height;
+    if (key.sar.num > 0 && key.sar.den > 0)
+        dw = dw * key.sar.num / key.sar.den;
+    if (dw <= 0 || dh <= 0 || c->width <= 0 || c->height <= 0)
+        goto done;
+
+    switch (de->aspect) {
+        case DRMPRIME_OUT_ASPECT_FIT:
+            // Letterbox or pillarbox
+            if (dw * c->height > dh * c->width) {
+                dst.height = dh * c->width / dw;
+                dst.y = c->y + (c->height - dst.height) / 2;
+            }
+            else {
+                dst.width = dw * c->height / dh;
+                dst.x = c->x + (c->width - dst.width) / 2;
+            }
+            break;
+
+        case DRMPRIME_OUT_ASPECT_FILL:
+            // Crop the source to the cell's shape
+            if (dw * c->height > dh * c->width) {
+                const int w = (int64_t)src.width * dh * c->width / (dw * c->height);
+                src.x += (src.width - w) / 2;
+                src.width = w;
+            }
+            else {
+                const int h = (int64_t)src.height * dw * c->height / (dh * c->width);
+                src.y += (src.height - h) / 2;
+                src.height = h;
+            }
+            break;
+
+        case DRMPRIME_OUT_ASPECT_NATIVE:
+            // One frame pixel per screen pixel, centred, cropped if too big
+            if (src.width > c->width) {
+                src.x += (src.width - c->width) / 2;
+                src.width = c->width;
+            }
+            if (src.height > c->height) {
+                src.y += (src.height - c->height) / 2;
+                src.height = c->height;
+            }
+            dst.width = src.width;
+            dst.height = src.height;
+            dst.x = c->x + (c->width - dst.width) / 2;
+            dst.y = c->y + (c->height - dst.height) / 2;
+            break;
+
+        case DRMPRIME_OUT_ASPECT_STRETCH:
+        default:
+            break;
+    }
+
+done:
+    // Zero sized rects get rejected by the driver
+    if (dst.width < 1)
+        dst.width = 1;
+    if (dst.height < 1)
+        dst.height = 1;
+    if (src.width < 1)
+        src.width = 1;
+    if (src.height < 1)
+        src.height = 1;
+    port->src = src;
+    port->dst = dst;
+}
+
+// Find a plane for the frame & get its FB. Frees the frame (the caller's
+// pts is for reporting that) on failure.
+static fb_ent_t *port_import(drmprime_out_env_t *const de, drm_port_t *const port,
+                             AVFrame **const pframe, const int64_t pts)
+{
+    AVFrame *const frame = *pframe;
+    const AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
+    fb_ent_t *fbe;
+
+    if (!de->no_flip &&
+        port_set_format(de, port, desc->layers[0].format, desc->objects[0].format_modifier) != 0) {
+        frame_dropped(de, port, pframe, pts, &de->stats.dropped_error);
+        return NULL;
+    }
+
+    {
+        TRACE_BEGIN(t_import);
+        fbe = fb_cache_get(de, port, frame);
+        TRACE_END(TRACE_EV_FB_IMPORT, t_import, frame->pts);
+    }
+    if (fbe == NULL) {
+        atomic_fetch_add(&de->stats.import_failures, 1);
+        frame_dropped(de, port, pframe, pts, &de->stats.dropped_error);
+        return NULL;
+    }
+    port_geometry(de, port, frame);
+    port_color_want(port, frame);
+    // HDR is per connector: go with the first stream
+    if (port == de->ports && de->use_atomic)
+        hdr_want_frame(de, frame);
+    return fbe;
+}
+
+// pts is the caller's, for the presented callback
+static int do_display(drmprime_out_env_t *const de, drm_port_t *const port, AVFrame *frame,
+                      const int64_t pts)
+{
+    drm_aux_t *da;
+    fb_ent_t *fbe;
+    int64_t rx;
+    int ret = 0;
+
+    // Import (if we need to) before waiting so that any new buffer is ready
+    // to go as soon as the previous flip completes
+    if ((fbe = port_import(de, port, &frame, pts)) == NULL)
+        return -1;
+
+    // Benchmarking the import: hold the frame as if it had been displayed,
+    // but don't touch the plane
+    if (de->no_flip) {
+        atomic_fetch_add(&de->stats.displayed, 1);
+        presented(de, port, pts, time_now_us());
+        aux_attach(de, port, frame, fbe);
+        return 0;
+    }
+
+    // Atomic commits are only made once the last flip has completed (see
+    // display_thread); SetPlane has to wait for the vblank itself
+    if (!de->use_atomic) {
+        drmVBlank vbl = {
+            .request = {
+                .type = DRM_VBLANK_RELATIVE,
+                .sequence = 0
+            }
+        };
+
+        while (drmWaitVBlank(de->drm_fd, &vbl)) {
+            if (errno != EINTR) {
+                atomic_fetch_add(&de->stats.vblank_wait_failures, 1);
+// This always fails - don't know why
+//                fprintf(stderr, "drmWaitVBlank failed: %s\n", ERRSTR);
+                break;
+            }
+        }
+    }
+
+    rx = frame->reordered_opaque;
+    da = aux_attach(de, port, frame, fbe);
+
+    TRACE_BEGIN(t_commit);
+    if (de->use_atomic) {
+        drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+
+        if (req == NULL) {
+            ret = -ENOMEM;
+        }
+        else {
+            int osd;
+
+            atomic_add_port(de, req, port, fbe->fb_handle, frame);
+            osd = osd_add(de, req);
+            if ((ret = atomic_commit(de, req)) == 0) {
+                port->rx_pending = rx;
+                port->shown_pending = 1;
+                port->pts_pending = pts;
+            }
+            osd_committed(de, osd, ret == 0);
+            drmModeAtomicFree(req);
+        }
+        if (de->aux_adaptive) {
+            if (ret == 0)
+                port->aux_pending = da;
+            else
+                da_uninit(de, da);
+        }
+        fences_release(de);
+        if (ret != 0) {
+            atomic_fetch_add(&de->stats.dropped_error, 1);
+            presented(de, port, pts, 0);
+        }
+    }
+    else {
+        port_color_update(de, NULL, port);
+        ret = drmModeSetPlane(de->drm_fd, port->plane_id, de->setup.crtcId,
+                              fbe->fb_handle, 0,
+                              port->dst.x, port->dst.y,
+                              port->dst.width, port->dst.height,
+                              port->src.x << 16, port->src.y << 16,
+                              port->src.width << 16, port->src.height << 16);
+
+        if (ret != 0) {
+            fprintf(stderr, "drmModeSetPlane failed: %s\n", ERRSTR);
+        }
+        // SetPlane blocks until the vblank so this is a good enough guess
+        de->last_vbl = time_now_us();
+        if (ret == 0)
+            latency_add(de, rx, de->last_vbl);
+        atomic_fetch_add(ret == 0 ? &de->stats.displayed : &de->stats.dropped_error, 1);
+        presented(de, port, pts, ret == 0 ? de->last_vbl : 0);
+    }
+    TRACE_END(TRACE_EV_COMMIT, t_commit, pts);
+
+    return ret;
+}
+
+// Earliest vblank a commit made now can land on
+static int64_t next_vbl_time(const drmprime_out_env_t *const de, const int64_t now)
+{
+    const int64_t period = de->setup.vbl_period;
+
+    if (period <= 0)
+        return now;
+    if (de->last_vbl != 0 && de->last_vbl <= now)
+        return de->last_vbl + ((now - de->last_vbl) / period + 1) * period;
+    return now + period;
+}
+
+// Number of vblanks after next_vbl that the frame wants to be shown on,
+// <0 if it is already late
+static int64_t pace_vblanks(drmprime_out_env_t *const de, drm_port_t *const port,
+                            const AVFrame *const frame, const int64_t now, const int64_t next_vbl)
+{
+    const int64_t period = de->setup.vbl_period;
+    int64_t target;
+    int64_t n;
+
+    if (de->clock_fn != NULL) {
+        target = now + (frame->pts - de->clock_fn(de->clock_v));
+    }
+    else {
+        target = port->anchor_time + (frame->pts - port->anchor_pts);
+        // (Re)start the clock on the first frame and on any discontinuity
+        // (new file, seek, broken timestamps)
+        if (!port->anchored || target < now - 1000000 || target > now + 2000000) {
+            port->anchored = 1;
+            port->anchor_pts = frame->pts;
+            port->anchor_time = next_vbl;
+            target = next_vbl;
+        }
+    }
+
+    // Vblanks between the next one and the one nearest target
+    n = (target - next_vbl + period / 2);
+    return n < 0 ? -((period - 1 - n) / period) : n / period;
+}
+
+static int pace_active(const drmprime_out_env_t *const de, const AVFrame *const frame)
+{
+    return de->pace && !de->no_flip && frame->pts != AV_NOPTS_VALUE && de->setup.vbl_period > 0;
+}
+
+// A frame put before the last flush
+static int port_stale(drm_port_t *const port)
+{
+    return port->next_gen != atomic_load(&port->flush_gen);
+}
+
+// Display thread: the port's next frame, taking one off the queue if it
+// has none.  Frames put before the last flush are dropped; the generation
+// is stamped at put time as puts and flushes are both on the producer
+// thread.  *taken is set if the frame is newly off the queue.
+static AVFrame *port_next(drmprime_out_env_t *const de, drm_port_t *const port, int *const taken)
+{
+    *taken = 0;
+    if (port->next != NULL && port_stale(port))
+        frame_dropped(de, port, &port->next, port->next_pts, &de->stats.dropped_flush);
+    while (port->next == NULL) {
+        if ((port->next = ring_take(&port->q, &port->next_gen, &port->next_pts)) == NULL)
+            return NULL;
+        ring_kick(&port->q.prod_waiting, &port->q.prod_sem);
+        if (port_stale(port)) {
+            frame_dropped(de, port, &port->next, port->next_pts, &de->stats.dropped_flush);
+            continue;
+        }
+        *taken = 1;
+    }
+    return port->next;
+}
+
+// Pick the frame port should show on the coming vblank, NULL if it should
+// keep what it has.  Frames that are for an earlier vblank than we can now
+// hit are dropped if there is something newer to show; early ones are kept
+// in port->next for a later vblank.  *ppts gets the caller's pts.
+static AVFrame *pick_frame(drmprime_out_env_t *const de, drm_port_t *const port,
+                           const int64_t now, const int64_t next_vbl, int64_t *const ppts)
+{
+    AVFrame *frame;
+    int taken;
+
+    for (;;) {
+        if (port_next(de, port, &taken) == NULL)
+            return NULL;
+
+        // Low latency: skip frames that would already be too old when they
+        // got to the screen if there is something newer
+        if (de->latency_max != 0 && port->next->reordered_opaque > 0 &&
+            next_vbl - port->next->reordered_opaque > de->latency_max &&
+            !ring_empty(&port->q)) {
+            ++de->latency.dropped;
+            frame_dropped(de, port, &port->next, port->next_pts, &de->stats.dropped_late);
+            continue;
+        }
+
+        if (!pace_active(de, port->next))
+            break;
+        {
+            const int64_t n = pace_vblanks(de, port, port->next, now, next_vbl);
+            if (n > 0)
+                return NULL;
+            if (n == 0 || ring_empty(&port->q))
+                break;
+        }
+        frame_dropped(de, port, &port->next, port->next_pts, &de->stats.dropped_late);
+    }
+
+    // A flush may have come in while we looked
+    if (port_stale(port)) {
+        frame_dropped(de, port, &port->next, port->next_pts, &de->stats.dropped_flush);
+        return NULL;
+    }
+    frame = port->next;
+    port->next = NULL;
+    *ppts = port->next_pts;
+    return frame;
+}
+
+static int all_empty(const drmprime_out_env_t *const de)
+{
+    unsigned int i;
+
+    for (i = 0; i != de->nports; ++i) {
+        if (de->ports[i].next != NULL || !ring_empty(&de->ports[i].q))
+            return 0;
+    }
+    return 1;
+}
+
+// While a flip is pending take the next frame for each port off its queue
+// and import it so that it can be committed as soon as the flip completes
+static void preimport(drmprime_out_env_t *const de)
+{
+    unsigned int i;
+
+    for (i = 0; i != de->nports; ++i) {
+        drm_port_t *const port = de->ports + i;
+        int taken;
+
+        if (port_next(de, port, &taken) != NULL && taken)
+            port_import(de, port, &port->next, port->next_pts);
+    }
+}
+
+// Put whatever each port has that is due on screen.  With more than one
+// port everything goes in a single atomic commit.  Returns the number of
+// frames taken.
+static unsigned int display_due(drmprime_out_env_t *const de, const int64_t now, const int64_t next_vbl)
+{
+    const int64_t period = de->setup.vbl_period > 0 ? de->setup.vbl_period : 16667;
+    drmModeAtomicReqPtr req = NULL;
+    drm_aux_t *pending[PORTS_MAX] = {NULL};
+    int64_t rx[PORTS_MAX] = {0};
+    int64_t pts[PORTS_MAX] = {0};
+    unsigned int n = 0;
+    unsigned int i;
+
+    if (de->nports == 1) {
+        int64_t frame_pts;
+        AVFrame *const frame = pick_frame(de, de->ports, now, next_vbl, &frame_pts);
+
+        if (frame == NULL)
+            return 0;
+        // Without a flip to wait for don't spin
+        if (do_display(de, de->ports, frame, frame_pts) != 0)
+            de->hold_until = now + period;
+        return 1;
+    }
+
+    for (i = 0; i != de->nports; ++i) {
+        drm_port_t *const port = de->ports + i;
+        AVFrame *frame = pick_frame(de, port, now, next_vbl, pts + i);
+        fb_ent_t *fbe;
+
+        if (frame == NULL || (fbe = port_import(de, port, &frame, pts[i])) == NULL)
+            continue;
+
+        if (req == NULL && (req = drmModeAtomicAlloc()) == NULL) {
+            frame_dropped(de, port, &frame, pts[i], &de->stats.dropped_error);
+            continue;
+        }
+        atomic_add_port(de, req, port, fbe->fb_handle, frame);
+        rx[i] = frame->reordered_opaque;
+        pending[i] = aux_attach(de, port, frame, fbe);
+        ++n;
+    }
+
+    if (n == 0) {
+        drmModeAtomicFree(req);
+        return 0;
+    }
+
+    {
+        const int osd = osd_add(de, req);
+        TRACE_BEGIN(t_commit);
+        const int ret = atomic_commit(de, req);
+        TRACE_END(TRACE_EV_COMMIT, t_commit, n);
+
+        osd_committed(de, osd, ret == 0);
+
+        for (i = 0; i != de->nports; ++i) {
+            if (pending[i] == NULL)
+                continue;
+            if (ret == 0) {
+                de->ports[i].rx_pending = rx[i];
+                de->ports[i].shown_pending = 1;
+                de->ports[i].pts_pending = pts[i];
+            }
+            else {
+                atomic_fetch_add(&de->stats.dropped_error, 1);
+                presented(de, de->ports + i, pts[i], 0);
             }
+            if (!de->aux_adaptive)
+                continue;
+            if (ret == 0)
+                de->ports[i].aux_pending = pending[i];
+            else
+                da_uninit(de, pending[i]);
         }
+        fences_release(de);
+        if (ret != 0)
+            de->hold_until = now + period;
     }
+    drmModeAtomicFree(req);
+    return n;
+}
 
-    da_uninit(de, da);
+// Event loop: poll for a flip completing, a new frame or OSD update, quit or (if
+// something is waiting for it) the vblank that it is due on, then do
+// whatever can be done without blocking.  Frames already queued when quit
+// is signalled are still shown.
+static void* display_thread(void *v)
+{
+    drmprime_out_env_t *const de = v;
+    int quit = 0;
+    unsigned int i, j;
 
-    {
-        uint32_t pitches[4] = { 0 };
-        uint32_t offsets[4] = { 0 };
-        uint64_t modifiers[4] = { 0 };
-        uint32_t bo_handles[4] = { 0 };
-        int i, j, n;
-
-        da->frame = frame;
-
-        memset(da->bo_handles, 0, sizeof(da->bo_handles));
-        for (i = 0; i < desc->nb_objects; ++i) {
-            if (drmPrimeFDToHandle(de->drm_fd, desc->objects[i].fd, da->bo_handles + i) != 0) {
-                fprintf(stderr, "drmPrimeFDToHandle[%d](%d) failed: %s\n", i, desc->objects[i].fd, ERRSTR);
-                return -1;
+    for (;;) {
+        struct pollfd pfd[3] = {
+            {.fd = de->quit_efd, .events = POLLIN},
+            {.fd = de->cons_efd, .events = POLLIN},
+            {.fd = de->drm_fd, .events = POLLIN},
+        };
+        struct timespec ts;
+        const int64_t now = time_now_us();
+        int64_t wake = -1;      // us, -1 = wait for an event
+        eventfd_t ev;
+        int rv;
+
+        // Flag before looking at the queues so a put after we have looked
+        // still wakes us
+        atomic_store(&de->cons_waiting, 1);
+
+        if (de->flip_pending) {
+            preimport(de);
+            wake = de->commit_time + FLIP_TIMEOUT_US;
+            if (now >= wake) {
+                fprintf(stderr, "Timeout waiting for page flip\n");
+                flip_done(de, 0);
+                continue;
+            }
+        }
+        else if (now < de->hold_until) {
+            wake = de->hold_until;
+        }
+        else {
+            if (!all_empty(de)) {
+                const int64_t next_vbl = next_vbl_time(de, now);
+
+                if (display_due(de, now, next_vbl) != 0)
+                    continue;
+                // Something is queued but not yet due - look again next vblank
+                wake = next_vbl + 1000;
             }
+            // An OSD change with no frame to carry it goes up on its own
+            if (osd_display(de, now))
+                continue;
+            if (wake < 0 && quit)
+                break;
         }
 
-        n = 0;
-        for (i = 0; i < desc->nb_layers; ++i) {
-            for (j = 0; j < desc->layers[i].nb_planes; ++j) {
-                const AVDRMPlaneDescriptor *const p = desc->layers[i].planes + j;
-                const AVDRMObjectDescriptor *const obj = desc->objects + p->object_index;
-                pitches[n] = p->pitch;
-                offsets[n] = p->offset;
-                modifiers[n] = obj->format_modifier;
-                bo_handles[n] = da->bo_handles[p->object_index];
-                ++n;
+        if (de->stats_period != 0) {
+            if (now >= de->stats_next) {
+                stats_report(de, now);
+                de->stats_next = now + de->stats_period;
             }
+            if (wake < 0 || wake > de->stats_next)
+                wake = de->stats_next;
         }
 
-#if 1 && TRACE_ALL
-        fprintf(stderr, "%dx%d, fmt: %x, boh=%d,%d,%d,%d, pitch=%d,%d,%d,%d,"
-               " offset=%d,%d,%d,%d, mod=%llx,%llx,%llx,%llx\n",
-               av_frame_cropped_width(frame),
-               av_frame_cropped_height(frame),
-               desc->layers[0].format,
-               bo_handles[0],
-               bo_handles[1],
-               bo_handles[2],
-               bo_handles[3],
-               pitches[0],
-               pitches[1],
-               pitches[2],
-               pitches[3],
-               offsets[0],
-               offsets[1],
-               offsets[2],
-               offsets[3],
-               (long long)modifiers[0],
-               (long long)modifiers[1],
-               (long long)modifiers[2],
-               (long long)modifiers[3]
-              );
-#endif
-
-        if (drmModeAddFB2WithModifiers(de->drm_fd,
-                                       av_frame_cropped_width(frame),
-                                       av_frame_cropped_height(frame),
-                                       desc->layers[0].format, bo_handles,
-                                       pitches, offsets, modifiers,
-                                       &da->fb_handle, DRM_MODE_FB_MODIFIERS /** 0 if no mods */) != 0) {
-            fprintf(stderr, "drmModeAddFB2WithModifiers failed: %s\n", ERRSTR);
-            return -1;
+        if (wake >= 0) {
+            const int64_t dt = wake > now ? wake - now : 0;
+            ts.tv_sec = dt / 1000000;
+            ts.tv_nsec = (dt % 1000000) * 1000;
         }
-    }
 
-    ret = drmModeSetPlane(de->drm_fd, de->setup.planeId, de->setup.crtcId,
-                          da->fb_handle, 0,
-                          de->setup.compose.x, de->setup.compose.y,
-                          de->setup.compose.width,
-                          de->setup.compose.height,
-                          0, 0,
-                          av_frame_cropped_width(frame) << 16,
-                          av_frame_cropped_height(frame) << 16);
+        {
+            TRACE_BEGIN(t_wait);
+            rv = ppoll(pfd, de->flip_pending ? 3 : 2, wake >= 0 ? &ts : NULL, NULL);
+            TRACE_END(de->flip_pending ? TRACE_EV_FLIP_WAIT :
+                      wake >= 0 ? TRACE_EV_PACE : TRACE_EV_QUEUE_GET, t_wait, 0);
+        }
+        atomic_store(&de->cons_waiting, 0);
 
-    if (ret != 0) {
-        fprintf(stderr, "drmModeSetPlane failed: %s\n", ERRSTR);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ppoll failed: %s\n", ERRSTR);
+            break;
+        }
+        if ((pfd[0].revents & POLLIN) != 0) {
+            eventfd_read(de->quit_efd, &ev);
+            quit = 1;
+        }
+        if ((pfd[1].revents & POLLIN) != 0)
+            eventfd_read(de->cons_efd, &ev);
+        if ((pfd[2].revents & POLLIN) != 0)
+            handle_drm_events(de);
     }
 
-    de->ano = de->ano + 1 >= AUX_SIZE ? 0 : de->ano + 1;
+    // Don't pull FBs out from under a flip that is still in progress
+    if (de->use_atomic)
+        wait_flip_done(de);
 
-    return ret;
-}
+    for (i = 0; i != de->nports; ++i) {
+        drm_port_t *const port = de->ports + i;
 
-static int do_sem_wait(sem_t *const sem, const int nowait)
-{
-    while (nowait ? sem_trywait(sem) : sem_wait(sem)) {
-        if (errno != EINTR) return -errno;
+        frame_dropped(de, port, &port->next, port->next_pts, &de->stats.dropped_flush);
+        for (j = 0; j != de->aux_size; ++j)
+            da_uninit(de, port->aux + j);
+        port->aux_cur = NULL;
+        port->aux_pending = NULL;
     }
-    return 0;
+    fb_cache_flush(de);
+
+    return NULL;
 }
 
-static void* display_thread(void *v)
+// Indexed by DRM_MODE_CONNECTOR_xxx, names as the kernel uses them
+static const char *const connector_type_names[] = {
+    "Unknown", "VGA", "DVI-I", "DVI-D", "DVI-A", "Composite", "SVIDEO",
+    "LVDS", "Component", "DIN", "DP", "HDMI-A", "HDMI-B", "TV", "eDP",
+    "Virtual", "DSI", "DPI", "Writeback",
+};
+
+// name is either a connector id or <type>-<n> e.g. "HDMI-A-2"
+static int connector_matches(const drmModeConnector *const con, const char *const name)
 {
-    drmprime_out_env_t *const de = v;
-    int i;
+    char buf[32];
+    char *e;
+    const unsigned long id = strtoul(name, &e, 0);
 
-#if TRACE_ALL
-    fprintf(stderr, "<<< %s\n", __func__);
-#endif
+    if (*e == 0)
+        return id == con->connector_id;
+    if (con->connector_type >= FF_ARRAY_ELEMS(connector_type_names))
+        return 0;
+    snprintf(buf, sizeof(buf), "%s-%u",
+             connector_type_names[con->connector_type], con->connector_type_id);
+    return strcasecmp(buf, name) == 0;
+}
 
-    sem_post(&de->q_sem_out);
+// Find a named connector & the CRTC currently driving it.
+// We don't modeset so it has to be already active.
+static int find_connector(const int drmfd, const char *const name, struct drm_setup *const s)
+{
+    drmModeRes *res = drmModeGetResources(drmfd);
+    int ret = -1;
+    int i;
 
-    for (;;) {
-        AVFrame *frame;
+    if (!res) {
+        fprintf(stderr, "drmModeGetResources failed: %s\n", ERRSTR);
+        return -1;
+    }
 
-        do_sem_wait(&de->q_sem_in, 0);
+    for (i = 0; i < res->count_connectors; ++i) {
+        drmModeConnector *const con = drmModeGetConnector(drmfd, res->connectors[i]);
+        drmModeEncoder *enc;
 
-        if (de->q_terminate)
-            break;
+        if (con == NULL)
+            continue;
+        if (!connector_matches(con, name)) {
+            drmModeFreeConnector(con);
+            continue;
+        }
 
-        frame = de->q_next;
-        de->q_next = NULL;
-        sem_post(&de->q_sem_out);
+        s->conId = con->connector_id;
+        s->crtcId = 0;
+        if (con->encoder_id && (enc = drmModeGetEncoder(drmfd, con->encoder_id)) != NULL) {
+            s->crtcId = enc->crtc_id;
+            drmModeFreeEncoder(enc);
+        }
+        drmModeFreeConnector(con);
 
-        do_display(de, frame);
+        if (s->crtcId == 0)
+            fprintf(stderr, "Connector %s is not active\n", name);
+        else
+            ret = 0;
+        break;
     }
 
-#if TRACE_ALL
-    fprintf(stderr, ">>> %s\n", __func__);
-#endif
-
-    for (i = 0; i != AUX_SIZE; ++i)
-        da_uninit(de, de->aux + i);
-
-    av_frame_free(&de->q_next);
-
-    return NULL;
+    if (i == res->count_connectors)
+        fprintf(stderr, "Connector %s not found\n", name);
+    drmModeFreeResources(res);
+    return ret;
 }
 
 static int find_crtc(int drmfd, struct drm_setup *s, uint32_t *const pConId)
@@ -418,6 +2752,10 @@ static int find_crtc(int drmfd, struct drm_setup *s, uint32_t *const pConId)
         s->compose.y = crtc->y;
         s->compose.width = crtc->width;
         s->compose.height = crtc->height;
+        s->vbl_period = 0;
+        if (crtc->mode_valid && crtc->mode.clock != 0)
+            s->vbl_period = (int64_t)crtc->mode.htotal * crtc->mode.vtotal * 1000 /
+                crtc->mode.clock;
         drmModeFreeCrtc(crtc);
     }
 
@@ -433,104 +2771,645 @@ fail_res:
     return ret;
 }
 
-int drmprime_out_display(drmprime_out_env_t *de, struct AVFrame *src_frame)
+int drmprime_out_display_port(drmprime_out_env_t *de, unsigned int n, struct AVFrame *src_frame)
 {
+    drm_port_t *port;
     AVFrame *frame;
-    int ret;
+    int rv;
+
+    if (n >= de->nports) {
+        fprintf(stderr, "Bad display port %u\n", n);
+        return AVERROR(EINVAL);
+    }
+    port = de->ports + n;
 
+    atomic_fetch_add(&de->stats.received, 1);
     if ((src_frame->flags & AV_FRAME_FLAG_CORRUPT) != 0) {
         fprintf(stderr, "Discard corrupt frame: fmt=%d, ts=%" PRId64 "\n", src_frame->format, src_frame->pts);
+        atomic_fetch_add(&de->stats.dropped_corrupt, 1);
+        presented(de, port, src_frame->pts, 0);
         return 0;
     }
 
+    if (src_frame->format != AV_PIX_FMT_DRM_PRIME && src_frame->format != AV_PIX_FMT_VAAPI) {
+        fprintf(stderr, "Frame (format=%d) not DRM_PRiME\n", src_frame->format);
+        rv = AVERROR(EINVAL);
+        goto fail;
+    }
+    if ((frame = frame_pool_get(de->frame_pool)) == NULL) {
+        rv = AVERROR(ENOMEM);
+        goto fail;
+    }
     if (src_frame->format == AV_PIX_FMT_DRM_PRIME) {
-        frame = av_frame_alloc();
-        av_frame_ref(frame, src_frame);
-    } else if (src_frame->format == AV_PIX_FMT_VAAPI) {
-        frame = av_frame_alloc();
+        if ((rv = av_frame_ref(frame, src_frame)) != 0) {
+            fprintf(stderr, "Failed to ref frame: %s\n", av_err2str(rv));
+            goto fail_put;
+        }
+    } else {
         frame->format = AV_PIX_FMT_DRM_PRIME;
         if (av_hwframe_map(frame, src_frame, 0) != 0) {
             fprintf(stderr, "Failed to map frame (format=%d) to DRM_PRiME\n", src_frame->format);
-            av_frame_free(&frame);
-            return AVERROR(EINVAL);
+            rv = AVERROR(EINVAL);
+            goto fail_put;
         }
-    } else {
-        fprintf(stderr, "Frame (format=%d) not DRM_PRiME\n", src_frame->format);
-        return AVERROR(EINVAL);
     }
 
-    ret = do_sem_wait(&de->q_sem_out, !de->show_all);
-    if (ret) {
-        av_frame_free(&frame);
-    } else {
-        de->q_next = frame;
-        sem_post(&de->q_sem_in);
+    // Pacing works in us - convert while we still know the time_base
+    if (frame->pts != AV_NOPTS_VALUE && port->time_base.den != 0) {
+        int64_t pts = av_rescale_q(frame->pts, port->time_base, (AVRational){1, 1000000});
+
+        // Join the new timeline on to the end of the old one
+        if (port->in_discontinuity) {
+            port->in_discontinuity = 0;
+            port->in_pts_offset = port->in_last_pts == AV_NOPTS_VALUE ? 0 :
+                port->in_last_pts + port->in_last_delta - pts;
+        }
+        pts += port->in_pts_offset;
+
+        if (port->in_last_pts == AV_NOPTS_VALUE || pts > port->in_last_pts) {
+            if (port->in_last_pts != AV_NOPTS_VALUE && pts - port->in_last_pts < 1000000)
+                port->in_last_delta = pts - port->in_last_pts;
+            port->in_last_pts = pts;
+        }
+        frame->pts = pts;
+    }
+    else {
+        frame->pts = AV_NOPTS_VALUE;
     }
 
+    {
+        TRACE_BEGIN(t_put);
+        const int64_t pts = frame->pts;
+        int64_t dropped_pts = AV_NOPTS_VALUE;
+        AVFrame *dropped = ring_put(&port->q, frame, atomic_load(&port->flush_gen),
+                                    src_frame->pts, de->policy, &dropped_pts);
+        TRACE_END(TRACE_EV_QUEUE_PUT, t_put, pts);
+        frame_dropped(de, port, &dropped, dropped_pts, &de->stats.dropped_policy);
+    }
     return 0;
+
+fail_put:
+    frame_pool_put(de->frame_pool, &frame);
+fail:
+    // Still counted & reported like any other frame we don't show
+    atomic_fetch_add(&de->stats.dropped_error, 1);
+    presented(de, port, src_frame->pts, 0);
+    return rv;
 }
 
-void drmprime_out_delete(drmprime_out_env_t *de)
+int drmprime_out_display(drmprime_out_env_t *de, struct AVFrame *src_frame)
 {
-    de->q_terminate = 1;
-    sem_post(&de->q_sem_in);
-    pthread_join(de->q_thread, NULL);
-    sem_destroy(&de->q_sem_in);
-    sem_destroy(&de->q_sem_out);
+    return drmprime_out_display_port(de, 0, src_frame);
+}
+
+void drmprime_out_set_time_base_port(drmprime_out_env_t *de, unsigned int n, int num, int den)
+{
+    if (n < de->nports)
+        de->ports[n].time_base = (AVRational){num, den};
+}
+
+void drmprime_out_set_time_base(drmprime_out_env_t *de, int num, int den)
+{
+    drmprime_out_set_time_base_port(de, 0, num, den);
+}
+
+void drmprime_out_discontinuity_port(drmprime_out_env_t *de, unsigned int n)
+{
+    if (n < de->nports)
+        de->ports[n].in_discontinuity = 1;
+}
+
+void drmprime_out_discontinuity(drmprime_out_env_t *de)
+{
+    drmprime_out_discontinuity_port(de, 0);
+}
+
+void drmprime_out_flush_port(drmprime_out_env_t *de, unsigned int n)
+{
+    drm_port_t *port;
+    AVFrame *frame;
+    int64_t pts;
+
+    if (n >= de->nports)
+        return;
+    port = de->ports + n;
+
+    while ((frame = ring_take(&port->q, NULL, &pts)) != NULL)
+        frame_dropped(de, port, &frame, pts, &de->stats.dropped_flush);
+    atomic_fetch_add(&port->flush_gen, 1);
+    // Get the display thread to let go of anything it took before the flush
+    ring_kick_cons(&port->q);
+    port->in_discontinuity = 1;
+}
+
+void drmprime_out_flush(drmprime_out_env_t *de)
+{
+    drmprime_out_flush_port(de, 0);
+}
+
+int drmprime_out_osd_size(drmprime_out_env_t *de, unsigned int *w, unsigned int *h)
+{
+    if (de->osd == NULL)
+        return AVERROR(ENOSYS);
+    *w = de->osd->width;
+    *h = de->osd->height;
+    return 0;
+}
+
+int drmprime_out_osd_update(drmprime_out_env_t *de, int x, int y, int w, int h,
+                            const uint32_t *argb, unsigned int stride)
+{
+    osd_t *const osd = de->osd;
+    drm_rect_t r;
+    osd_buf_t *back;
+    const osd_buf_t *front;
+    int i;
+
+    if (osd == NULL)
+        return AVERROR(ENOSYS);
+
+    // Clip to the screen
+    if (x < 0) {
+        if (argb != NULL)
+            argb -= x;
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        if (argb != NULL)
+            argb = (const uint32_t *)((const uint8_t *)argb - (ptrdiff_t)y * stride);
+        h += y;
+        y = 0;
+    }
+    r = (drm_rect_t){x, y, FFMIN(w, (int)osd->width - x), FFMIN(h, (int)osd->height - y)};
+    if (rect_empty(&r))
+        return 0;
+
+    pthread_mutex_lock(&osd->lock);
+    // Back is being scanned out from the next vblank
+    while (osd->in_flight)
+        pthread_cond_wait(&osd->cond, &osd->lock);
+
+    back = osd->bufs + osd->back;
+    front = osd->bufs + (osd->back ^ 1);
+    // Catch up with the changes that went into front
+    for (i = 0; i < osd->stale.height; ++i)
+        memcpy(back->map + (osd->stale.y + i) * back->pitch + osd->stale.x * 4,
+               front->map + (osd->stale.y + i) * front->pitch + osd->stale.x * 4,
+               osd->stale.width * 4);
+    osd->stale = (drm_rect_t){0};
+
+    for (i = 0; i != r.height; ++i) {
+        uint8_t *const d = back->map + (r.y + i) * back->pitch + r.x * 4;
+        if (argb == NULL)
+            memset(d, 0, r.width * 4);
+        else
+            memcpy(d, (const uint8_t *)argb + (size_t)i * stride, r.width * 4);
+    }
+    rect_union(&osd->damage, &r);
+    osd->dirty = 1;
+    pthread_mutex_unlock(&osd->lock);
+
+    eventfd_write(de->cons_efd, 1);
+    return 0;
+}
+
+void drmprime_out_set_clock(drmprime_out_env_t *de, drmprime_out_clock_fn *fn, void *v)
+{
+    unsigned int i;
+
+    de->clock_v = v;
+    de->clock_fn = fn;
+    for (i = 0; i != de->nports; ++i)
+        de->ports[i].anchored = 0;
+}
+
+static void ports_uninit(drmprime_out_env_t *const de)
+{
+    unsigned int i;
+
+    for (i = 0; i != de->nports; ++i)
+        ring_uninit(&de->ports[i].q);
+    free(de->ports);
+    de->ports = NULL;
+}
+
+// Free planes that were leased to another output for the lessor to use
+static void lease_return(drmprime_out_env_t *const lessor,
+                         const uint32_t *const plane_ids, const unsigned int n)
+{
+    unsigned int i, j;
 
-    av_frame_free(&de->q_next);
+    pthread_mutex_lock(&lessor->lease_lock);
+    for (i = 0; i != n; ++i) {
+        for (j = 0; j != lessor->n_leased; ++j) {
+            if (lessor->leased_planes[j] == plane_ids[i]) {
+                lessor->leased_planes[j] = lessor->leased_planes[--lessor->n_leased];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lessor->lease_lock);
+}
 
+void drmprime_out_delete(drmprime_out_env_t *de)
+{
+    eventfd_write(de->quit_efd, 1);
+    pthread_join(de->q_thread, NULL);
+    latency_report(de);
+    if (de->stats_period != 0)
+        stats_report(de, time_now_us());
+    ports_uninit(de);
+    osd_uninit(de);
+    frame_pool_delete(&de->frame_pool);
+    if (de->hdr_blob != 0)
+        drmModeDestroyPropertyBlob(de->drm_fd, de->hdr_blob);
+    close(de->quit_efd);
+    close(de->cons_efd);
+
+    // Closing the lease fd ends the lease
     if (de->drm_fd >= 0) {
         close(de->drm_fd);
         de->drm_fd = -1;
     }
+    if (de->lessor != NULL)
+        lease_return(de->lessor, de->lent_planes, de->n_lent);
 
+    free(de->fb_cache);
+    plane_caps_uninit(de);
+    pthread_mutex_destroy(&de->lease_lock);
     free(de);
 }
 
-drmprime_out_env_t* drmprime_out_new()
+void drmprime_out_opts_default(drmprime_out_opts_t *const opts)
+{
+    *opts = (drmprime_out_opts_t) {
+        .legacy = 0,
+        .pace = 0,
+        .queue_depth = 1,
+        .policy = DRMPRIME_OUT_POLICY_BLOCK,
+        .retain = 0,
+        .retain_adaptive = 0,
+        .no_flip = 0,
+        .ports = 1,
+        .connector = NULL,
+        .aspect = DRMPRIME_OUT_ASPECT_STRETCH,
+        .latency_ms = 0,
+        .osd = 0,
+        .device = NULL,
+        .plane_id = 0,
+        .presented_fn = NULL,
+        .presented_v = NULL,
+        .stats_period = 0,
+        .stats_json = 0,
+        .fences = 0,
+    };
+}
+
+int drmprime_out_get_stats(drmprime_out_env_t *const de, drmprime_out_stats_t *const stats)
+{
+    stats_get(de, stats);
+    return 0;
+}
+
+// Frames retained per port with fixed retention: one on screen, one
+// waiting to go & (with retain > 2) some slop for drivers whose idea of
+// when a flip has happened is optimistic
+static unsigned int retain_size(const drmprime_out_opts_t *const opts)
+{
+    return opts->retain == 0 ? AUX_SIZE :
+        opts->retain < 2 ? 2 : opts->retain > AUX_MAX ? AUX_MAX : opts->retain;
+}
+
+unsigned int drmprime_out_frames_held(const drmprime_out_opts_t *opts)
+{
+    drmprime_out_opts_t def_opts;
+    unsigned int retain;
+
+    if (opts == NULL) {
+        drmprime_out_opts_default(&def_opts);
+        opts = &def_opts;
+    }
+    // As out_new: fences & adaptive retention only keep the two
+    retain = !opts->legacy && ((opts->fences && !opts->no_flip) || opts->retain_adaptive) ?
+        2 : retain_size(opts);
+    // + the one taken from the queue waiting for its vblank
+    return retain + (opts->queue_depth < 1 ? 1 : opts->queue_depth) + 1;
+}
+
+// Split the CRTC into a grid with a cell for each port
+static void ports_layout(drmprime_out_env_t *const de)
+{
+    const drm_rect_t *const c = &de->setup.compose;
+    unsigned int cols = 1;
+    unsigned int rows;
+    unsigned int i;
+
+    while (cols * cols < de->nports)
+        ++cols;
+    rows = (de->nports + cols - 1) / cols;
+
+    for (i = 0; i != de->nports; ++i) {
+        const unsigned int x = i % cols;
+        const unsigned int y = i / cols;
+        drm_rect_t *const r = &de->ports[i].compose;
+
+        r->x = c->x + c->width * x / cols;
+        r->y = c->y + c->height * y / rows;
+        r->width = c->x + c->width * (x + 1) / cols - r->x;
+        r->height = c->y + c->height * (y + 1) / rows - r->y;
+    }
+}
+
+// drm_fd is a lease fd to use (and own) or -1 to open the device
+static drmprime_out_env_t* out_new(const drmprime_out_opts_t *opts, const int drm_fd)
 {
     int rv;
+    unsigned int i;
+    drmprime_out_opts_t def_opts;
     drmprime_out_env_t* const de = calloc(1, sizeof(*de));
-    if (de == NULL)
+    if (de == NULL) {
+        if (drm_fd >= 0)
+            close(drm_fd);
         return NULL;
+    }
 
     const char *drm_module = DRM_MODULE;
 
-    de->drm_fd = -1;
+    if (opts == NULL) {
+        drmprime_out_opts_default(&def_opts);
+        opts = &def_opts;
+    }
+
+    de->drm_fd = drm_fd;
+    pthread_mutex_init(&de->lease_lock, NULL);
     de->con_id = 0;
     de->setup = (struct drm_setup) { 0 };
-    de->q_terminate = 0;
-    de->show_all = 1;
+    atomic_init(&de->cons_waiting, 0);
+    de->quit_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    de->cons_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    de->policy = opts->policy;
+    de->no_flip = opts->no_flip;
+    de->aspect = opts->aspect;
+    de->pace = opts->pace;
+    de->latency_max = (int64_t)opts->latency_ms * 1000;
+    de->presented_fn = opts->presented_fn;
+    de->presented_v = opts->presented_v;
+    de->forced_plane = opts->plane_id;
+    de->stats_period = (int64_t)opts->stats_period * 1000000;
+    de->stats_next = time_now_us() + de->stats_period;
+    de->stats_json = opts->stats_json;
+    de->nports = opts->ports < 1 ? 1 : opts->ports;
+
+    if (de->quit_efd < 0 || de->cons_efd < 0) {
+        rv = AVERROR(errno);
+        fprintf(stderr, "Failed to create eventfd: %s\n", av_err2str(rv));
+        goto fail_close;
+    }
+    if (de->nports > PORTS_MAX) {
+        fprintf(stderr, "Too many display ports: %u (max %d)\n", de->nports, PORTS_MAX);
+        goto fail_close;
+    }
+    // Enough for everything queued, held for scanout & in hand
+    if ((de->frame_pool = frame_pool_new(de->nports * (opts->queue_depth + AUX_MAX + 2))) == NULL)
+        goto fail_close;
+    de->fb_cache_size = FB_CACHE_SIZE * de->nports;
+    if ((de->fb_cache = calloc(de->fb_cache_size, sizeof(*de->fb_cache))) == NULL ||
+        (de->ports = calloc(de->nports, sizeof(*de->ports))) == NULL)
+        goto fail_close;
+    for (i = 0; i != de->nports; ++i) {
+        de->ports[i].in_last_pts = AV_NOPTS_VALUE;
+        de->ports[i].in_fence = -1;
+    }
+    de->out_fence = -1;
 
-    if ((de->drm_fd = drmOpen(drm_module, NULL)) < 0) {
+    if (de->drm_fd < 0 && opts->device != NULL) {
+        if ((de->drm_fd = open(opts->device, O_RDWR | O_CLOEXEC)) < 0) {
+            rv = AVERROR(errno);
+            fprintf(stderr, "Failed to open %s: %s\n", opts->device, av_err2str(rv));
+            goto fail_free;
+        }
+    }
+    else if (de->drm_fd < 0 && (de->drm_fd = drmOpen(drm_module, NULL)) < 0) {
         rv = AVERROR(errno);
         fprintf(stderr, "Failed to drmOpen %s: %s\n", drm_module, av_err2str(rv));
         goto fail_free;
     }
 
-    if (find_crtc(de->drm_fd, &de->setup, &de->con_id) != 0) {
+    // Atomic implies universal planes
+    if (!opts->legacy && drmSetClientCap(de->drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0)
+        de->use_atomic = 1;
+    else if (!opts->legacy)
+        fprintf(stderr, "Atomic modesetting not supported - using legacy SetPlane\n");
+
+    // All the planes have to change on the same vblank
+    if (de->nports > 1 && !de->use_atomic && !de->no_flip) {
+        fprintf(stderr, "Mosaic display needs atomic modesetting\n");
+        goto fail_close;
+    }
+
+    {
+        uint64_t cap = 0;
+        de->monotonic_ts = drmGetCap(de->drm_fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) == 0 && cap;
+    }
+
+    de->aux_size = retain_size(opts);
+    if (opts->fences) {
+        // The fences do the job of the retained frames
+        if (de->use_atomic && !de->no_flip) {
+            de->fences = 1;
+            de->fence_export = 1;
+            de->fence_import = 1;
+            de->aux_adaptive = 1;
+            de->aux_size = 2;
+        }
+        else
+            fprintf(stderr, "Fences need atomic - not used\n");
+    }
+    if (opts->retain_adaptive && !de->fences) {
+        if (de->use_atomic) {
+            de->aux_adaptive = 1;
+            de->aux_size = 2;
+        }
+        else
+            fprintf(stderr, "Adaptive retention needs atomic - using %d buffers\n", de->aux_size);
+    }
+
+    // A lease only has the one connector so the default finds it
+    if (drm_fd < 0 && opts->connector != NULL &&
+        find_connector(de->drm_fd, opts->connector, &de->setup) != 0) {
+        rv = AVERROR(EINVAL);
+        goto fail_close;
+    }
+
+    if (find_crtc(de->drm_fd, &de->setup, &de->con_id) != 0 && !de->no_flip) {
         fprintf(stderr, "failed to find valid mode\n");
         rv = AVERROR(EINVAL);
         goto fail_close;
     }
+    ports_layout(de);
+    if (de->use_atomic && !de->no_flip)
+        hdr_init(de);
+    if (de->fences &&
+        find_prop(de->drm_fd, de->setup.crtcId, DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR",
+                  &de->out_fence_id, NULL) != 0) {
+        fprintf(stderr, "CRTC has no OUT_FENCE_PTR - frames held until flip\n");
+        de->out_fence_id = 0;
+    }
+
+    if (!de->no_flip && plane_caps_init(de) != 0) {
+        rv = AVERROR(EINVAL);
+        goto fail_close;
+    }
+
+    // Without atomic we couldn't put the OSD up with the frame
+    if (opts->osd) {
+        if (!de->use_atomic || de->no_flip)
+            fprintf(stderr, "OSD needs atomic modesetting - no OSD\n");
+        else if (osd_init(de) != 0)
+            fprintf(stderr, "Failed to set up the OSD - no OSD\n");
+    }
+
+    for (i = 0; i != de->nports; ++i) {
+        if ((rv = ring_init(&de->ports[i].q, opts->queue_depth < 1 ? 1 : opts->queue_depth,
+                            &de->cons_waiting, de->cons_efd, de->frame_pool)) != 0) {
+            fprintf(stderr, "Failed to alloc frame queue\n");
+            goto fail_ring;
+        }
+    }
 
-    sem_init(&de->q_sem_in, 0, 0);
-    sem_init(&de->q_sem_out, 0, 0);
     if (pthread_create(&de->q_thread, NULL, display_thread, de)) {
         rv = AVERROR(errno);
         fprintf(stderr, "Failed to create display thread: %s\n", av_err2str(rv));
-        goto fail_close;
+        goto fail_ring;
     }
 
     return de;
 
+fail_ring:
+    ports_uninit(de);
+    osd_uninit(de);
 fail_close:
-    close(de->drm_fd);
+    if (de->drm_fd >= 0)
+        close(de->drm_fd);
     de->drm_fd = -1;
 fail_free:
+    plane_caps_uninit(de);
+    free(de->ports);
+    free(de->fb_cache);
+    if (de->quit_efd >= 0)
+        close(de->quit_efd);
+    if (de->cons_efd >= 0)
+        close(de->cons_efd);
+    frame_pool_delete(&de->frame_pool);
+    pthread_mutex_destroy(&de->lease_lock);
     free(de);
     fprintf(stderr, ">>> %s: FAIL\n", __func__);
     return NULL;
 }
 
+drmprime_out_env_t* drmprime_out_new(const drmprime_out_opts_t *opts)
+{
+    return out_new(opts, -1);
+}
+
+// Lease the connector, its CRTC & primary plane and enough overlays for
+// the ports to a new fd (so a new DRM master with its own event queue) and
+// build an output on that.
+drmprime_out_env_t* drmprime_out_new_output(drmprime_out_env_t *lessor, const drmprime_out_opts_t *opts)
+{
+    struct drm_setup s = { 0 };
+    uint32_t objs[2 + LEASED_MAX + 1];
+    uint32_t lent[LEASED_MAX];
+    unsigned int n = 0;
+    unsigned int n_overlay = 0;
+    unsigned int want;
+    unsigned int n_leased;
+    drmModePlaneResPtr planes;
+    drmprime_out_env_t *de;
+    uint32_t lessee_id;
+    unsigned int i;
+    int fd;
+
+    if (opts == NULL || opts->connector == NULL) {
+        fprintf(stderr, "Another output needs a connector\n");
+        return NULL;
+    }
+    if (find_connector(lessor->drm_fd, opts->connector, &s) != 0 ||
+        find_crtc(lessor->drm_fd, &s, NULL) != 0)
+        return NULL;
+    if (s.crtcId == lessor->setup.crtcId) {
+        fprintf(stderr, "Connector %s is on a CRTC already in use\n", opts->connector);
+        return NULL;
+    }
+
+    objs[n++] = s.conId;
+    objs[n++] = s.crtcId;
+
+    // One spare for format changes (and one for the OSD)
+    want = (opts->ports < 1 ? 1 : opts->ports) + 1 + (opts->osd ? 1 : 0);
+
+    if ((planes = drmModeGetPlaneResources(lessor->drm_fd)) == NULL) {
+        fprintf(stderr, "drmModeGetPlaneResources failed: %s\n", ERRSTR);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lessor->lease_lock);
+    n_leased = lessor->n_leased;
+    pthread_mutex_unlock(&lessor->lease_lock);
+
+    for (i = 0; i != planes->count_planes; ++i) {
+        const uint32_t plane_id = planes->planes[i];
+        drmModePlanePtr plane = drmModeGetPlane(lessor->drm_fd, plane_id);
+        uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+        uint64_t crtc_id = 0;
+
+        if (plane == NULL)
+            continue;
+        if (!(plane->possible_crtcs & (1 << s.crtcIdx))) {
+            drmModeFreePlane(plane);
+            continue;
+        }
+        drmModeFreePlane(plane);
+
+        find_prop(lessor->drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, "type", NULL, &type);
+        if (type == DRM_PLANE_TYPE_PRIMARY) {
+            // Only the one already on our CRTC
+            if (find_prop(lessor->drm_fd, plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", NULL, &crtc_id) == 0 &&
+                crtc_id == s.crtcId)
+                objs[n++] = plane_id;
+        }
+        else if (type == DRM_PLANE_TYPE_OVERLAY && n_overlay < want &&
+                 n_leased + n_overlay < LEASED_MAX && !plane_in_use(lessor, NULL, plane_id)) {
+            objs[n++] = plane_id;
+            lent[n_overlay++] = plane_id;
+        }
+    }
+    drmModeFreePlaneResources(planes);
+
+    if (n_overlay == 0) {
+        fprintf(stderr, "No free overlay planes for connector %s\n", opts->connector);
+        return NULL;
+    }
+
+    if ((fd = drmModeCreateLease(lessor->drm_fd, objs, n, O_CLOEXEC, &lessee_id)) < 0) {
+        fprintf(stderr, "drmModeCreateLease failed: %s\n", strerror(-fd));
+        return NULL;
+    }
+
+    // From now on our display thread won't touch these planes
+    pthread_mutex_lock(&lessor->lease_lock);
+    memcpy(lessor->leased_planes + lessor->n_leased, lent, n_overlay * sizeof(*lent));
+    lessor->n_leased += n_overlay;
+    pthread_mutex_unlock(&lessor->lease_lock);
+
+    // out_new closes the fd (so ends the lease) if it fails
+    if ((de = out_new(opts, fd)) == NULL) {
+        lease_return(lessor, lent, n_overlay);
+        return NULL;
+    }
+    de->lessor = lessor;
+    de->n_lent = n_overlay;
+    memcpy(de->lent_planes, lent, n_overlay * sizeof(*lent));
+    return de;
+}
@@ -1,7 +1,167 @@
+// libdrmprime_out: shows DRM_PRIME AVFrames on a KMS plane from its own
+// display thread.  Always fill in the options with
+// drmprime_out_opts_default first; new options are only ever added on the
+// end with defaults that keep the old behaviour.
+
+#include <stdint.h>
+
 struct AVFrame;
 typedef struct drmprime_out_env_s drmprime_out_env_t;
 
+// What became of a frame passed to drmprime_out_display
+typedef struct drmprime_out_presented_s {
+    unsigned int port;
+    int64_t pts;        // frame->pts as it was passed in
+    // When the flip that put it on screen completed (CLOCK_MONOTONIC us
+    // if the driver's flip events are, else the time we heard); 0 if
+    // dropped
+    int64_t flip_time;
+    int dropped;        // Never shown: queue policy, pacing, flush or error
+} drmprime_out_presented_t;
+
+// Called once for every frame.  Usually from the display thread, but frames
+// dropped by the queue policy or a flush are reported from the thread
+// that called display / flush.  Must not block or call back in.
+typedef void drmprime_out_presented_fn(void * v, const drmprime_out_presented_t * p);
+
+// What drmprime_out_display does when the display queue is full
+enum drmprime_out_policy_e {
+    DRMPRIME_OUT_POLICY_BLOCK = 0,  // Wait for space
+    DRMPRIME_OUT_POLICY_DROP_OLDEST,// Discard the oldest queued frame
+    DRMPRIME_OUT_POLICY_DROP_NEWEST,// Discard the frame being queued
+};
+
+// How the (cropped) frame is fitted to its screen area.  Fit & fill honour
+// sample_aspect_ratio; any scaling is done by the plane.
+enum drmprime_out_aspect_e {
+    DRMPRIME_OUT_ASPECT_STRETCH = 0,// Fill the area, ignoring aspect
+    DRMPRIME_OUT_ASPECT_FIT,        // Letterbox / pillarbox
+    DRMPRIME_OUT_ASPECT_FILL,       // Fill the area, cropping the frame
+    DRMPRIME_OUT_ASPECT_NATIVE,     // 1:1 pixels, centred
+};
+
+typedef struct drmprime_out_opts_s {
+    int legacy;         // Use drmModeSetPlane even if atomic is available
+    int pace;           // Present frames at their pts rather than asap
+    unsigned int queue_depth;  // Frames queued between decode & display
+    enum drmprime_out_policy_e policy;
+    // Number of frames (and so decoder buffers) held for scanout, 0 for
+    // default.  With retain_adaptive (atomic only) each frame is instead
+    // released as soon as the flip that replaces it has completed.
+    unsigned int retain;
+    int retain_adaptive;
+    int no_flip;        // Import FBs but never put them on a plane (bench)
+    // Number of streams (ports) to show at once, each on its own overlay
+    // plane in a grid on the one CRTC.  All planes are updated with a
+    // single atomic commit per vblank.  Default 1.
+    unsigned int ports;
+    // Connector to use: id or name as the kernel has it (e.g. "HDMI-A-2").
+    // It must already be active.  NULL for the first active one.
+    const char * connector;
+    enum drmprime_out_aspect_e aspect;
+    // Low latency: frame->reordered_opaque holds when the frame's data was
+    // received (CLOCK_MONOTONIC us, 0 if unknown).  Frames that would be
+    // more than this old by the time they are on screen are dropped if
+    // there is a newer one, and the receive to display latency is reported
+    // to stderr on delete.  0 (default) for off.
+    unsigned int latency_ms;
+    // Put a screen sized ARGB overlay plane above the video for subtitles /
+    // OSD (drmprime_out_osd_update).  Atomic only.
+    int osd;
+    // DRM device to open (e.g. /dev/dri/card1); NULL for the first vc4
+    const char * device;
+    // Plane for port 0 (0 to pick one that can show the frames)
+    uint32_t plane_id;
+    // Per frame feedback, NULL for none
+    drmprime_out_presented_fn * presented_fn;
+    void * presented_v;
+    // Print the drmprime_out_get_stats counters to stderr every stats_period
+    // seconds and on delete (0 = never), as one JSON object per line if
+    // stats_json
+    unsigned int stats_period;
+    int stats_json;
+    // Explicit sync (atomic only): each frame's plane waits on the fences of
+    // whatever is still writing its dma-bufs (IN_FENCE_FD) and frames going
+    // off screen are handed back as soon as they are committed with the
+    // flip's OUT_FENCE attached to their dma-bufs, rather than after the
+    // flip.  Only set if the producer waits for implicit fences before
+    // writing a buffer (GPU / VAAPI; V4L2 decoders don't).  Implies
+    // retain_adaptive.
+    int fences;
+} drmprime_out_opts_t;
+
+// Running totals since the output was opened, summed over its ports.
+// Every frame passed in is counted once in received and later once in
+// displayed or one of the dropped_* counters.
+typedef struct drmprime_out_stats_s {
+    uint64_t received;
+    uint64_t displayed;         // Flip with it in completed
+    uint64_t dropped_policy;    // Queue full (--queue-policy drop-*)
+    uint64_t dropped_late;      // Pacing or latency target
+    uint64_t dropped_corrupt;   // AV_FRAME_FLAG_CORRUPT
+    uint64_t dropped_flush;     // Flush or shutdown
+    uint64_t dropped_error;     // Import, alloc or commit failed
+    uint64_t late_flips;        // Flips that missed at least one vblank
+    uint64_t missed_vblanks;
+    uint64_t vblank_wait_failures;  // Legacy drmWaitVBlank
+    uint64_t import_failures;   // Frames that couldn't be made into an FB
+} drmprime_out_stats_t;
+
+// External master clock: returns the current media time in us, on the same
+// timeline as frame pts (after time_base conversion)
+typedef int64_t drmprime_out_clock_fn(void * v);
+
+// Fill in the default options
+void drmprime_out_opts_default(drmprime_out_opts_t * opts);
+
+// Time base of the pts of frames passed to drmprime_out_display
+void drmprime_out_set_time_base(drmprime_out_env_t * dpo, int num, int den);
+// The next frame's pts starts a new timeline (new file, seek); when pacing
+// it is shown straight after the last frame of the old one
+void drmprime_out_discontinuity(drmprime_out_env_t * dpo);
+// Drop every frame queued that hasn't yet been put on screen (seek) and
+// start a new timeline as with drmprime_out_discontinuity
+void drmprime_out_flush(drmprime_out_env_t * dpo);
+// Slave presentation to an external clock (e.g. audio). fn NULL to revert
+// to free-running from the first frame
+void drmprime_out_set_clock(drmprime_out_env_t * dpo, drmprime_out_clock_fn * fn, void * v);
+
 int drmprime_out_display(drmprime_out_env_t * dpo, struct AVFrame * frame);
+
+// As above for port n.  Each port has its own queue & timeline so may be
+// fed from its own thread; the plain versions use port 0.
+int drmprime_out_display_port(drmprime_out_env_t * dpo, unsigned int n, struct AVFrame * frame);
+void drmprime_out_set_time_base_port(drmprime_out_env_t * dpo, unsigned int n, int num, int den);
+void drmprime_out_discontinuity_port(drmprime_out_env_t * dpo, unsigned int n);
+void drmprime_out_flush_port(drmprime_out_env_t * dpo, unsigned int n);
+
+// OSD (opts.osd): copy a w x h ARGB8888 (premultiplied alpha) bitmap with
+// stride bytes per line to x,y on the OSD plane, or clear that rect to
+// transparent if argb is NULL.  The plane starts transparent and is only
+// committed (with the next frame, or on its own if none is due) when it
+// has changed.  May wait for the flip of the previous change.  Returns
+// AVERROR(ENOSYS) if there is no OSD.
+int drmprime_out_osd_update(drmprime_out_env_t * dpo, int x, int y, int w, int h,
+                            const uint32_t * argb, unsigned int stride);
+// Size of the OSD plane (the screen)
+int drmprime_out_osd_size(drmprime_out_env_t * dpo, unsigned int * w, unsigned int * h);
+
+// Snapshot of the counters (may be called from any thread)
+int drmprime_out_get_stats(drmprime_out_env_t * dpo, drmprime_out_stats_t * stats);
+
+// Most frames an output opened with opts holds on to per port at once:
+// queued, waiting for their vblank & retained for scanout.  For sizing
+// decoder buffer pools.  Assumes the device does atomic: if it doesn't,
+// fences and adaptive retention fall back to fixed retention and it holds
+// opts->retain (or the default) rather than two.
+unsigned int drmprime_out_frames_held(const drmprime_out_opts_t * opts);
+
 void drmprime_out_delete(drmprime_out_env_t * dpo);
-drmprime_out_env_t * drmprime_out_new();
+// opts may be NULL for defaults
+drmprime_out_env_t * drmprime_out_new(const drmprime_out_opts_t * opts);
+// Open another output (opts->connector, required) on the same device as dpo.
+// The connector, its CRTC and some planes are leased from dpo so the new
+// output has its own display thread and flip timing; frames may be shared
+// with dpo (clone) or not.  Delete it before dpo.
+drmprime_out_env_t * drmprime_out_new_output(drmprime_out_env_t * dpo, const drmprime_out_opts_t * opts);
 
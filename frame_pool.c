@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+// Recycles AVFrame shells - the AVFrame struct itself, not the buffers it
+// references - so that the per-frame paths don't go to malloc for them.
+// Frames are unref'd on the way back in.  Thread safe: frames are usually
+// got on the decode thread and put back on the display thread.
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <libavutil/frame.h>
+
+#include "frame_pool.h"
+
+struct frame_pool_s
+{
+    pthread_mutex_t lock;
+    unsigned int size;
+    unsigned int n;
+    AVFrame *frames[];
+};
+
+AVFrame *frame_pool_get(frame_pool_t *const fp)
+{
+    AVFrame *frame = NULL;
+
+    if (fp != NULL) {
+        pthread_mutex_lock(&fp->lock);
+        if (fp->n != 0)
+            frame = fp->frames[--fp->n];
+        pthread_mutex_unlock(&fp->lock);
+    }
+    return frame != NULL ? frame : av_frame_alloc();
+}
+
+void frame_pool_put(frame_pool_t *const fp, AVFrame **const pframe)
+{
+    AVFrame *frame = *pframe;
+
+    if (frame == NULL)
+        return;
+    *pframe = NULL;
+
+    if (fp != NULL) {
+        av_frame_unref(frame);
+        pthread_mutex_lock(&fp->lock);
+        if (fp->n < fp->size) {
+            fp->frames[fp->n++] = frame;
+            frame = NULL;
+        }
+        pthread_mutex_unlock(&fp->lock);
+    }
+    av_frame_free(&frame);
+}
+
+void frame_pool_delete(frame_pool_t **const pfp)
+{
+    frame_pool_t *const fp = *pfp;
+
+    if (fp == NULL)
+        return;
+    *pfp = NULL;
+
+    while (fp->n != 0)
+        av_frame_free(fp->frames + --fp->n);
+    pthread_mutex_destroy(&fp->lock);
+    free(fp);
+}
+
+frame_pool_t *frame_pool_new(const unsigned int size)
+{
+    frame_pool_t *const fp = calloc(1, sizeof(*fp) + size * sizeof(fp->frames[0]));
+
+    if (fp == NULL)
+        return NULL;
+    pthread_mutex_init(&fp->lock, NULL);
+    fp->size = size;
+    return fp;
+}
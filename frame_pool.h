@@ -0,0 +1,13 @@
+struct AVFrame;
+typedef struct frame_pool_s frame_pool_t;
+
+// A blank frame, from the pool if it has one.  fp may be NULL (plain
+// av_frame_alloc).
+struct AVFrame * frame_pool_get(frame_pool_t * fp);
+// Unref *pframe and keep it for reuse (freed if the pool is full).
+// *pframe is set to NULL; NULL frames are ignored.
+void frame_pool_put(frame_pool_t * fp, struct AVFrame ** pframe);
+
+void frame_pool_delete(frame_pool_t ** pfp);
+// Pool holds at most size spare frames
+frame_pool_t * frame_pool_new(unsigned int size);
@@ -32,28 +32,361 @@
  * frames from the HW video surfaces.
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+
+#include <drm_fourcc.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/adler32.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
 #include <libavutil/opt.h>
 #include <libavutil/avassert.h>
 #include <libavutil/imgutils.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 
+#include "bench.h"
+#include "demux.h"
+#include "drmprime_dump.h"
 #include "drmprime_out.h"
+#include "frame_pool.h"
+#include "probe_cache.h"
+#include "raw_src.h"
+#include "trace.h"
+#include "tune.h"
+#include "v4l2dec.h"
 
 static enum AVPixelFormat hw_pix_fmt;
 static FILE *output_file = NULL;
+static drmprime_dump_env_t *dump_env = NULL;
+static bench_env_t *bench_env = NULL;
 static long frames = 0;
+// Decode side AVFrames (shared by the mosaic threads)
+static frame_pool_t *frame_pool = NULL;
+// Live input: probe as little as possible and don't let the decoder delay
+static bool low_latency = false;
+static const char *probe_cache_name = NULL;
+
+// Decoder threads & buffers: -1 for the default (or --auto-tune)
+static int decode_threads = -1;
+static int decode_extra_frames = -1;
+static bool auto_tune = false;
+static unsigned int display_held = 0;   // Frames the outputs may hold at once
+
+// Seek & trick play
+static int64_t seek_skip_pts = AV_NOPTS_VALUE;  // Decoded frames before this aren't shown
+static unsigned int trick_speed = 1;            // >1 decodes & shows keyframes only
+static int64_t trick_base = AV_NOPTS_VALUE;     // pts trick play timing is relative to
+static bool wait_key = false;                   // Skip packets until a keyframe
+
+// OSD test: show the time of the frames decoded in the top left
+static bool osd_time = false;
+
+// --validate: inputs with no hw decoder are decoded in software
+static bool validate = false;
+
+// Extra outputs showing copies of everything shown on the main one
+#define OUTPUTS_MAX 4
+static drmprime_out_env_t * const *clone_envs = NULL;
+static unsigned int clone_count = 0;
 
 static AVFilterContext *buffersink_ctx = NULL;
 static AVFilterContext *buffersrc_ctx = NULL;
 static AVFilterGraph *filter_graph = NULL;
+// Filter to build on the first interlaced frame (NULL for none) and the
+// time base of the stream it will be fed
+static const char *filter_descr = NULL;
+static AVRational filter_tb = {0, 1};
+
+static int init_filters(const AVRational time_base,
+                        const AVCodecContext * const dec_ctx,
+                        const char * const filters_descr);
+
+// --deinterlace runs the filter graph on its own thread so that the
+// decoder and deinterlacer hardware work at the same time.  Decoded frames
+// are handed over in a small bounded queue; what comes out of the graph
+// goes to the outputs (which have their own bounded queues) from the
+// filter thread.
+#define FILTER_QUEUE_SIZE 4
+typedef struct filter_stage_s {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    AVFrame *q[FILTER_QUEUE_SIZE];  // NULL entry = end of stream
+    unsigned int q_get;
+    unsigned int q_n;
+    bool discard;                   // Stop now, dropping anything queued
+    bool done;                      // Thread has finished
+    int ret;                        // Thread error
+    drmprime_out_env_t *dpo;
+    unsigned int port;
+} filter_stage_t;
+
+static filter_stage_t filter_stage = {
+    .running = false,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int frame_out(drmprime_out_env_t * const dpo, const unsigned int port, AVFrame * const frame);
+
+// Pass *pframe (NULL for end of stream) to the filter thread, waiting
+// while its queue is full
+static int filter_queue(filter_stage_t * const fs, AVFrame ** const pframe)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->lock);
+    while (fs->q_n == FILTER_QUEUE_SIZE && !fs->done)
+        pthread_cond_wait(&fs->cond, &fs->lock);
+    if (fs->done) {
+        ret = fs->ret < 0 ? fs->ret : AVERROR_EOF;
+    }
+    else {
+        fs->q[(fs->q_get + fs->q_n++) % FILTER_QUEUE_SIZE] = *pframe;
+        *pframe = NULL;
+        pthread_cond_broadcast(&fs->cond);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+static void * filter_thread(void * v)
+{
+    filter_stage_t * const fs = v;
+    AVFrame *frame = NULL;
+    bool eos = false;
+    int ret = 0;
+
+    while (!eos && ret >= 0) {
+        AVFrame *in;
+
+        pthread_mutex_lock(&fs->lock);
+        while (fs->q_n == 0 && !fs->discard)
+            pthread_cond_wait(&fs->cond, &fs->lock);
+        if (fs->discard) {
+            pthread_mutex_unlock(&fs->lock);
+            break;
+        }
+        in = fs->q[fs->q_get];
+        fs->q_get = (fs->q_get + 1) % FILTER_QUEUE_SIZE;
+        --fs->q_n;
+        pthread_cond_broadcast(&fs->cond);
+        pthread_mutex_unlock(&fs->lock);
+
+        TRACE_BEGIN(t_filter);
+        // NULL flushes the graph
+        ret = av_buffersrc_add_frame_flags(buffersrc_ctx, in, 0);
+        frame_pool_put(frame_pool, &in);
+        if (ret < 0) {
+            fprintf(stderr, "Error while feeding the filtergraph\n");
+            break;
+        }
+
+        for (;;) {
+            if (frame == NULL && (frame = frame_pool_get(frame_pool)) == NULL) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            ret = av_buffersink_get_frame(buffersink_ctx, frame);
+            if (ret == AVERROR(EAGAIN)) {
+                ret = 0;
+                break;
+            }
+            if (ret == AVERROR_EOF) {
+                eos = true;
+                ret = 0;
+                break;
+            }
+            if (ret < 0) {
+                fprintf(stderr, "Failed to get frame: %s", av_err2str(ret));
+                break;
+            }
+            TRACE_END(TRACE_EV_FILTER, t_filter, frame->pts);
+
+            ret = frame_out(fs->dpo, fs->port, frame);
+            av_frame_unref(frame);
+            if (ret < 0)
+                break;
+        }
+    }
+    frame_pool_put(frame_pool, &frame);
+
+    pthread_mutex_lock(&fs->lock);
+    fs->done = true;
+    fs->ret = ret;
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->lock);
+    return NULL;
+}
+
+// Finish with the filter graph: everything queued is either put through
+// it and out (drain) or dropped.  The graph is then freed; it is built
+// again on the next interlaced frame.
+static void filter_stop(filter_stage_t * const fs, const bool drain)
+{
+    if (fs->running) {
+        AVFrame *eos = NULL;
+
+        if (drain) {
+            filter_queue(fs, &eos);
+        }
+        else {
+            pthread_mutex_lock(&fs->lock);
+            fs->discard = true;
+            pthread_cond_broadcast(&fs->cond);
+            pthread_mutex_unlock(&fs->lock);
+        }
+        pthread_join(fs->thread, NULL);
+        fs->running = false;
+
+        while (fs->q_n != 0) {
+            frame_pool_put(frame_pool, fs->q + fs->q_get);
+            fs->q_get = (fs->q_get + 1) % FILTER_QUEUE_SIZE;
+            --fs->q_n;
+        }
+    }
+    avfilter_graph_free(&filter_graph);
+}
+
+// Build the filter graph, switch the outputs to its time base and start
+// the filter thread
+static int filter_start(const AVCodecContext * const avctx,
+                        drmprime_out_env_t * const dpo, const unsigned int port)
+{
+    filter_stage_t * const fs = &filter_stage;
+    AVRational tb;
+    unsigned int i;
+
+    if (init_filters(filter_tb, avctx, filter_descr) < 0) {
+        fprintf(stderr, "Failed to init deinterlace\n");
+        avfilter_graph_free(&filter_graph);
+        return -1;
+    }
+
+    fs->dpo = dpo;
+    fs->port = port;
+    fs->q_get = 0;
+    fs->q_n = 0;
+    fs->discard = false;
+    fs->done = false;
+    fs->ret = 0;
+    if (pthread_create(&fs->thread, NULL, filter_thread, fs) != 0) {
+        fprintf(stderr, "Failed to start filter thread\n");
+        avfilter_graph_free(&filter_graph);
+        return -1;
+    }
+    fs->running = true;
+
+    tb = av_buffersink_get_time_base(buffersink_ctx);
+    if (dpo != NULL)
+        drmprime_out_set_time_base_port(dpo, port, tb.num, tb.den);
+    for (i = 0; i != clone_count; ++i)
+        drmprime_out_set_time_base_port(clone_envs[i], port, tb.num, tb.den);
+    return 0;
+}
+
+// 3x5 pixel digits and ':' - each row is 3 bits, msb on the left
+static const uint8_t osd_font[11][5] = {
+    {7, 5, 5, 5, 7}, {2, 6, 2, 2, 7}, {7, 1, 7, 4, 7}, {7, 1, 7, 1, 7},
+    {5, 5, 7, 1, 1}, {7, 4, 7, 1, 7}, {7, 4, 7, 5, 7}, {7, 1, 1, 1, 1},
+    {7, 5, 7, 5, 7}, {7, 5, 7, 1, 7}, {0, 2, 0, 2, 0},
+};
+#define OSD_SCALE 8
+#define OSD_CHARS 5     // mm:ss
+#define OSD_W ((OSD_CHARS * 4 + 1) * OSD_SCALE)
+#define OSD_H (7 * OSD_SCALE)
+
+// Draw pts as mm:ss on the OSD of every output; only redrawn when the
+// second changes
+static void osd_time_show(drmprime_out_env_t * const dpo, const int64_t pts, const AVRational tb)
+{
+    static uint32_t bitmap[OSD_H * OSD_W];
+    static int64_t last = -1;
+    const int64_t t = pts == AV_NOPTS_VALUE ? -1 : av_rescale_q(pts, tb, (AVRational){1, 1});
+    char str[OSD_CHARS + 1];
+    unsigned int c, x, y;
+
+    if (t < 0 || t == last)
+        return;
+    last = t;
+    snprintf(str, sizeof(str), "%02d:%02d", (int)(t / 60 % 100), (int)(t % 60));
+
+    // Translucent black box with a 1 cell border
+    for (x = 0; x != OSD_H * OSD_W; ++x)
+        bitmap[x] = 0x80000000;
+    for (c = 0; c != OSD_CHARS; ++c) {
+        const uint8_t * const glyph = osd_font[str[c] == ':' ? 10 : str[c] - '0'];
+        for (y = 0; y != 5 * OSD_SCALE; ++y) {
+            uint32_t * const row = bitmap + (y + OSD_SCALE) * OSD_W + (c * 4 + 1) * OSD_SCALE;
+            for (x = 0; x != 3 * OSD_SCALE; ++x) {
+                if ((glyph[y / OSD_SCALE] & (4 >> x / OSD_SCALE)) != 0)
+                    row[x] = 0xffffffff;
+            }
+        }
+    }
+
+    if (dpo != NULL)
+        drmprime_out_osd_update(dpo, 32, 32, OSD_W, OSD_H, bitmap, OSD_W * 4);
+    for (c = 0; c != clone_count; ++c)
+        drmprime_out_osd_update(clone_envs[c], 32, 32, OSD_W, OSD_H, bitmap, OSD_W * 4);
+}
+
+// A stateful V4L2 decoder (h264_v4l2m2m) ignores extra_hw_frames; its
+// buffer counts are private options instead
+static bool is_v4l2m2m(const AVCodecContext * const ctx)
+{
+    return ctx->codec != NULL && ctx->codec->priv_class != NULL &&
+        av_opt_find(ctx->priv_data, "num_capture_buffers", NULL, 0, 0) != NULL;
+}
+
+// Thread count & extra frames for a new decoder: --threads / --hw-frames,
+// else --auto-tune, else the defaults.  -1 if --auto-tune finds the stream
+// won't fit in CMA.
+static int decoder_tune(AVCodecContext * const ctx, const AVCodecParameters * const par)
+{
+    tune_t t = {.threads = 3};
+    int extra = -1;
+
+    if (auto_tune) {
+        if (tune_decode(&t, par, display_held, low_latency) != 0)
+            return -1;
+    }
+    // Frame threading adds a frame of delay per thread
+    else if (low_latency)
+        t.threads = 1;
+
+    ctx->thread_count = decode_threads > 0 ? decode_threads : t.threads;
+    if (decode_extra_frames >= 0)
+        extra = decode_extra_frames;
+    else if (auto_tune)
+        extra = t.extra_frames;
+    if (extra < 0)
+        return 0;
+
+    if (!is_v4l2m2m(ctx)) {
+        ctx->extra_hw_frames = extra;
+        return 0;
+    }
+    // Its counts are totals: the references as well as the extras
+    av_opt_set_int(ctx->priv_data, "num_capture_buffers", tune_dpb_frames(par) + extra, 0);
+    if (auto_tune)
+        av_opt_set_int(ctx->priv_data, "num_output_buffers", t.v4l2_out, 0);
+    return 0;
+}
 
 static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type)
 {
@@ -70,13 +403,15 @@ static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type)
     return err;
 }
 
+// ctx->opaque points at the wanted format
 static enum AVPixelFormat get_hw_format(AVCodecContext *ctx,
                                         const enum AVPixelFormat *pix_fmts)
 {
+    const enum AVPixelFormat want = *(const enum AVPixelFormat *)ctx->opaque;
     const enum AVPixelFormat *p;
 
     for (p = pix_fmts; *p != -1; p++) {
-        if (*p == hw_pix_fmt)
+        if (*p == want)
             return *p;
     }
 
@@ -84,266 +419,1670 @@ static enum AVPixelFormat get_hw_format(AVCodecContext *ctx,
     return AV_PIX_FMT_NONE;
 }
 
-static int decode_write(AVCodecContext * const avctx,
-                        drmprime_out_env_t * const dpo,
-                        AVPacket *packet)
+// Send a finished (decoded & filtered) frame to the outputs, the dump
+// and -o.  The frame is left for the caller to free.
+static int frame_out(drmprime_out_env_t * const dpo, const unsigned int port, AVFrame * const frame)
 {
-    AVFrame *frame = NULL, *sw_frame = NULL;
+    AVFrame *sw_frame = NULL;
     uint8_t *buffer = NULL;
     int size;
     int ret = 0;
     unsigned int i;
 
-    ret = avcodec_send_packet(avctx, packet);
+    if (osd_time)
+        osd_time_show(dpo, frame->pts, filter_graph != NULL ?
+                      av_buffersink_get_time_base(buffersink_ctx) : filter_tb);
+
+    // Trick play: show the keyframes speed times faster than their pts
+    if (trick_speed > 1 && frame->pts != AV_NOPTS_VALUE) {
+        if (trick_base == AV_NOPTS_VALUE)
+            trick_base = frame->pts;
+        frame->pts = trick_base + (frame->pts - trick_base) / trick_speed;
+    }
+
+    if (dpo != NULL)
+        drmprime_out_display_port(dpo, port, frame);
+    for (i = 0; i != clone_count; ++i)
+        drmprime_out_display_port(clone_envs[i], port, frame);
+
+    if (dump_env != NULL &&
+        (ret = drmprime_dump_frame(dump_env, frame)) < 0)
+        goto fail;
+
+    if (output_file != NULL) {
+        AVFrame *tmp_frame;
+
+        if (frame->format == hw_pix_fmt) {
+            if ((sw_frame = frame_pool_get(frame_pool)) == NULL) {
+                fprintf(stderr, "Can not alloc frame\n");
+                ret = AVERROR(ENOMEM);
+                goto fail;
+            }
+            /* retrieve data from GPU to CPU */
+            if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0) {
+                fprintf(stderr, "Error transferring the data to system memory\n");
+                goto fail;
+            }
+            tmp_frame = sw_frame;
+        } else
+            tmp_frame = frame;
+
+        size = av_image_get_buffer_size(tmp_frame->format, tmp_frame->width,
+                                        tmp_frame->height, 1);
+        buffer = av_malloc(size);
+        if (!buffer) {
+            fprintf(stderr, "Can not alloc buffer\n");
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        ret = av_image_copy_to_buffer(buffer, size,
+                                      (const uint8_t * const *)tmp_frame->data,
+                                      (const int *)tmp_frame->linesize, tmp_frame->format,
+                                      tmp_frame->width, tmp_frame->height, 1);
+        if (ret < 0) {
+            fprintf(stderr, "Can not copy image to buffer\n");
+            goto fail;
+        }
+
+        if ((ret = fwrite(buffer, 1, size, output_file)) < 0) {
+            fprintf(stderr, "Failed to dump raw data.\n");
+            goto fail;
+        }
+        ret = 0;
+    }
+
+fail:
+    frame_pool_put(frame_pool, &sw_frame);
+    av_freep(&buffer);
+    return ret;
+}
+
+static int decode_write(AVCodecContext * const avctx,
+                        drmprime_out_env_t * const dpo, const unsigned int port,
+                        AVPacket *packet, long * const pframes)
+{
+    AVFrame *frame = NULL;
+    int ret = 0;
+
+    if (bench_env != NULL && packet->size != 0)
+        bench_packet_in(bench_env, packet->pts);
+
+    {
+        TRACE_BEGIN(t_send);
+        ret = avcodec_send_packet(avctx, packet);
+        TRACE_END(TRACE_EV_SEND_PACKET, t_send, packet->pts);
+    }
     if (ret < 0) {
         fprintf(stderr, "Error during decoding\n");
         return ret;
     }
 
     for (;;) {
-        if (!(frame = av_frame_alloc()) || !(sw_frame = av_frame_alloc())) {
+        if ((frame = frame_pool_get(frame_pool)) == NULL) {
             fprintf(stderr, "Can not alloc frame\n");
             ret = AVERROR(ENOMEM);
             goto fail;
         }
 
-        ret = avcodec_receive_frame(avctx, frame);
+        {
+            TRACE_BEGIN(t_recv);
+            ret = avcodec_receive_frame(avctx, frame);
+            if (ret == 0)
+                TRACE_END(TRACE_EV_RECEIVE_FRAME, t_recv, frame->pts);
+        }
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            av_frame_free(&frame);
-            av_frame_free(&sw_frame);
+            frame_pool_put(frame_pool, &frame);
             return 0;
         } else if (ret < 0) {
             fprintf(stderr, "Error while decoding\n");
             goto fail;
         }
 
-        // push the decoded frame into the filtergraph if it exists
-        if (filter_graph != NULL &&
-            (ret = av_buffersrc_add_frame_flags(buffersrc_ctx, frame, AV_BUFFERSRC_FLAG_KEEP_REF)) < 0) {
-            fprintf(stderr, "Error while feeding the filtergraph\n");
-            goto fail;
-        }
+        if (bench_env != NULL)
+            bench_frame_out(bench_env, frame->pts);
 
-        do {
-            if (filter_graph != NULL) {
-                av_frame_unref(frame);
-                ret = av_buffersink_get_frame(buffersink_ctx, frame);
-                if (ret == AVERROR(EAGAIN)) {
-                    ret = 0;
-                    break;
-                }
-                if (ret < 0) {
-                    if (ret != AVERROR_EOF)
-                        fprintf(stderr, "Failed to get frame: %s", av_err2str(ret));
-                    goto fail;
-                }
+        // Frame accurate seek: decoding starts at the keyframe before the
+        // target but only frames from the target on are shown
+        if (seek_skip_pts != AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE) {
+            if (frame->pts < seek_skip_pts) {
+                ret = 0;
+                goto fail;
             }
+            seek_skip_pts = AV_NOPTS_VALUE;
+        }
 
-            drmprime_out_display(dpo, frame);
-
-            if (output_file != NULL) {
-                AVFrame *tmp_frame;
-
-                if (frame->format == hw_pix_fmt) {
-                    /* retrieve data from GPU to CPU */
-                    if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0) {
-                        fprintf(stderr, "Error transferring the data to system memory\n");
-                        goto fail;
-                    }
-                    tmp_frame = sw_frame;
-                } else
-                    tmp_frame = frame;
-
-                size = av_image_get_buffer_size(tmp_frame->format, tmp_frame->width,
-                                                tmp_frame->height, 1);
-                buffer = av_malloc(size);
-                if (!buffer) {
-                    fprintf(stderr, "Can not alloc buffer\n");
-                    ret = AVERROR(ENOMEM);
-                    goto fail;
-                }
-                ret = av_image_copy_to_buffer(buffer, size,
-                                              (const uint8_t * const *)tmp_frame->data,
-                                              (const int *)tmp_frame->linesize, tmp_frame->format,
-                                              tmp_frame->width, tmp_frame->height, 1);
-                if (ret < 0) {
-                    fprintf(stderr, "Can not copy image to buffer\n");
-                    goto fail;
-                }
+        // Progressive streams never need the deinterlacer
+        if (filter_graph == NULL && filter_descr != NULL && frame->interlaced_frame &&
+            (ret = filter_start(avctx, dpo, port)) < 0)
+            goto fail;
 
-                if ((ret = fwrite(buffer, 1, size, output_file)) < 0) {
-                    fprintf(stderr, "Failed to dump raw data.\n");
-                    goto fail;
-                }
-            }
-        } while (buffersink_ctx != NULL);  // Loop if we have a filter to drain
+        // Once there is a graph the filter thread does the output
+        if (filter_graph != NULL)
+            ret = filter_queue(&filter_stage, &frame);
+        else
+            ret = frame_out(dpo, port, frame);
+        if (ret < 0)
+            goto fail;
 
-        if (frames == 0 || --frames == 0)
+        if (*pframes == 0 || --*pframes == 0)
             ret = -1;
 
     fail:
-        av_frame_free(&frame);
-        av_frame_free(&sw_frame);
-        av_freep(&buffer);
+        frame_pool_put(frame_pool, &frame);
         if (ret < 0)
             return ret;
     }
     return 0;
 }
 
-// Copied almost directly from ffmpeg filtering_video.c example
-static int init_filters(const AVStream * const stream,
-                        const AVCodecContext * const dec_ctx,
-                        const char * const filters_descr)
+// --bench-display: when each frame got to the screen
+static void bench_presented(void * v, const drmprime_out_presented_t * p)
+{
+    bench_frame_shown(v, p->pts, p->dropped ? 0 : p->flip_time);
+}
+
+// Hand a frame from the native V4L2 decoder on to the outputs
+static int v4l2_frame_out(drmprime_out_env_t * const dpo, AVFrame * const frame,
+                          long * const pframes)
 {
-    char args[512];
     int ret = 0;
-    const AVFilter *buffersrc  = avfilter_get_by_name("buffer");
-    const AVFilter *buffersink = avfilter_get_by_name("buffersink");
-    AVFilterInOut *outputs = avfilter_inout_alloc();
-    AVFilterInOut *inputs  = avfilter_inout_alloc();
-    AVRational time_base = stream->time_base;
-    enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_DRM_PRIME, AV_PIX_FMT_NONE };
+    unsigned int i;
 
-    filter_graph = avfilter_graph_alloc();
-    if (!outputs || !inputs || !filter_graph) {
-        ret = AVERROR(ENOMEM);
-        goto end;
-    }
+    if (bench_env != NULL)
+        bench_frame_out(bench_env, frame->pts);
 
-    /* buffer video source: the decoded frames from the decoder will be inserted here. */
-    snprintf(args, sizeof(args),
-            "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-            dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
-            time_base.num, time_base.den,
-            dec_ctx->sample_aspect_ratio.num, dec_ctx->sample_aspect_ratio.den);
+    if (dpo != NULL)
+        drmprime_out_display_port(dpo, 0, frame);
+    for (i = 0; i != clone_count; ++i)
+        drmprime_out_display_port(clone_envs[i], 0, frame);
 
-    ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
-                                       args, NULL, filter_graph);
-    if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot create buffer source\n");
-        goto end;
-    }
+    if (dump_env != NULL)
+        ret = drmprime_dump_frame(dump_env, frame);
+    av_frame_unref(frame);
 
-    /* buffer video sink: to terminate the filter chain. */
-    ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
-                                       NULL, NULL, filter_graph);
-    if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot create buffer sink\n");
-        goto end;
-    }
+    if (ret == 0 && (*pframes == 0 || --*pframes == 0))
+        ret = -1;
+    return ret;
+}
 
-    ret = av_opt_set_int_list(buffersink_ctx, "pix_fmts", pix_fmts,
-                              AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+// As decode_write but using the native V4L2 decoder.  An empty packet
+// drains it.
+static int v4l2_decode_write(v4l2dec_env_t * const dec, drmprime_out_env_t * const dpo,
+                             AVPacket * const packet, long * const pframes)
+{
+    const bool drain = packet->size == 0;
+    AVFrame *frame;
+    int ret;
+
+    if ((frame = frame_pool_get(frame_pool)) == NULL)
+        return AVERROR(ENOMEM);
+
+    if (bench_env != NULL && !drain)
+        bench_packet_in(bench_env, packet->pts);
+
+    // If the OUTPUT queue is full wait for a frame to free up a buffer
+    for (;;) {
+        TRACE_BEGIN(t_send);
+        ret = v4l2dec_send(dec, drain ? NULL : packet);
+        TRACE_END(TRACE_EV_SEND_PACKET, t_send, packet->pts);
+        if (ret != AVERROR(EAGAIN))
+            break;
+
+        TRACE_BEGIN(t_recv);
+        ret = v4l2dec_receive(dec, frame, 100);
+        if (ret == 0) {
+            TRACE_END(TRACE_EV_RECEIVE_FRAME, t_recv, frame->pts);
+            if ((ret = v4l2_frame_out(dpo, frame, pframes)) < 0)
+                goto done;
+        }
+        else if (ret != AVERROR(EAGAIN)) {
+            goto done;
+        }
+    }
     if (ret < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
-        goto end;
+        fprintf(stderr, "Error during decoding\n");
+        goto done;
     }
 
-    /*
-     * Set the endpoints for the filter graph. The filter_graph will
-     * be linked to the graph described by filters_descr.
-     */
+    // Take whatever is ready; when draining wait for the end
+    for (;;) {
+        TRACE_BEGIN(t_recv);
+        ret = v4l2dec_receive(dec, frame, drain ? 1000 : 0);
+        if (ret != 0)
+            break;
+        TRACE_END(TRACE_EV_RECEIVE_FRAME, t_recv, frame->pts);
+        if ((ret = v4l2_frame_out(dpo, frame, pframes)) < 0)
+            goto done;
+    }
+    if (ret == AVERROR(EAGAIN) && drain)
+        fprintf(stderr, "Timeout draining V4L2 decoder\n");
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+        ret = 0;
+    else
+        fprintf(stderr, "Error while decoding\n");
+
+done:
+    frame_pool_put(frame_pool, &frame);
+    return ret;
+}
 
-    /*
-     * The buffer source output must be connected to the input pad of
-     * the first filter described by filters_descr; since the first
-     * filter input label is not specified, it is set to "in" by
-     * default.
-     */
-    outputs->name       = av_strdup("in");
-    outputs->filter_ctx = buffersrc_ctx;
-    outputs->pad_idx    = 0;
-    outputs->next       = NULL;
+// Frames --raw loads: more than the display holds on to so they cycle
+#define RAW_FRAMES_MAX 16
 
-    /*
-     * The buffer sink input must be connected to the output pad of
-     * the last filter described by filters_descr; since the last
-     * filter output label is not specified, it is set to "out" by
-     * default.
-     */
-    inputs->name       = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx;
-    inputs->pad_idx    = 0;
-    inputs->next       = NULL;
+// --raw: show the frames of a raw file in turn at rate fps (0 = as fast as
+// the display takes them) with no decode at all, and say how fast that was
+static int raw_play(drmprime_out_env_t * const dpo, const char * const name,
+                    const char * const format, const unsigned int width,
+                    const unsigned int height, const unsigned int rate,
+                    const long loop_count, const long frame_count)
+{
+    raw_src_t *rs = raw_src_new(name, format, width, height, RAW_FRAMES_MAX);
+    AVFrame *frame = NULL;
+    struct timespec t0, t;
+    long total, n;
+    double secs;
+    int ret = 0;
 
-    if ((ret = avfilter_graph_parse_ptr(filter_graph, filters_descr,
-                                    &inputs, &outputs, NULL)) < 0)
-        goto end;
+    if (rs == NULL)
+        return -1;
+    if ((frame = frame_pool_get(frame_pool)) == NULL) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    total = frame_count >= 0 ? frame_count : (long)raw_src_count(rs) * loop_count;
+    if (rate != 0) {
+        filter_tb = (AVRational){1, rate};
+        drmprime_out_set_time_base(dpo, 1, rate);
+        for (n = 0; n != clone_count; ++n)
+            drmprime_out_set_time_base(clone_envs[n], 1, rate);
+    }
 
-    if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
-        goto end;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (n = 0; n != total; ++n) {
+        if (rate != 0) {
+            const int64_t due = (int64_t)t0.tv_sec * 1000000000 + t0.tv_nsec +
+                av_rescale(n, 1000000000, rate);
+            t.tv_sec = due / 1000000000;
+            t.tv_nsec = due % 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+        }
+        if ((ret = raw_src_frame(rs, frame, n)) != 0)
+            break;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        // As if just received, for the --low-latency report
+        frame->reordered_opaque = (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+        frame->pts = rate != 0 ? n : AV_NOPTS_VALUE;
+        if ((ret = frame_out(dpo, 0, frame)) != 0)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t);
 
-end:
-    avfilter_inout_free(&inputs);
-    avfilter_inout_free(&outputs);
+    secs = (double)(t.tv_sec - t0.tv_sec) + (t.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "Raw: %ld frames in %.3fs: %.1f fps\n", n, secs, secs > 0 ? n / secs : 0.0);
 
+fail:
+    frame_pool_put(frame_pool, &frame);
+    raw_src_delete(&rs);
     return ret;
 }
 
-void usage()
-{
-    fprintf(stderr, "Usage: hello_drmprime [-l loop_count] [-f <frames>] [-o yuv_output_file] [--deinterlace] <input file> [<input_file> ...]\n");
-    exit(1);
-}
-
-int main(int argc, char *argv[])
+typedef struct input_s {
+    demux_env_t *demux;
+    int video_stream;
+    AVCodec *decoder;
+    enum AVPixelFormat hw_pix_fmt;      // AV_PIX_FMT_NONE if software only
+    AVCodec *sw_decoder;                // Plain decoder for the stream
+} input_t;
+
+// Open and probe an input: find its video stream and the decoder we want
+// for it.  Safe to run on a thread other than the decode thread.
+static int input_open(input_t * const in, const char * const name,
+                      const enum AVHWDeviceType type)
 {
-    AVFormatContext *input_ctx = NULL;
-    int video_stream, ret;
-    AVStream *video = NULL;
-    AVCodecContext *decoder_ctx = NULL;
+    AVFormatContext *input_ctx;
     AVCodec *decoder = NULL;
-    AVPacket packet;
-    enum AVHWDeviceType type;
-    const char * in_file;
-    char * const * in_filelist;
-    unsigned int in_count;
-    unsigned int in_n = 0;
-    const char * hwdev = "drm";
+    AVDictionary *opts = NULL;
+    int ret;
     int i;
-    drmprime_out_env_t * dpo;
-    long loop_count = 1;
-    long frame_count = -1;
-    const char * out_name = NULL;
-    bool wants_deinterlace = false;
 
-    {
-        char * const * a = argv + 1;
-        int n = argc - 1;
+    memset(in, 0, sizeof(*in));
 
-        while (n-- > 0 && a[0][0] == '-') {
-            const char *arg = *a++;
-            char *e;
+    if (low_latency) {
+        av_dict_set(&opts, "probesize", "32768", 0);
+        av_dict_set(&opts, "analyzeduration", "100000", 0);
+        av_dict_set(&opts, "fflags", "nobuffer", 0);
+    }
+    in->demux = demux_open(name, &opts);
+    av_dict_free(&opts);
+    if (in->demux == NULL)
+        return -1;
+    input_ctx = demux_format_ctx(in->demux);
 
-            if (strcmp(arg, "-l") == 0 || strcmp(arg, "--loop") == 0) {
-                if (n == 0)
-                    usage();
-                loop_count = strtol(*a, &e, 0);
-                if (*e != 0)
+    // Seen this file before - skip the probe
+    if ((ret = probe_cache_get(probe_cache_name, name, input_ctx)) >= 0) {
+        if ((decoder = avcodec_find_decoder(input_ctx->streams[ret]->codecpar->codec_id)) == NULL) {
+            fprintf(stderr, "No decoder for cached stream of %s\n", name);
+            goto fail;
+        }
+    }
+    else {
+        if (avformat_find_stream_info(input_ctx, NULL) < 0) {
+            fprintf(stderr, "Cannot find input stream information.\n");
+            goto fail;
+        }
+
+        /* find the video stream information */
+        ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+        if (ret < 0) {
+            fprintf(stderr, "Cannot find a video stream in the input file\n");
+            goto fail;
+        }
+        probe_cache_put(probe_cache_name, name, input_ctx, ret);
+    }
+    in->video_stream = ret;
+    in->sw_decoder = decoder;
+
+    if (decoder->id == AV_CODEC_ID_H264) {
+        if ((decoder = avcodec_find_decoder_by_name("h264_v4l2m2m")) == NULL) {
+            fprintf(stderr, "Cannot find the h264 v4l2m2m decoder\n");
+            goto fail;
+        }
+        in->hw_pix_fmt = AV_PIX_FMT_DRM_PRIME;
+    }
+    else {
+        for (i = 0;; i++) {
+            const AVCodecHWConfig *config = avcodec_get_hw_config(decoder, i);
+            if (!config && validate) {
+                in->hw_pix_fmt = AV_PIX_FMT_NONE;
+                break;
+            }
+            if (!config) {
+                fprintf(stderr, "Decoder %s does not support device type %s.\n",
+                        decoder->name, av_hwdevice_get_type_name(type));
+                goto fail;
+            }
+            if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
+                config->device_type == type) {
+                in->hw_pix_fmt = config->pix_fmt;
+                break;
+            }
+        }
+    }
+    in->decoder = decoder;
+    return 0;
+
+fail:
+    demux_close(&in->demux);
+    return -1;
+}
+
+// Opens the next playlist entry while the current one plays
+typedef struct prefetch_s {
+    pthread_t thread;
+    bool running;
+    const char *name;
+    enum AVHWDeviceType type;
+    size_t readahead;
+    input_t in;
+    int ret;
+} prefetch_t;
+
+static void * prefetch_thread(void * v)
+{
+    prefetch_t * const pf = v;
+
+    if ((pf->ret = input_open(&pf->in, pf->name, pf->type)) == 0 &&
+        (pf->ret = demux_start(pf->in.demux, pf->in.video_stream, pf->readahead)) != 0)
+        demux_close(&pf->in.demux);
+    return NULL;
+}
+
+static int prefetch_start(prefetch_t * const pf, const char * const name,
+                          const enum AVHWDeviceType type, const size_t readahead)
+{
+    pf->name = name;
+    pf->type = type;
+    pf->readahead = readahead;
+    if (pthread_create(&pf->thread, NULL, prefetch_thread, pf) != 0)
+        return -1;
+    pf->running = true;
+    return 0;
+}
+
+// Returns the result of input_open; if good the readahead is already running
+static int prefetch_wait(prefetch_t * const pf, input_t * const in)
+{
+    pthread_join(pf->thread, NULL);
+    pf->running = false;
+    *in = pf->in;
+    return pf->ret;
+}
+
+// Can a decoder opened with old_par carry straight on with new_par?
+// If so we only need to drain and flush it between inputs.
+static bool decoder_reusable(const AVCodecContext * const ctx, const AVCodecParameters * const old_par,
+                             const AVCodec * const decoder, const AVCodecParameters * const new_par)
+{
+    return ctx->codec == decoder &&
+        old_par->codec_id == new_par->codec_id &&
+        old_par->width == new_par->width &&
+        old_par->height == new_par->height &&
+        old_par->format == new_par->format &&
+        old_par->profile == new_par->profile &&
+        old_par->extradata_size == new_par->extradata_size &&
+        (old_par->extradata_size == 0 ||
+         memcmp(old_par->extradata, new_par->extradata, old_par->extradata_size) == 0);
+}
+
+// Jump to t seconds into the stream.  Decoding restarts at the keyframe
+// before t; the frames between it and t are decoded but not shown.
+static int seek_to(const input_t * const in, AVCodecContext * const avctx,
+                   drmprime_out_env_t * const * const outputs, const unsigned int n_outputs,
+                   const double t)
+{
+    const AVStream *const st = demux_format_ctx(in->demux)->streams[in->video_stream];
+    int64_t ts = av_rescale_q((int64_t)(t * 1000000.0), (AVRational){1, 1000000}, st->time_base);
+    unsigned int i;
+    int ret;
+
+    if (st->start_time != AV_NOPTS_VALUE)
+        ts += st->start_time;
+    if ((ret = demux_seek(in->demux, ts)) < 0)
+        return ret;
+
+    avcodec_flush_buffers(avctx);
+    // The deinterlacer holds frames too; it is rebuilt if still needed
+    filter_stop(&filter_stage, false);
+    for (i = 0; i != n_outputs; ++i) {
+        drmprime_out_flush(outputs[i]);
+        drmprime_out_set_time_base(outputs[i], st->time_base.num, st->time_base.den);
+    }
+    seek_skip_pts = ts;
+    trick_base = AV_NOPTS_VALUE;
+    return 0;
+}
+
+static void set_speed(AVCodecContext * const avctx,
+                      drmprime_out_env_t * const * const outputs, const unsigned int n_outputs,
+                      const unsigned int speed)
+{
+    unsigned int i;
+
+    if (speed == trick_speed)
+        return;
+    // The frames we skipped aren't there to be referenced
+    if (trick_speed > 1)
+        wait_key = true;
+    // The filter thread uses the trick play state
+    filter_stop(&filter_stage, true);
+    trick_speed = speed;
+    trick_base = AV_NOPTS_VALUE;
+    avctx->skip_frame = speed > 1 ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+    for (i = 0; i != n_outputs; ++i)
+        drmprime_out_discontinuity(outputs[i]);
+}
+
+// --control: a command line from stdin if a whole one has arrived, else
+// NULL.  Never blocks.
+static const char * control_poll(void)
+{
+    static char buf[256];
+    static char line[256];
+    static size_t n = 0;
+    static bool eof = false;
+    char *nl;
+
+    if ((nl = memchr(buf, '\n', n)) == NULL) {
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        ssize_t r;
+
+        if (eof || poll(&pfd, 1, 0) <= 0)
+            return NULL;
+        // Throw away a line too long to be a command
+        if (n == sizeof(buf))
+            n = 0;
+        if ((r = read(STDIN_FILENO, buf + n, sizeof(buf) - n)) <= 0) {
+            eof = true;
+            return NULL;
+        }
+        n += r;
+        if ((nl = memchr(buf, '\n', n)) == NULL)
+            return NULL;
+    }
+
+    memcpy(line, buf, nl - buf);
+    line[nl - buf] = 0;
+    n -= nl + 1 - buf;
+    memmove(buf, nl + 1, n);
+    return line;
+}
+
+// Mosaic: each input is decoded on its own thread into its own display port
+typedef struct mosaic_stream_s {
+    pthread_t thread;
+    const char *name;
+    enum AVHWDeviceType type;
+    drmprime_out_env_t *dpo;
+    unsigned int port;
+    long loop_count;
+    long frame_count;
+    size_t readahead;
+    int ret;
+} mosaic_stream_t;
+
+static void * mosaic_thread(void * v)
+{
+    mosaic_stream_t * const ms = v;
+    long loop_count = ms->loop_count;
+    AVCodecContext *decoder_ctx = NULL;
+    AVPacket packet;
+    input_t input;
+    AVStream *video;
+    long frames;
+    int ret;
+
+    do {
+        if (input_open(&input, ms->name, ms->type) != 0 ||
+            demux_start(input.demux, input.video_stream, ms->readahead) != 0)
+            goto fail;
+        video = demux_format_ctx(input.demux)->streams[input.video_stream];
+
+        if (!(decoder_ctx = avcodec_alloc_context3(input.decoder)) ||
+            avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
+            goto fail;
+        decoder_ctx->get_format = get_hw_format;
+        decoder_ctx->opaque = &input.hw_pix_fmt;
+        if (hw_decoder_init(decoder_ctx, ms->type) < 0 ||
+            decoder_tune(decoder_ctx, video->codecpar) != 0)
+            goto fail;
+        if (low_latency)
+            decoder_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        if (avcodec_open2(decoder_ctx, input.decoder, NULL) < 0) {
+            fprintf(stderr, "%s: Failed to open codec for stream #%u\n", ms->name, input.video_stream);
+            goto fail;
+        }
+
+        drmprime_out_set_time_base_port(ms->dpo, ms->port, video->time_base.num, video->time_base.den);
+        drmprime_out_discontinuity_port(ms->dpo, ms->port);
+
+        frames = ms->frame_count;
+        ret = 0;
+        while (ret >= 0) {
+            if ((ret = demux_get(input.demux, &packet)) < 0)
+                break;
+            decoder_ctx->reordered_opaque = demux_packet_time(input.demux);
+            ret = decode_write(decoder_ctx, ms->dpo, ms->port, &packet, &frames);
+            av_packet_unref(&packet);
+        }
+
+        packet.data = NULL;
+        packet.size = 0;
+        decode_write(decoder_ctx, ms->dpo, ms->port, &packet, &frames);
+
+        avcodec_free_context(&decoder_ctx);
+        demux_close(&input.demux);
+    } while (--loop_count > 0);
+
+    ms->ret = 0;
+    return NULL;
+
+fail:
+    avcodec_free_context(&decoder_ctx);
+    demux_close(&input.demux);
+    ms->ret = -1;
+    return NULL;
+}
+
+// --validate: a pool of threads each taking the next input, decoding it
+// with nothing displayed and checksumming every frame.  As many as hw_free
+// use the hw decoder at once; the rest (and any that fail to open it) are
+// decoded in software.
+typedef struct validate_env_s {
+    pthread_mutex_t lock;
+    char * const *names;
+    unsigned int n_names;
+    unsigned int next;          // Next input to take
+    unsigned int hw_free;       // hw decoders that may still be opened
+    enum AVHWDeviceType type;
+    long frame_count;
+    size_t readahead;
+    FILE *report;
+    unsigned int failed;
+} validate_env_t;
+
+// ms with neither send nor receive getting anywhere before giving up
+#define VALIDATE_STALL_MS 2000
+
+typedef struct validate_frame_s {
+    int64_t pts;
+    uint32_t sum;
+} validate_frame_t;
+
+// The checksum is of the picture as planar samples - every row of Y, then
+// of U, then of V, each sample as 16-bit little endian - whatever layout
+// the decoder left it in, so hw and sw decodes of a file give the same
+// sums (as long as both decoders are bit exact).
+typedef struct canon_s {
+    unsigned long sum;
+    uint16_t *line;             // A row of one component
+    uint8_t *bytes;             // ...as it is summed
+} canon_t;
+
+static int canon_init(canon_t * const c, const unsigned int width)
+{
+    c->sum = 1;
+    c->line = av_malloc_array(width, sizeof(*c->line));
+    c->bytes = av_malloc_array(width, 2);
+    return c->line == NULL || c->bytes == NULL ? AVERROR(ENOMEM) : 0;
+}
+
+static void canon_uninit(canon_t * const c)
+{
+    av_freep(&c->line);
+    av_freep(&c->bytes);
+}
+
+// Add n samples of c->line, every step'th from first
+static void canon_add(canon_t * const c, const unsigned int first, const unsigned int step,
+                      const unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i != n; ++i) {
+        const uint16_t v = c->line[first + i * step];
+        c->bytes[i * 2] = v & 0xff;
+        c->bytes[i * 2 + 1] = v >> 8;
+    }
+    c->sum = av_adler32_update(c->sum, c->bytes, n * 2);
+}
+
+// Visible area of the frame & that of its chroma
+typedef struct canon_rect_s {
+    unsigned int x, y, w, h;
+    unsigned int cx, cy, cw, ch;
+} canon_rect_t;
+
+static canon_rect_t canon_rect(const AVFrame * const frame, const AVPixFmtDescriptor * const desc)
+{
+    canon_rect_t r;
+
+    r.x = frame->crop_left;
+    r.y = frame->crop_top;
+    r.w = frame->width - frame->crop_left - frame->crop_right;
+    r.h = frame->height - frame->crop_top - frame->crop_bottom;
+    r.cx = r.x >> desc->log2_chroma_w;
+    r.cy = r.y >> desc->log2_chroma_h;
+    r.cw = AV_CEIL_RSHIFT(r.w, desc->log2_chroma_w);
+    r.ch = AV_CEIL_RSHIFT(r.h, desc->log2_chroma_h);
+    return r;
+}
+
+// Any software YUV layout libavutil knows
+static int canon_image(canon_t * const c, const uint8_t *data[4], const int linesize[4],
+                       const AVPixFmtDescriptor * const desc, const canon_rect_t * const r)
+{
+    unsigned int comp, y;
+
+    if ((desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL |
+                        AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_BITSTREAM)) != 0 ||
+        desc->nb_components < 3)
+        return AVERROR(ENOSYS);
+
+    for (comp = 0; comp != 3; ++comp) {
+        const unsigned int x0 = comp == 0 ? r->x : r->cx;
+        const unsigned int y0 = comp == 0 ? r->y : r->cy;
+        const unsigned int w = comp == 0 ? r->w : r->cw;
+        const unsigned int h = comp == 0 ? r->h : r->ch;
+
+        for (y = 0; y != h; ++y) {
+            av_read_image_line2(c->line, data, linesize, desc, x0, y0 + y, comp, w, 0, 2);
+            canon_add(c, 0, 1, w);
+        }
+    }
+    return 0;
+}
+
+// Samples x0 .. x0 + n - 1 of row y of a SAND128 plane into c->line.  NV12
+// has 128 8-bit samples per column row, P030 96 10-bit ones packed 3 to a
+// 32-bit word.
+static void sand_row(canon_t * const c, const uint8_t * const base, const size_t col_stride,
+                     const unsigned int y, const unsigned int x0, const unsigned int n,
+                     const bool p030)
+{
+    unsigned int i;
+
+    for (i = 0; i != n; ++i) {
+        const unsigned int x = x0 + i;
+
+        if (p030) {
+            const uint8_t * const p = base + (x / 96) * col_stride + y * 128 + (x % 96) / 3 * 4;
+            const uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+            c->line[i] = (v >> (10 * (x % 3))) & 0x3ff;
+        }
+        else {
+            c->line[i] = base[(x / 128) * col_stride + y * 128 + x % 128];
+        }
+    }
+}
+
+// SAND128 NV12 / P030: luma then interleaved chroma at half height, each
+// column 128 bytes x col_height lines
+static int canon_sand(canon_t * const c, const AVDRMFrameDescriptor * const desc,
+                      const uint8_t * const * const maps, const size_t * const sizes,
+                      const canon_rect_t * const r)
+{
+    const AVDRMLayerDescriptor * const layer = desc->layers + 0;
+    const bool p030 = layer->format == DRM_FORMAT_P030;
+    const size_t col_stride = (size_t)128 * fourcc_mod_broadcom_param(desc->objects[0].format_modifier);
+    const unsigned int per_col = p030 ? 96 : 128;
+    const uint8_t *base[2];
+    unsigned int i, y;
+
+    if (layer->nb_planes != 2 || (layer->format != DRM_FORMAT_NV12 && !p030))
+        return AVERROR(ENOSYS);
+    for (i = 0; i != 2; ++i) {
+        const AVDRMPlaneDescriptor * const p = layer->planes + i;
+        // Chroma samples are U & V interleaved
+        const unsigned int end = i == 0 ? r->x + r->w : (r->cx + r->cw) * 2;
+        const unsigned int rows = i == 0 ? r->y + r->h : r->cy + r->ch;
+
+        if ((size_t)p->offset + (size_t)((end + per_col - 1) / per_col - 1) * col_stride +
+            (size_t)rows * 128 > sizes[p->object_index])
+            return AVERROR(ENOSYS);
+        base[i] = maps[p->object_index] + p->offset;
+    }
+
+    for (y = 0; y != r->h; ++y) {
+        sand_row(c, base[0], col_stride, r->y + y, r->x, r->w, p030);
+        canon_add(c, 0, 1, r->w);
+    }
+    // U rows then V rows
+    for (i = 0; i != 2; ++i) {
+        for (y = 0; y != r->ch; ++y) {
+            sand_row(c, base[1], col_stride, r->cy + y, r->cx * 2, r->cw * 2, p030);
+            canon_add(c, i, 2, r->cw);
+        }
+    }
+    return 0;
+}
+
+// DRM formats we can read in place as linear images
+static enum AVPixelFormat drm_linear_fmt(const uint32_t fourcc)
+{
+    switch (fourcc) {
+        case DRM_FORMAT_NV12:
+            return AV_PIX_FMT_NV12;
+        case DRM_FORMAT_NV21:
+            return AV_PIX_FMT_NV21;
+        case DRM_FORMAT_YUV420:
+            return AV_PIX_FMT_YUV420P;
+        case DRM_FORMAT_P010:
+            return AV_PIX_FMT_P010LE;
+        default:
+            return AV_PIX_FMT_NONE;
+    }
+}
+
+// Linear: the planes by their pitch & offset
+static int canon_drm_linear(canon_t * const c, const AVFrame * const frame,
+                            const AVDRMFrameDescriptor * const desc,
+                            const uint8_t * const * const maps, const size_t * const sizes,
+                            const canon_rect_t * const r)
+{
+    const AVDRMLayerDescriptor * const layer = desc->layers + 0;
+    const enum AVPixelFormat fmt = drm_linear_fmt(layer->format);
+    const AVPixFmtDescriptor * const pix_desc = av_pix_fmt_desc_get(fmt);
+    const uint8_t *data[4] = {NULL};
+    int linesize[4] = {0};
+    int i;
+
+    if (pix_desc == NULL || desc->nb_layers != 1 || layer->nb_planes != av_pix_fmt_count_planes(fmt))
+        return AVERROR(ENOSYS);
+    for (i = 0; i != layer->nb_planes; ++i) {
+        const AVDRMPlaneDescriptor * const p = layer->planes + i;
+        const int len = av_image_get_linesize(fmt, frame->width, i);
+        const int rows = i == 0 ? frame->height : AV_CEIL_RSHIFT(frame->height, pix_desc->log2_chroma_h);
+
+        if (len <= 0 || p->pitch < len ||
+            (size_t)p->offset + (size_t)(rows - 1) * p->pitch + len > sizes[p->object_index])
+            return AVERROR(ENOSYS);
+        data[i] = maps[p->object_index] + p->offset;
+        linesize[i] = p->pitch;
+    }
+    // The DRM format's chroma layout is that of its AV one
+    return canon_image(c, data, linesize, pix_desc, r);
+}
+
+// Read a DRM_PRIME frame straight from its dma-bufs.  Returns
+// AVERROR(ENOSYS) for a layout we don't know rather than summing padding.
+static int canon_drm(canon_t * const c, const AVFrame * const frame)
+{
+    const AVDRMFrameDescriptor * const desc = (const AVDRMFrameDescriptor *)frame->data[0];
+    const uint64_t mod = desc->objects[0].format_modifier;
+    const bool sand = fourcc_mod_broadcom_mod(mod) == DRM_FORMAT_MOD_BROADCOM_SAND128;
+    // Both are 4:2:0 as all the layouts we take are
+    const canon_rect_t r = canon_rect(frame, av_pix_fmt_desc_get(AV_PIX_FMT_NV12));
+    const uint8_t *maps[AV_DRM_MAX_PLANES] = {NULL};
+    size_t sizes[AV_DRM_MAX_PLANES] = {0};
+    int ret;
+    int i;
+
+    if (desc->nb_layers < 1 ||
+        (!sand && mod != DRM_FORMAT_MOD_LINEAR && mod != DRM_FORMAT_MOD_INVALID))
+        return AVERROR(ENOSYS);
+
+    for (i = 0; i != desc->nb_objects; ++i) {
+        const AVDRMObjectDescriptor * const obj = desc->objects + i;
+        struct dma_buf_sync sync = {.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ};
+        void *p;
+
+        sizes[i] = obj->size != 0 ? obj->size : (size_t)lseek(obj->fd, 0, SEEK_END);
+        if ((p = mmap(NULL, sizes[i], PROT_READ, MAP_SHARED, obj->fd, 0)) == MAP_FAILED) {
+            ret = AVERROR(errno);
+            goto done;
+        }
+        maps[i] = p;
+        ioctl(obj->fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+
+    ret = sand ? canon_sand(c, desc, maps, sizes, &r) :
+        canon_drm_linear(c, frame, desc, maps, sizes, &r);
+
+done:
+    for (i = 0; i != desc->nb_objects; ++i) {
+        struct dma_buf_sync sync = {.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ};
+
+        if (maps[i] == NULL)
+            continue;
+        ioctl(desc->objects[i].fd, DMA_BUF_IOCTL_SYNC, &sync);
+        munmap((void *)maps[i], sizes[i]);
+    }
+    return ret;
+}
+
+// Adler-32 of the picture in its canonical form (see canon_t).  DRM_PRIME
+// frames are read where they are, other hw frames mapped (copied only if
+// they can't be).  AVERROR(ENOSYS) if there is no telling which bytes are
+// the picture.
+static int frame_checksum(const AVFrame * const frame, AVFrame * const tmp, uint32_t * const psum)
+{
+    const AVFrame *src = frame;
+    canon_t c;
+    int ret;
+
+    // +1 for the chroma pairs of an odd width
+    if ((ret = canon_init(&c, frame->width + 1)) != 0)
+        goto done;
+
+    // Read DRM_PRIME in place if we know its layout
+    if (frame->format == AV_PIX_FMT_DRM_PRIME) {
+        ret = canon_drm(&c, frame);
+        if (ret != AVERROR(ENOSYS) || frame->hw_frames_ctx == NULL)
+            goto done;
+        c.sum = 1;
+    }
+    if (frame->hw_frames_ctx != NULL) {
+        tmp->format = AV_PIX_FMT_NONE;
+        if (av_hwframe_map(tmp, frame, AV_HWFRAME_MAP_READ) != 0 &&
+            av_hwframe_transfer_data(tmp, frame, 0) != 0) {
+            ret = -1;
+            goto done;
+        }
+        // Mapping doesn't carry the crop over
+        tmp->crop_left = frame->crop_left;
+        tmp->crop_right = frame->crop_right;
+        tmp->crop_top = frame->crop_top;
+        tmp->crop_bottom = frame->crop_bottom;
+        src = tmp;
+    }
+
+    {
+        const AVPixFmtDescriptor * const desc = av_pix_fmt_desc_get(src->format);
+        const canon_rect_t r = desc == NULL ? (canon_rect_t){0} : canon_rect(src, desc);
+
+        ret = desc == NULL ? AVERROR(ENOSYS) :
+            canon_image(&c, (const uint8_t **)src->data, src->linesize, desc, &r);
+    }
+
+done:
+    if (ret == 0)
+        *psum = c.sum;
+    canon_uninit(&c);
+    av_frame_unref(tmp);
+    return ret;
+}
+
+// Decoder for in: hw if we got a slot and it opens, else software
+static AVCodecContext * validate_open(validate_env_t * const ve, input_t * const in,
+                                      const AVStream * const video, bool * const phw)
+{
+    AVCodecContext *ctx;
+    bool hw = false;
+
+    if (in->hw_pix_fmt != AV_PIX_FMT_NONE) {
+        pthread_mutex_lock(&ve->lock);
+        if (ve->hw_free != 0) {
+            --ve->hw_free;
+            hw = true;
+        }
+        pthread_mutex_unlock(&ve->lock);
+    }
+
+    if (hw) {
+        if ((ctx = avcodec_alloc_context3(in->decoder)) != NULL &&
+            avcodec_parameters_to_context(ctx, video->codecpar) >= 0) {
+            ctx->get_format = get_hw_format;
+            ctx->opaque = &in->hw_pix_fmt;
+            // Too big for CMA as hw falls back to sw like any other failure
+            hw = decoder_tune(ctx, video->codecpar) == 0;
+            // The pool is the parallelism
+            ctx->thread_count = decode_threads > 0 ? decode_threads : 1;
+            if (hw && hw_decoder_init(ctx, ve->type) >= 0 &&
+                avcodec_open2(ctx, in->decoder, NULL) >= 0) {
+                *phw = true;
+                return ctx;
+            }
+        }
+        avcodec_free_context(&ctx);
+        pthread_mutex_lock(&ve->lock);
+        ++ve->hw_free;
+        pthread_mutex_unlock(&ve->lock);
+    }
+
+    if ((ctx = avcodec_alloc_context3(in->sw_decoder)) == NULL ||
+        avcodec_parameters_to_context(ctx, video->codecpar) < 0)
+        goto fail;
+    ctx->thread_count = decode_threads > 0 ? decode_threads : 1;
+    if (avcodec_open2(ctx, in->sw_decoder, NULL) < 0)
+        goto fail;
+    *phw = false;
+    return ctx;
+
+fail:
+    avcodec_free_context(&ctx);
+    return NULL;
+}
+
+// What validate_file has found so far
+typedef struct validate_file_s {
+    validate_frame_t *v;
+    size_t n;
+    size_t size;
+    unsigned int errors;
+    unsigned int corrupt;
+    unsigned int unsummed;      // Frames in a layout we can't checksum
+} validate_file_t;
+
+// Checksum & keep a decoded frame.  Returns -1 if out of memory.
+static int validate_frame_add(validate_file_t * const vf, const AVFrame * const frame,
+                              AVFrame * const tmp)
+{
+    int ret;
+
+    if (vf->n == vf->size) {
+        validate_frame_t *const v = realloc(vf->v, (vf->size * 2 + 256) * sizeof(*v));
+        if (v == NULL)
+            return -1;
+        vf->v = v;
+        vf->size = vf->size * 2 + 256;
+    }
+    if ((frame->flags & AV_FRAME_FLAG_CORRUPT) != 0)
+        ++vf->corrupt;
+    vf->v[vf->n].pts = frame->pts;
+    if ((ret = frame_checksum(frame, tmp, &vf->v[vf->n].sum)) != 0) {
+        vf->v[vf->n].sum = 0;
+        if (ret == AVERROR(ENOSYS))
+            ++vf->unsummed;
+        else
+            ++vf->errors;
+    }
+    ++vf->n;
+    return 0;
+}
+
+static void validate_file(validate_env_t * const ve, const char * const name)
+{
+    AVCodecContext *ctx = NULL;
+    AVFrame *frame = NULL;
+    AVFrame *tmp = NULL;
+    validate_file_t vf = {NULL};
+    AVPacket packet;
+    input_t input;
+    bool hw = false;
+    bool draining = false;
+    bool done = ve->frame_count == 0;
+    unsigned long sum;
+    const char *why = NULL;
+    size_t i;
+    int ret;
+
+    if (input_open(&input, name, ve->type) != 0) {
+        why = "open";
+        goto report;
+    }
+    if (demux_start(input.demux, input.video_stream, ve->readahead) != 0 ||
+        (ctx = validate_open(ve, &input,
+                             demux_format_ctx(input.demux)->streams[input.video_stream], &hw)) == NULL) {
+        why = "decoder";
+        goto report;
+    }
+    if ((frame = av_frame_alloc()) == NULL || (tmp = av_frame_alloc()) == NULL) {
+        why = "alloc";
+        goto report;
+    }
+
+    while (!done) {
+        unsigned int stalled = 0;
+        bool sent = false;
+
+        if (demux_get(input.demux, &packet) < 0) {
+            packet.data = NULL;
+            packet.size = 0;
+            draining = true;
+        }
+
+        // EAGAIN from send (e.g. v4l2m2m with its OUTPUT queue full) means
+        // take frames first then send the same packet again; when draining
+        // keep taking them until EOF
+        while (!done) {
+            const size_t n_before = vf.n;
+
+            if (!sent) {
+                ret = avcodec_send_packet(ctx, &packet);
+                if (ret == 0) {
+                    sent = true;
+                }
+                else if (ret != AVERROR(EAGAIN)) {
+                    ++vf.errors;
+                    done = draining;
+                    break;
+                }
+            }
+
+            while ((ret = avcodec_receive_frame(ctx, frame)) == 0) {
+                ret = validate_frame_add(&vf, frame, tmp);
+                av_frame_unref(frame);
+                if (ret != 0) {
+                    av_packet_unref(&packet);
+                    why = "alloc";
+                    goto report;
+                }
+                // -f
+                if (ve->frame_count > 0 && vf.n >= (size_t)ve->frame_count) {
+                    done = true;
+                    break;
+                }
+            }
+            if (ret == AVERROR_EOF)
+                done = true;
+            else if (ret != 0 && ret != AVERROR(EAGAIN))
+                ++vf.errors;
+            if (done || (sent && !draining))
+                break;
+
+            // Neither side can move yet: give the decoder a moment
+            if (vf.n != n_before) {
+                stalled = 0;
+            }
+            else if (++stalled > VALIDATE_STALL_MS) {
+                fprintf(stderr, "%s: decoder stalled\n", name);
+                ++vf.errors;
+                done = true;
+            }
+            else {
+                usleep(1000);
+            }
+        }
+        av_packet_unref(&packet);
+    }
+
+    if (vf.n == 0)
+        why = "no frames";
+    else if (vf.errors != 0)
+        why = "decode errors";
+    else if (vf.corrupt != 0)
+        why = "corrupt frames";
+
+report:
+    // The file's checksum is that of its frames' checksums
+    sum = 1;
+    for (i = 0; i != vf.n; ++i)
+        sum = av_adler32_update(sum, (const uint8_t *)&vf.v[i].sum, sizeof(vf.v[i].sum));
+
+    // One file's lines together
+    pthread_mutex_lock(&ve->lock);
+    fprintf(ve->report, "# %s\n", name);
+    for (i = 0; i != vf.n; ++i)
+        fprintf(ve->report, "%zu, %" PRId64 ", 0x%08" PRIx32 "\n", i, vf.v[i].pts, vf.v[i].sum);
+    fprintf(ve->report, "%s %s: %zu frames, %s decode, %u errors, %u corrupt, %u unchecksummed, checksum 0x%08lx%s%s\n",
+            why == NULL ? "PASS" : "FAIL", name, vf.n, hw ? "hw" : "sw", vf.errors, vf.corrupt, vf.unsummed, sum,
+            why == NULL ? "" : " - ", why == NULL ? "" : why);
+    fflush(ve->report);
+    if (why != NULL)
+        ++ve->failed;
+    pthread_mutex_unlock(&ve->lock);
+
+    if (hw) {
+        pthread_mutex_lock(&ve->lock);
+        ++ve->hw_free;
+        pthread_mutex_unlock(&ve->lock);
+    }
+    av_frame_free(&tmp);
+    av_frame_free(&frame);
+    avcodec_free_context(&ctx);
+    demux_close(&input.demux);
+    free(vf.v);
+}
+
+static void * validate_thread(void * v)
+{
+    validate_env_t * const ve = v;
+
+    for (;;) {
+        unsigned int n;
+
+        pthread_mutex_lock(&ve->lock);
+        n = ve->next < ve->n_names ? ve->next++ : ve->n_names;
+        pthread_mutex_unlock(&ve->lock);
+        if (n >= ve->n_names)
+            break;
+        validate_file(ve, ve->names[n]);
+    }
+    return NULL;
+}
+
+// Copied almost directly from ffmpeg filtering_video.c example
+static int init_filters(const AVRational time_base,
+                        const AVCodecContext * const dec_ctx,
+                        const char * const filters_descr)
+{
+    char args[512];
+    int ret = 0;
+    const AVFilter *buffersrc  = avfilter_get_by_name("buffer");
+    const AVFilter *buffersink = avfilter_get_by_name("buffersink");
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs  = avfilter_inout_alloc();
+    enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_DRM_PRIME, AV_PIX_FMT_NONE };
+
+    filter_graph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !filter_graph) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    /* buffer video source: the decoded frames from the decoder will be inserted here. */
+    snprintf(args, sizeof(args),
+            "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+            dec_ctx->width, dec_ctx->height, dec_ctx->pix_fmt,
+            time_base.num, time_base.den,
+            dec_ctx->sample_aspect_ratio.num, dec_ctx->sample_aspect_ratio.den);
+
+    ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in",
+                                       args, NULL, filter_graph);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create buffer source\n");
+        goto end;
+    }
+
+    /* buffer video sink: to terminate the filter chain. */
+    ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out",
+                                       NULL, NULL, filter_graph);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot create buffer sink\n");
+        goto end;
+    }
+
+    ret = av_opt_set_int_list(buffersink_ctx, "pix_fmts", pix_fmts,
+                              AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Cannot set output pixel format\n");
+        goto end;
+    }
+
+    /*
+     * Set the endpoints for the filter graph. The filter_graph will
+     * be linked to the graph described by filters_descr.
+     */
+
+    /*
+     * The buffer source output must be connected to the input pad of
+     * the first filter described by filters_descr; since the first
+     * filter input label is not specified, it is set to "in" by
+     * default.
+     */
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = buffersrc_ctx;
+    outputs->pad_idx    = 0;
+    outputs->next       = NULL;
+
+    /*
+     * The buffer sink input must be connected to the output pad of
+     * the last filter described by filters_descr; since the last
+     * filter output label is not specified, it is set to "out" by
+     * default.
+     */
+    inputs->name       = av_strdup("out");
+    inputs->filter_ctx = buffersink_ctx;
+    inputs->pad_idx    = 0;
+    inputs->next       = NULL;
+
+    if ((ret = avfilter_graph_parse_ptr(filter_graph, filters_descr,
+                                    &inputs, &outputs, NULL)) < 0)
+        goto end;
+
+    if ((ret = avfilter_graph_config(filter_graph, NULL)) < 0)
+        goto end;
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+
+    return ret;
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage: hello_drmprime [-l loop_count] [-f <frames>] [-o yuv_output_file] [--dump <drm_output_file> [--dump-direct]] [--deinterlace] [--legacy] [--pace] [--queue <n>] [--queue-policy block|drop-oldest|drop-newest] [--retain <n>] [--retain-adaptive] [--fences] [--bench|--bench-import|--bench-display] [--bench-format json|csv] [--bench-out <file>] [--trace <file>] [--trace-summary] [--readahead <bytes>[k|M]] [--gapless] [--mosaic] [--connector <name|id> ...] [--aspect stretch|fit|fill|1:1] [--device <dri device>] [--plane <id>] [--v4l2dec <device> [--v4l2-buffers <out>,<cap>]] [--low-latency [--latency-target <ms>]] [--auto-tune] [--threads <n>] [--hw-frames <n>] [--probe-cache <file>] [--seek <seconds>] [--speed <n>] [--control] [--osd-time] [--validate <jobs> [--validate-hw <n>] [--validate-out <file>]] [--raw yuv420p|nv12|sand128 --raw-size <w>x<h> [--raw-rate <fps>]] [--stats <seconds> [--stats-json]] <input file> [<input_file> ...]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    AVFormatContext *input_ctx = NULL;
+    input_t input;
+    prefetch_t prefetch = {.running = false};
+    int ret;
+    AVStream *video = NULL;
+    AVCodecContext *decoder_ctx = NULL;
+    AVCodecParameters *decoder_par = NULL;
+    AVPacket packet;
+    enum AVHWDeviceType type;
+    const char * in_file;
+    char * const * in_filelist;
+    unsigned int in_count;
+    unsigned int in_n = 0;
+    const char * hwdev = "drm";
+    drmprime_out_env_t * dpo;
+    const char * connectors[OUTPUTS_MAX];
+    unsigned int n_connectors = 0;
+    drmprime_out_env_t * outputs[OUTPUTS_MAX] = {NULL};
+    unsigned int n_outputs = 0;
+    long loop_count = 1;
+    long frame_count = -1;
+    const char * out_name = NULL;
+    const char * dump_name = NULL;
+    bool dump_direct = false;
+    bool bench = false;
+    bool bench_import = false;
+    bool bench_display = false;
+    enum bench_format_e bench_fmt = BENCH_FORMAT_JSON;
+    const char * bench_name = NULL;
+    const char * trace_name = NULL;
+    bool trace_summary = false;
+    size_t readahead = 8 << 20;
+    bool gapless = false;
+    bool mosaic = false;
+    bool wants_deinterlace = false;
+    unsigned int latency_target = 100;
+    double seek_start = 0.0;
+    bool control = false;
+    const char * v4l2_dev = NULL;
+    unsigned int v4l2_n_out = 6;
+    unsigned int v4l2_n_cap = 4;
+    bool v4l2_buffers_set = false;
+    v4l2dec_env_t * v4l2_dec = NULL;
+    const char * raw_format = NULL;
+    unsigned int raw_width = 0;
+    unsigned int raw_height = 0;
+    unsigned int raw_rate = 0;
+    long validate_jobs = 0;
+    long validate_hw = -1;
+    const char * validate_name = NULL;
+    int exit_code = 0;
+    drmprime_out_opts_t dpo_opts;
+
+    drmprime_out_opts_default(&dpo_opts);
+
+    {
+        char * const * a = argv + 1;
+        int n = argc - 1;
+
+        while (n-- > 0 && a[0][0] == '-') {
+            const char *arg = *a++;
+            char *e;
+
+            if (strcmp(arg, "-l") == 0 || strcmp(arg, "--loop") == 0) {
+                if (n == 0)
+                    usage();
+                loop_count = strtol(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "-f") == 0 || strcmp(arg, "--frames") == 0) {
+                if (n == 0)
+                    usage();
+                frame_count = strtol(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "-o") == 0) {
+                if (n == 0)
+                    usage();
+                out_name = *a;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--dump") == 0) {
+                if (n == 0)
+                    usage();
+                dump_name = *a;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--dump-direct") == 0) {
+                dump_direct = true;
+            }
+            else if (strcmp(arg, "--bench") == 0) {
+                bench = true;
+            }
+            else if (strcmp(arg, "--bench-display") == 0) {
+                bench = true;
+                bench_display = true;
+            }
+            else if (strcmp(arg, "--bench-import") == 0) {
+                bench = true;
+                bench_import = true;
+            }
+            else if (strcmp(arg, "--bench-format") == 0) {
+                if (n == 0)
+                    usage();
+                if (strcmp(*a, "json") == 0)
+                    bench_fmt = BENCH_FORMAT_JSON;
+                else if (strcmp(*a, "csv") == 0)
+                    bench_fmt = BENCH_FORMAT_CSV;
+                else
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--bench-out") == 0) {
+                if (n == 0)
+                    usage();
+                bench_name = *a;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--trace") == 0) {
+                if (n == 0)
+                    usage();
+                trace_name = *a;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--trace-summary") == 0) {
+                trace_summary = true;
+            }
+            else if (strcmp(arg, "--readahead") == 0) {
+                if (n == 0)
+                    usage();
+                readahead = strtoul(*a, &e, 0);
+                if (*e == 'k' || *e == 'K') {
+                    readahead <<= 10;
+                    ++e;
+                }
+                else if (*e == 'm' || *e == 'M') {
+                    readahead <<= 20;
+                    ++e;
+                }
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--connector") == 0) {
+                if (n == 0 || n_connectors >= OUTPUTS_MAX)
                     usage();
+                connectors[n_connectors++] = *a;
                 --n;
                 ++a;
             }
-            else if (strcmp(arg, "-f") == 0 || strcmp(arg, "--frames") == 0) {
+            else if (strcmp(arg, "--mosaic") == 0) {
+                mosaic = true;
+            }
+            else if (strcmp(arg, "--validate") == 0) {
                 if (n == 0)
                     usage();
-                frame_count = strtol(*a, &e, 0);
+                validate_jobs = strtol(*a, &e, 0);
+                if (*e != 0 || validate_jobs < 0 || validate_jobs > 64)
+                    usage();
+                validate = true;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--validate-hw") == 0) {
+                if (n == 0)
+                    usage();
+                validate_hw = strtol(*a, &e, 0);
+                if (*e != 0 || validate_hw < 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--validate-out") == 0) {
+                if (n == 0)
+                    usage();
+                validate_name = *a;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--raw") == 0) {
+                if (n == 0)
+                    usage();
+                raw_format = *a;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--raw-size") == 0) {
+                if (n == 0)
+                    usage();
+                if (sscanf(*a, "%ux%u", &raw_width, &raw_height) != 2 ||
+                    raw_width == 0 || raw_height == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--raw-rate") == 0) {
+                if (n == 0)
+                    usage();
+                raw_rate = strtoul(*a, &e, 0);
+                if (*e != 0 || raw_rate > 1000)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--v4l2dec") == 0) {
+                if (n == 0)
+                    usage();
+                v4l2_dev = *a;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--v4l2-buffers") == 0) {
+                if (n == 0)
+                    usage();
+                v4l2_n_out = strtoul(*a, &e, 0);
+                if (*e != ',' || v4l2_n_out == 0)
+                    usage();
+                v4l2_n_cap = strtoul(e + 1, &e, 0);
                 if (*e != 0)
                     usage();
+                v4l2_buffers_set = true;
                 --n;
                 ++a;
             }
-            else if (strcmp(arg, "-o") == 0) {
+            else if (strcmp(arg, "--device") == 0) {
                 if (n == 0)
                     usage();
-                out_name = *a;
+                dpo_opts.device = *a;
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--plane") == 0) {
+                if (n == 0)
+                    usage();
+                dpo_opts.plane_id = strtoul(*a, &e, 0);
+                if (*e != 0 || dpo_opts.plane_id == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--stats") == 0) {
+                if (n == 0)
+                    usage();
+                dpo_opts.stats_period = strtoul(*a, &e, 0);
+                if (*e != 0 || dpo_opts.stats_period == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--fences") == 0) {
+                dpo_opts.fences = 1;
+            }
+            else if (strcmp(arg, "--stats-json") == 0) {
+                dpo_opts.stats_json = 1;
+            }
+            else if (strcmp(arg, "--auto-tune") == 0) {
+                auto_tune = true;
+            }
+            else if (strcmp(arg, "--threads") == 0) {
+                if (n == 0)
+                    usage();
+                decode_threads = strtol(*a, &e, 0);
+                if (*e != 0 || decode_threads < 1 || decode_threads > 16)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--hw-frames") == 0) {
+                if (n == 0)
+                    usage();
+                decode_extra_frames = strtol(*a, &e, 0);
+                if (*e != 0 || decode_extra_frames < 0 || decode_extra_frames > 64)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--low-latency") == 0) {
+                low_latency = true;
+                dpo_opts.policy = DRMPRIME_OUT_POLICY_DROP_OLDEST;
+            }
+            else if (strcmp(arg, "--latency-target") == 0) {
+                if (n == 0)
+                    usage();
+                latency_target = strtoul(*a, &e, 0);
+                if (*e != 0 || latency_target == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--seek") == 0) {
+                if (n == 0)
+                    usage();
+                seek_start = strtod(*a, &e);
+                if (*e != 0 || seek_start < 0.0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--speed") == 0) {
+                if (n == 0)
+                    usage();
+                trick_speed = strtoul(*a, &e, 0);
+                if (*e != 0 || trick_speed < 1 || trick_speed > 16)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--control") == 0) {
+                control = true;
+            }
+            else if (strcmp(arg, "--osd-time") == 0) {
+                osd_time = true;
+            }
+            else if (strcmp(arg, "--probe-cache") == 0) {
+                if (n == 0)
+                    usage();
+                probe_cache_name = *a;
                 --n;
                 ++a;
             }
+            else if (strcmp(arg, "--gapless") == 0) {
+                gapless = true;
+            }
             else if (strcmp(arg, "--deinterlace") == 0) {
                 wants_deinterlace = true;
             }
+            else if (strcmp(arg, "--legacy") == 0) {
+                dpo_opts.legacy = 1;
+            }
+            else if (strcmp(arg, "--pace") == 0) {
+                dpo_opts.pace = 1;
+            }
+            else if (strcmp(arg, "--queue") == 0) {
+                if (n == 0)
+                    usage();
+                dpo_opts.queue_depth = strtoul(*a, &e, 0);
+                if (*e != 0 || dpo_opts.queue_depth == 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--retain") == 0) {
+                if (n == 0)
+                    usage();
+                dpo_opts.retain = strtoul(*a, &e, 0);
+                if (*e != 0)
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--retain-adaptive") == 0) {
+                dpo_opts.retain_adaptive = 1;
+            }
+            else if (strcmp(arg, "--aspect") == 0) {
+                if (n == 0)
+                    usage();
+                if (strcmp(*a, "stretch") == 0)
+                    dpo_opts.aspect = DRMPRIME_OUT_ASPECT_STRETCH;
+                else if (strcmp(*a, "fit") == 0)
+                    dpo_opts.aspect = DRMPRIME_OUT_ASPECT_FIT;
+                else if (strcmp(*a, "fill") == 0)
+                    dpo_opts.aspect = DRMPRIME_OUT_ASPECT_FILL;
+                else if (strcmp(*a, "1:1") == 0)
+                    dpo_opts.aspect = DRMPRIME_OUT_ASPECT_NATIVE;
+                else
+                    usage();
+                --n;
+                ++a;
+            }
+            else if (strcmp(arg, "--queue-policy") == 0) {
+                if (n == 0)
+                    usage();
+                if (strcmp(*a, "block") == 0)
+                    dpo_opts.policy = DRMPRIME_OUT_POLICY_BLOCK;
+                else if (strcmp(*a, "drop-oldest") == 0)
+                    dpo_opts.policy = DRMPRIME_OUT_POLICY_DROP_OLDEST;
+                else if (strcmp(*a, "drop-newest") == 0)
+                    dpo_opts.policy = DRMPRIME_OUT_POLICY_DROP_NEWEST;
+                else
+                    usage();
+                --n;
+                ++a;
+            }
             else
                 break;
         }
@@ -354,7 +2093,57 @@ int main(int argc, char *argv[])
 
         in_filelist = a;
         in_count = n + 1;
-        loop_count *= in_count;
+        if (!mosaic)
+            loop_count *= in_count;
+    }
+
+    // The mosaic decoders run in parallel so can't share the single
+    // filter / output / bench state
+    if (mosaic && (wants_deinterlace || out_name != NULL || dump_name != NULL || bench)) {
+        fprintf(stderr, "--mosaic can't be used with --deinterlace, -o, --dump or --bench\n");
+        return 1;
+    }
+
+    // The native decoder hands out DRM_PRIME frames only
+    if (v4l2_dev != NULL && (mosaic || wants_deinterlace || out_name != NULL)) {
+        fprintf(stderr, "--v4l2dec can't be used with --mosaic, --deinterlace or -o\n");
+        return 1;
+    }
+
+    if ((seek_start != 0.0 || trick_speed != 1 || control) && (mosaic || v4l2_dev != NULL)) {
+        fprintf(stderr, "--seek, --speed and --control can't be used with --mosaic or --v4l2dec\n");
+        return 1;
+    }
+
+    // Decode only, on its own threads
+    if (validate &&
+        (mosaic || v4l2_dev != NULL || wants_deinterlace || out_name != NULL ||
+         dump_name != NULL || bench || raw_format != NULL || seek_start != 0.0 ||
+         trick_speed != 1 || control || osd_time)) {
+        fprintf(stderr, "--validate can't be used with --mosaic, --v4l2dec, --deinterlace, -o, "
+                "--dump, --bench, --raw, --seek, --speed, --control or --osd-time\n");
+        return 1;
+    }
+
+    // Nothing to decode, so nothing to filter, seek or bench
+    if (raw_format != NULL &&
+        (in_count != 1 || raw_width == 0 || mosaic || v4l2_dev != NULL || wants_deinterlace ||
+         out_name != NULL || (bench && !bench_import) || seek_start != 0.0 ||
+         trick_speed != 1 || control)) {
+        fprintf(stderr, "--raw needs --raw-size and one input and can't be used with "
+                "--mosaic, --v4l2dec, --deinterlace, -o, --bench, --seek, --speed or --control\n");
+        return 1;
+    }
+
+    if (osd_time && (mosaic || v4l2_dev != NULL)) {
+        fprintf(stderr, "--osd-time can't be used with --mosaic or --v4l2dec\n");
+        return 1;
+    }
+
+    if ((trace_name != NULL || trace_summary) && trace_init(1 << 20) != 0) {
+        fprintf(stderr, "Tracing not available: build with TRACE=1\n");
+        trace_name = NULL;
+        trace_summary = false;
     }
 
     type = av_hwdevice_find_type_by_name(hwdev);
@@ -367,11 +2156,58 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    dpo = drmprime_out_new();
-    if (dpo == NULL) {
-        fprintf(stderr, "Failed to open drmprime output\n");
+    if (bench_import)
+        dpo_opts.no_flip = 1;
+    if (low_latency)
+        dpo_opts.latency_ms = latency_target;
+    dpo_opts.osd = osd_time;
+    if (wants_deinterlace)
+        filter_descr = "deinterlace_v4l2m2m";
+
+    if (bench && (bench_env = bench_new()) == NULL) {
+        fprintf(stderr, "Failed to init bench\n");
         return 1;
     }
+    if (bench_display) {
+        dpo_opts.presented_fn = bench_presented;
+        dpo_opts.presented_v = bench_env;
+    }
+
+    if ((bench && !bench_import && !bench_display) || validate) {
+        dpo = NULL;
+    }
+    else {
+        // Mosaic shares the inputs out between the outputs, otherwise
+        // every output shows the same thing
+        const unsigned int n_out = n_connectors == 0 ? 1 :
+            mosaic && in_count < n_connectors ? in_count : n_connectors;
+
+        for (n_outputs = 0; n_outputs != n_out; ++n_outputs) {
+            dpo_opts.connector = n_connectors == 0 ? NULL : connectors[n_outputs];
+            if (mosaic)
+                dpo_opts.ports = (in_count + n_out - 1 - n_outputs) / n_out;
+            outputs[n_outputs] = n_outputs == 0 ?
+                drmprime_out_new(&dpo_opts) :
+                drmprime_out_new_output(outputs[0], &dpo_opts);
+            if (outputs[n_outputs] == NULL) {
+                fprintf(stderr, "Failed to open drmprime output %s\n",
+                        dpo_opts.connector == NULL ? "" : dpo_opts.connector);
+                return 1;
+            }
+            // The others can't have the same plane
+            dpo_opts.plane_id = 0;
+        }
+        dpo = outputs[0];
+        if (!mosaic) {
+            clone_envs = outputs + 1;
+            clone_count = n_outputs - 1;
+        }
+        // A mosaic stream goes to one port; clones each hold their own
+        display_held = drmprime_out_frames_held(&dpo_opts) * (mosaic ? 1 : n_outputs);
+    }
+
+    if ((frame_pool = frame_pool_new(8)) == NULL)
+        return AVERROR(ENOMEM);
 
     /* open the file to dump raw data */
     if (out_name != NULL) {
@@ -381,87 +2217,243 @@ int main(int argc, char *argv[])
         }
     }
 
-loopy:
-    in_file = in_filelist[in_n];
-    if (++in_n >= in_count)
-        in_n = 0;
+    if (dump_name != NULL) {
+        if ((dump_env = drmprime_dump_new(dump_name, dump_direct)) == NULL)
+            return -1;
+    }
 
-    /* open the input file */
-    if (avformat_open_input(&input_ctx, in_file, NULL, NULL) != 0) {
-        fprintf(stderr, "Cannot open input file '%s'\n", in_file);
-        return -1;
+    if (validate) {
+        validate_env_t ve = {
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .names = in_filelist,
+            .n_names = in_count,
+            .type = type,
+            .frame_count = frame_count,
+            .readahead = readahead,
+            .report = validate_name == NULL ? stdout : fopen(validate_name, "w"),
+        };
+        pthread_t threads[64];
+        unsigned int started;
+
+        if (validate_jobs == 0)
+            validate_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        validate_jobs = FFMAX(1, FFMIN(FFMIN(validate_jobs, 64), (long)in_count));
+        ve.hw_free = validate_hw < 0 ? validate_jobs : validate_hw;
+        if (ve.report == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", validate_name, strerror(errno));
+            return 1;
+        }
+        fprintf(ve.report, "# checksum: Adler-32 of visible Y, U, V rows as 16-bit LE samples, comparable between hw & sw decodes\n");
+
+        for (started = 0; started != validate_jobs; ++started) {
+            if (pthread_create(threads + started, NULL, validate_thread, &ve) != 0) {
+                fprintf(stderr, "Failed to start validate thread\n");
+                break;
+            }
+        }
+        // With no threads at all do it here
+        if (started == 0)
+            validate_thread(&ve);
+        while (started-- > 0)
+            pthread_join(threads[started], NULL);
+
+        fprintf(stderr, "Validate: %u of %u files passed\n", in_count - ve.failed, in_count);
+        if (ve.report != stdout)
+            fclose(ve.report);
+        if (ve.failed != 0)
+            exit_code = 1;
+        goto done;
     }
 
-    if (avformat_find_stream_info(input_ctx, NULL) < 0) {
-        fprintf(stderr, "Cannot find input stream information.\n");
-        return -1;
+    if (raw_format != NULL) {
+        if (raw_play(dpo, in_filelist[0], raw_format, raw_width, raw_height, raw_rate,
+                     loop_count, frame_count) != 0)
+            return 1;
+        goto done;
     }
 
-    /* find the video stream information */
-    ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Cannot find a video stream in the input file\n");
-        return -1;
+    if (mosaic) {
+        mosaic_stream_t *const streams = calloc(in_count, sizeof(*streams));
+        unsigned int started;
+
+        if (streams == NULL)
+            return AVERROR(ENOMEM);
+        for (started = 0; started != in_count; ++started) {
+            mosaic_stream_t *const ms = streams + started;
+
+            ms->name = in_filelist[started];
+            ms->type = type;
+            ms->dpo = outputs[started % n_outputs];
+            ms->port = started / n_outputs;
+            ms->loop_count = loop_count;
+            ms->frame_count = frame_count;
+            ms->readahead = readahead;
+            if (pthread_create(&ms->thread, NULL, mosaic_thread, ms) != 0) {
+                fprintf(stderr, "Failed to start decode of %s\n", ms->name);
+                break;
+            }
+        }
+
+        ret = 0;
+        while (started-- > 0) {
+            pthread_join(streams[started].thread, NULL);
+            if (streams[started].ret != 0)
+                ret = -1;
+        }
+        free(streams);
+        if (ret != 0)
+            return ret;
+        goto done;
     }
-    video_stream = ret;
 
-    if (decoder->id == AV_CODEC_ID_H264) {
-        if ((decoder = avcodec_find_decoder_by_name("h264_v4l2m2m")) == NULL) {
-            fprintf(stderr, "Cannot find the h264 v4l2m2m decoder\n");
+    if ((decoder_par = avcodec_parameters_alloc()) == NULL)
+        return AVERROR(ENOMEM);
+
+loopy:
+    in_file = in_filelist[in_n];
+    if (++in_n >= in_count)
+        in_n = 0;
+
+    /* open the input file - already done in the background if gapless */
+    if (prefetch.running) {
+        if (prefetch_wait(&prefetch, &input) != 0)
             return -1;
-        }
-        hw_pix_fmt = AV_PIX_FMT_DRM_PRIME;
     }
     else {
-        for (i = 0;; i++) {
-            const AVCodecHWConfig *config = avcodec_get_hw_config(decoder, i);
-            if (!config) {
-                fprintf(stderr, "Decoder %s does not support device type %s.\n",
-                        decoder->name, av_hwdevice_get_type_name(type));
+        if (input_open(&input, in_file, type) != 0)
+            return -1;
+        if (demux_start(input.demux, input.video_stream, readahead) != 0)
+            return -1;
+    }
+    input_ctx = demux_format_ctx(input.demux);
+    video = input_ctx->streams[input.video_stream];
+
+    if (gapless && loop_count > 1 &&
+        prefetch_start(&prefetch, in_filelist[in_n], type, readahead) != 0)
+        fprintf(stderr, "Failed to start prefetch - next input opened in line\n");
+
+    if (v4l2_dev != NULL) {
+        unsigned int i;
+
+        if (auto_tune && !v4l2_buffers_set) {
+            tune_t t;
+            if (tune_decode(&t, video->codecpar, display_held, low_latency) != 0)
                 return -1;
-            }
-            if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
-                config->device_type == type) {
-                hw_pix_fmt = config->pix_fmt;
-                break;
-            }
+            v4l2_n_out = t.v4l2_out;
+            v4l2_n_cap = t.extra_frames;
         }
+        if ((v4l2_dec = v4l2dec_new(v4l2_dev, video->codecpar, v4l2_n_out, v4l2_n_cap)) == NULL)
+            return -1;
+        for (i = 0; i != n_outputs; ++i) {
+            drmprime_out_set_time_base(outputs[i], video->time_base.num, video->time_base.den);
+            drmprime_out_discontinuity(outputs[i]);
+        }
+
+        frames = frame_count;
+        ret = 0;
+        while (ret >= 0 && (ret = demux_get(input.demux, &packet)) >= 0) {
+            v4l2dec_set_reordered_opaque(v4l2_dec, demux_packet_time(input.demux));
+            ret = v4l2_decode_write(v4l2_dec, dpo, &packet, &frames);
+            av_packet_unref(&packet);
+        }
+        packet.data = NULL;
+        packet.size = 0;
+        v4l2_decode_write(v4l2_dec, dpo, &packet, &frames);
+
+        v4l2dec_delete(&v4l2_dec);
+        demux_close(&input.demux);
+        input_ctx = NULL;
+
+        if (--loop_count > 0)
+            goto loopy;
+        goto finish;
     }
 
-    if (!(decoder_ctx = avcodec_alloc_context3(decoder)))
-        return AVERROR(ENOMEM);
+    if (decoder_ctx != NULL &&
+        !decoder_reusable(decoder_ctx, decoder_par, input.decoder, video->codecpar)) {
+        filter_stop(&filter_stage, true);
+        avcodec_free_context(&decoder_ctx);
+    }
 
-    video = input_ctx->streams[video_stream];
-    if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
-        return -1;
+    if (decoder_ctx == NULL) {
+        hw_pix_fmt = input.hw_pix_fmt;
 
-    decoder_ctx->get_format  = get_hw_format;
+        if (!(decoder_ctx = avcodec_alloc_context3(input.decoder)))
+            return AVERROR(ENOMEM);
 
-    if (hw_decoder_init(decoder_ctx, type) < 0)
-        return -1;
+        if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
+            return -1;
 
-    decoder_ctx->thread_count = 3;
+        decoder_ctx->get_format  = get_hw_format;
+        decoder_ctx->opaque = &hw_pix_fmt;
 
-    if ((ret = avcodec_open2(decoder_ctx, decoder, NULL)) < 0) {
-        fprintf(stderr, "Failed to open codec for stream #%u\n", video_stream);
-        return -1;
-    }
+        if (hw_decoder_init(decoder_ctx, type) < 0 ||
+            decoder_tune(decoder_ctx, video->codecpar) != 0)
+            return -1;
 
-    if (wants_deinterlace) {
-        if (init_filters(video, decoder_ctx, "deinterlace_v4l2m2m") < 0) {
-            fprintf(stderr, "Failed to init deinterlace\n");
+        if (low_latency)
+            decoder_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        decoder_ctx->skip_frame = trick_speed > 1 ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+
+        if ((ret = avcodec_open2(decoder_ctx, input.decoder, NULL)) < 0) {
+            fprintf(stderr, "Failed to open codec for stream #%u\n", input.video_stream);
             return -1;
         }
+
+        if (avcodec_parameters_copy(decoder_par, video->codecpar) < 0)
+            return AVERROR(ENOMEM);
+    }
+
+    // The deinterlacer is built on the first interlaced frame (see
+    // decode_write) and bakes in the stream time base
+    if (filter_graph != NULL && av_cmp_q(filter_tb, video->time_base) != 0)
+        filter_stop(&filter_stage, true);
+    filter_tb = video->time_base;
+
+    {
+        const AVRational tb = filter_graph != NULL ?
+            av_buffersink_get_time_base(buffersink_ctx) : video->time_base;
+        unsigned int i;
+
+        for (i = 0; i != n_outputs; ++i) {
+            drmprime_out_set_time_base(outputs[i], tb.num, tb.den);
+            drmprime_out_discontinuity(outputs[i]);
+        }
     }
 
+    if (seek_start != 0.0 && seek_to(&input, decoder_ctx, outputs, n_outputs, seek_start) != 0)
+        fprintf(stderr, "Failed to seek to %.3fs - playing from the start\n", seek_start);
+
     /* actual decoding and dump the raw data */
     frames = frame_count;
+    ret = 0;
     while (ret >= 0) {
-        if ((ret = av_read_frame(input_ctx, &packet)) < 0)
+        const char *const cmd = control ? control_poll() : NULL;
+
+        if (cmd != NULL) {
+            double t;
+            unsigned int speed;
+
+            if (sscanf(cmd, "seek %lf", &t) == 1 && t >= 0.0)
+                seek_to(&input, decoder_ctx, outputs, n_outputs, t);
+            else if (sscanf(cmd, "speed %u", &speed) == 1 && speed >= 1 && speed <= 16)
+                set_speed(decoder_ctx, outputs, n_outputs, speed);
+            else
+                fprintf(stderr, "Unknown command: '%s'\n", cmd);
+        }
+
+        if ((ret = demux_get(input.demux, &packet)) < 0)
             break;
 
-        if (video_stream == packet.stream_index)
-            ret = decode_write(decoder_ctx, dpo, &packet);
+        // Trick play sends keyframes only
+        if ((trick_speed > 1 || wait_key) && (packet.flags & AV_PKT_FLAG_KEY) == 0) {
+            av_packet_unref(&packet);
+            continue;
+        }
+        wait_key = false;
+
+        decoder_ctx->reordered_opaque = demux_packet_time(input.demux);
+        ret = decode_write(decoder_ctx, dpo, 0, &packet, &frames);
 
         av_packet_unref(&packet);
     }
@@ -469,19 +2461,61 @@ loopy:
     /* flush the decoder */
     packet.data = NULL;
     packet.size = 0;
-    ret = decode_write(decoder_ctx, dpo, &packet);
+    ret = decode_write(decoder_ctx, dpo, 0, &packet, &frames);
     av_packet_unref(&packet);
 
-    if (output_file)
-        fclose(output_file);
-    avfilter_graph_free(&filter_graph);
-    avcodec_free_context(&decoder_ctx);
-    avformat_close_input(&input_ctx);
+    // A drained decoder can take the next input after a flush
+    if (gapless && loop_count > 1) {
+        avcodec_flush_buffers(decoder_ctx);
+    }
+    else {
+        filter_stop(&filter_stage, true);
+        avcodec_free_context(&decoder_ctx);
+    }
+    demux_close(&input.demux);
+    input_ctx = NULL;
 
     if (--loop_count > 0)
         goto loopy;
 
-    drmprime_out_delete(dpo);
+finish:
+    avcodec_parameters_free(&decoder_par);
+    if (output_file)
+        fclose(output_file);
 
-    return 0;
+done:
+    drmprime_dump_delete(dump_env);
+    // Leased outputs go before the one they lease from
+    while (n_outputs > 0)
+        drmprime_out_delete(outputs[--n_outputs]);
+    frame_pool_delete(&frame_pool);
+
+    if (bench_env != NULL) {
+        FILE *const bf = bench_name == NULL ? stdout : fopen(bench_name, "w");
+        if (bf == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", bench_name, strerror(errno));
+        }
+        else {
+            bench_report(bench_env, bf, bench_fmt, in_filelist[0]);
+            if (bf != stdout)
+                fclose(bf);
+        }
+        bench_delete(bench_env);
+    }
+
+    if (trace_name != NULL) {
+        FILE *const tf = fopen(trace_name, "w");
+        if (tf == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", trace_name, strerror(errno));
+        }
+        else {
+            trace_write_chrome(tf);
+            fclose(tf);
+        }
+    }
+    if (trace_summary)
+        trace_write_summary(stderr);
+    trace_uninit();
+
+    return exit_code;
 }
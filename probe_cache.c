@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+// On-disk cache of what avformat_find_stream_info works out about the
+// video stream, so that a file we have played before can go straight to
+// the decoder.  One line per entry, keyed on path, mtime and size; the
+// last matching line wins:
+//
+// <path> <mtime> <size> <stream> <time_base> <codec params...> <extradata hex>
+//
+// (tab separated).  Only regular files are cached.
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libavformat/avformat.h>
+
+#include "probe_cache.h"
+
+// Mosaic opens its inputs in parallel
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct probe_key_s
+{
+    int64_t mtime_s;
+    long mtime_ns;
+    int64_t size;
+} probe_key_t;
+
+static int file_key(const char *const name, probe_key_t *const key)
+{
+    struct stat st;
+
+    // Tabs & newlines would break the line format
+    if (strpbrk(name, "\t\n") != NULL || stat(name, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    key->mtime_s = st.st_mtim.tv_sec;
+    key->mtime_ns = st.st_mtim.tv_nsec;
+    key->size = st.st_size;
+    return 0;
+}
+
+static int hex_val(const char c)
+{
+    return c >= '0' && c <= '9' ? c - '0' :
+        c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+        c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// Fill st->codecpar from the rest of a line that matched on path.
+// Returns 0 if the key matched and the entry fits the stream.
+static int entry_apply(const char *p, const probe_key_t *const key,
+                       AVFormatContext *const ctx, int *const pstream)
+{
+    probe_key_t k;
+    int stream, tb_num, tb_den;
+    int codec_id, format, width, height, profile, level, field_order;
+    int color_range, color_primaries, color_trc, color_space, video_delay;
+    int sar_num, sar_den;
+    unsigned int codec_tag;
+    int64_t bit_rate;
+    AVCodecParameters *par;
+    size_t hex_len;
+    int n = 0;
+    int i;
+
+    if (sscanf(p, "%" SCNd64 ".%ld\t%" SCNd64 "\t%d\t%d/%d\t%d\t%u\t%d\t%d\t%d\t%d\t%d\t%d"
+               "\t%d\t%d\t%d\t%d\t%d/%d\t%d\t%" SCNd64 "\t%n",
+               &k.mtime_s, &k.mtime_ns, &k.size, &stream, &tb_num, &tb_den,
+               &codec_id, &codec_tag, &format, &width, &height, &profile, &level,
+               &field_order, &color_range, &color_primaries, &color_trc, &color_space,
+               &sar_num, &sar_den, &video_delay, &bit_rate, &n) < 22 || n == 0)
+        return -1;
+    if (k.mtime_s != key->mtime_s || k.mtime_ns != key->mtime_ns || k.size != key->size)
+        return -1;
+
+    // The container header must agree with what we saw last time; if the
+    // stream is only found by probing (e.g. TS) we can't skip the probe
+    if (stream < 0 || (unsigned int)stream >= ctx->nb_streams ||
+        ctx->streams[stream]->time_base.num != tb_num ||
+        ctx->streams[stream]->time_base.den != tb_den)
+        return -1;
+    par = ctx->streams[stream]->codecpar;
+    if (par->codec_type != AVMEDIA_TYPE_VIDEO ||
+        (par->codec_id != AV_CODEC_ID_NONE && par->codec_id != (enum AVCodecID)codec_id))
+        return -1;
+
+    p += n;
+    hex_len = strcspn(p, "\n");
+    if ((hex_len & 1) != 0)
+        return -1;
+
+    av_freep(&par->extradata);
+    par->extradata_size = 0;
+    if (hex_len != 0) {
+        if ((par->extradata = av_mallocz(hex_len / 2 + AV_INPUT_BUFFER_PADDING_SIZE)) == NULL)
+            return -1;
+        for (i = 0; i != (int)hex_len / 2; ++i) {
+            const int hi = hex_val(p[i * 2]);
+            const int lo = hex_val(p[i * 2 + 1]);
+            if (hi < 0 || lo < 0) {
+                av_freep(&par->extradata);
+                return -1;
+            }
+            par->extradata[i] = (hi << 4) | lo;
+        }
+        par->extradata_size = hex_len / 2;
+    }
+
+    par->codec_id = codec_id;
+    par->codec_tag = codec_tag;
+    par->format = format;
+    par->width = width;
+    par->height = height;
+    par->profile = profile;
+    par->level = level;
+    par->field_order = field_order;
+    par->color_range = color_range;
+    par->color_primaries = color_primaries;
+    par->color_trc = color_trc;
+    par->color_space = color_space;
+    par->sample_aspect_ratio = (AVRational){sar_num, sar_den};
+    par->video_delay = video_delay;
+    par->bit_rate = bit_rate;
+    *pstream = stream;
+    return 0;
+}
+
+int probe_cache_get(const char *const cache_name, const char *const name, AVFormatContext *const ctx)
+{
+    const size_t name_len = strlen(name);
+    probe_key_t key;
+    FILE *f;
+    char *line = NULL;
+    size_t line_size = 0;
+    int stream = -1;
+
+    if (cache_name == NULL || file_key(name, &key) != 0)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    if ((f = fopen(cache_name, "r")) != NULL) {
+        while (getline(&line, &line_size, f) > 0) {
+            int s;
+            if (strncmp(line, name, name_len) == 0 && line[name_len] == '\t' &&
+                entry_apply(line + name_len + 1, &key, ctx, &s) == 0)
+                stream = s;
+        }
+        fclose(f);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(line);
+    return stream;
+}
+
+void probe_cache_put(const char *const cache_name, const char *const name,
+                     const AVFormatContext *const ctx, const int stream)
+{
+    const AVStream *const st = ctx->streams[stream];
+    const AVCodecParameters *const par = st->codecpar;
+    probe_key_t key;
+    FILE *f;
+    int i;
+
+    if (cache_name == NULL || file_key(name, &key) != 0)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    if ((f = fopen(cache_name, "a")) == NULL) {
+        fprintf(stderr, "Failed to open probe cache %s\n", cache_name);
+    }
+    else {
+        fprintf(f, "%s\t%" PRId64 ".%ld\t%" PRId64 "\t%d\t%d/%d\t%d\t%u\t%d\t%d\t%d\t%d\t%d\t%d"
+                "\t%d\t%d\t%d\t%d\t%d/%d\t%d\t%" PRId64 "\t",
+                name, key.mtime_s, key.mtime_ns, key.size, stream,
+                st->time_base.num, st->time_base.den,
+                par->codec_id, par->codec_tag, par->format, par->width, par->height,
+                par->profile, par->level, par->field_order, par->color_range,
+                par->color_primaries, par->color_trc, par->color_space,
+                par->sample_aspect_ratio.num, par->sample_aspect_ratio.den,
+                par->video_delay, par->bit_rate);
+        for (i = 0; i != par->extradata_size; ++i)
+            fprintf(f, "%02x", par->extradata[i]);
+        fputc('\n', f);
+        fclose(f);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,10 @@
+struct AVFormatContext;
+
+// Look name (a local file) up in the probe cache.  On a hit the cached
+// codec parameters are written to the stream's codecpar and the index of
+// the video stream is returned; otherwise -1 and ctx is untouched.
+// cache_name may be NULL for no cache.
+int probe_cache_get(const char * cache_name, const char * name, struct AVFormatContext * ctx);
+// Remember the (probed) parameters of ctx->streams[stream] for name
+void probe_cache_put(const char * cache_name, const char * name,
+                     const struct AVFormatContext * ctx, int stream);
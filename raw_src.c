@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Frames from a raw video file for exercising the display path with no
+// decoder.  The file is mmapped and each frame copied once into its own
+// CMA dma-buf (from a dma-heap) laid out as the display wants it; after
+// that the same buffers are handed out again and again so the display's
+// FB cache imports each of them just the once.
+//
+// yuv420p and nv12 files are packed rows, plane after plane, as written by
+// -o.  sand128 files are NV12 in 128 byte wide columns, as the Pi HEVC
+// decoder makes them and --dump writes them: each frame is ceil(w / 128)
+// columns of 128 x (h16 * 3 / 2) bytes, where h16 is h rounded up to 16,
+// the luma lines above the chroma ones.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <drm_fourcc.h>
+
+#include "libavutil/buffer.h"
+#include "libavutil/common.h"
+#include "libavutil/frame.h"
+#include "libavutil/hwcontext_drm.h"
+#include "libavutil/mem.h"
+
+#include "raw_src.h"
+
+#define ERRSTR strerror(errno)
+
+// Pitch alignment of the linear formats
+#define RAW_PITCH_ALIGN 64
+
+struct raw_src_s {
+    unsigned int width;
+    unsigned int height;
+    unsigned int n;
+    AVBufferRef **bufs;         // AVDRMFrameDescriptor, one per frame
+};
+
+// Where each plane of a frame goes in the file & the dma-buf
+typedef struct raw_layout_s {
+    uint32_t fourcc;
+    uint64_t modifier;
+    unsigned int n_planes;
+    struct {
+        size_t file_offset;
+        size_t row_len;         // Bytes per row in the file
+        unsigned int rows;
+        size_t offset;
+        unsigned int pitch;
+    } p[3];
+    size_t file_size;           // Bytes per frame in the file
+    size_t size;                // ...and in the dma-buf
+} raw_layout_t;
+
+static int raw_layout(raw_layout_t *const rl, const char *const format,
+                      const unsigned int w, const unsigned int h)
+{
+    const unsigned int cw = (w + 1) / 2;
+    const unsigned int ch = (h + 1) / 2;
+    const unsigned int pitch = FFALIGN(w, RAW_PITCH_ALIGN);
+    unsigned int i;
+
+    memset(rl, 0, sizeof(*rl));
+    rl->modifier = DRM_FORMAT_MOD_LINEAR;
+
+    if (strcmp(format, "yuv420p") == 0) {
+        rl->fourcc = DRM_FORMAT_YUV420;
+        rl->n_planes = 3;
+        rl->p[0].row_len = w;
+        rl->p[0].rows = h;
+        rl->p[0].pitch = pitch;
+        for (i = 1; i != 3; ++i) {
+            rl->p[i].row_len = cw;
+            rl->p[i].rows = ch;
+            rl->p[i].pitch = pitch / 2;
+        }
+    }
+    else if (strcmp(format, "nv12") == 0) {
+        rl->fourcc = DRM_FORMAT_NV12;
+        rl->n_planes = 2;
+        rl->p[0].row_len = w;
+        rl->p[0].rows = h;
+        rl->p[0].pitch = pitch;
+        rl->p[1].row_len = cw * 2;
+        rl->p[1].rows = ch;
+        rl->p[1].pitch = pitch;
+    }
+    else if (strcmp(format, "sand128") == 0) {
+        // Copied as a lump; the columns have no rows to speak of
+        const unsigned int h16 = FFALIGN(h, 16);
+        const unsigned int col_height = h16 * 3 / 2;
+        const unsigned int stride = FFALIGN(w, 128);
+
+        rl->fourcc = DRM_FORMAT_NV12;
+        rl->modifier = DRM_FORMAT_MOD_BROADCOM_SAND128_COL_HEIGHT(col_height);
+        rl->n_planes = 2;
+        rl->p[0].pitch = stride;
+        rl->p[1].offset = (size_t)h16 * 128;
+        rl->p[1].pitch = stride;
+        rl->file_size = (size_t)stride * col_height;
+        rl->size = rl->file_size;
+        return 0;
+    }
+    else {
+        fprintf(stderr, "Unknown raw format '%s' (yuv420p, nv12 or sand128)\n", format);
+        return -1;
+    }
+
+    for (i = 0; i != rl->n_planes; ++i) {
+        rl->p[i].file_offset = rl->file_size;
+        rl->p[i].offset = rl->size;
+        rl->file_size += rl->p[i].row_len * rl->p[i].rows;
+        rl->size += (size_t)rl->p[i].pitch * rl->p[i].rows;
+    }
+    return 0;
+}
+
+static int heap_open(void)
+{
+    // Contiguous first: the Pi display can't scan out anything else
+    static const char *const heaps[] = {
+        "/dev/dma_heap/linux,cma",
+        "/dev/dma_heap/reserved",
+        "/dev/dma_heap/system",
+    };
+    unsigned int i;
+    int fd;
+
+    for (i = 0; i != FF_ARRAY_ELEMS(heaps); ++i) {
+        if ((fd = open(heaps[i], O_RDWR | O_CLOEXEC)) >= 0)
+            return fd;
+    }
+    fprintf(stderr, "No dma-heap to allocate from: %s\n", ERRSTR);
+    return -1;
+}
+
+static void raw_buf_free(void *opaque, uint8_t *data)
+{
+    AVDRMFrameDescriptor *const desc = (AVDRMFrameDescriptor *)data;
+
+    (void)opaque;
+    close(desc->objects[0].fd);
+    av_free(desc);
+}
+
+// A dma-buf with frame n of the file in it
+static AVBufferRef *raw_buf_new(const int heap_fd, const raw_layout_t *const rl,
+                                const uint8_t *const src)
+{
+    struct dma_heap_allocation_data alloc = {
+        .len = rl->size,
+        .fd_flags = O_RDWR | O_CLOEXEC,
+    };
+    struct dma_buf_sync sync = {.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE};
+    AVDRMFrameDescriptor *desc;
+    AVBufferRef *buf;
+    uint8_t *dst;
+    unsigned int i, y;
+
+    if (ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc) != 0) {
+        fprintf(stderr, "dma-heap alloc of %zu failed: %s\n", rl->size, ERRSTR);
+        return NULL;
+    }
+
+    if ((dst = mmap(NULL, rl->size, PROT_READ | PROT_WRITE, MAP_SHARED, alloc.fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "mmap of dma-buf failed: %s\n", ERRSTR);
+        close(alloc.fd);
+        return NULL;
+    }
+    ioctl(alloc.fd, DMA_BUF_IOCTL_SYNC, &sync);
+    if (rl->modifier != DRM_FORMAT_MOD_LINEAR) {
+        memcpy(dst, src, rl->size);
+    }
+    else {
+        for (i = 0; i != rl->n_planes; ++i) {
+            for (y = 0; y != rl->p[i].rows; ++y)
+                memcpy(dst + rl->p[i].offset + (size_t)y * rl->p[i].pitch,
+                       src + rl->p[i].file_offset + y * rl->p[i].row_len, rl->p[i].row_len);
+        }
+    }
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+    ioctl(alloc.fd, DMA_BUF_IOCTL_SYNC, &sync);
+    munmap(dst, rl->size);
+
+    if ((desc = av_mallocz(sizeof(*desc))) == NULL)
+        goto fail;
+    desc->nb_objects = 1;
+    desc->objects[0].fd = alloc.fd;
+    desc->objects[0].size = rl->size;
+    desc->objects[0].format_modifier = rl->modifier;
+    desc->nb_layers = 1;
+    desc->layers[0].format = rl->fourcc;
+    desc->layers[0].nb_planes = rl->n_planes;
+    for (i = 0; i != rl->n_planes; ++i) {
+        desc->layers[0].planes[i].object_index = 0;
+        desc->layers[0].planes[i].offset = rl->p[i].offset;
+        desc->layers[0].planes[i].pitch = rl->p[i].pitch;
+    }
+
+    if ((buf = av_buffer_create((uint8_t *)desc, sizeof(*desc), raw_buf_free, NULL, 0)) == NULL) {
+        av_free(desc);
+        goto fail;
+    }
+    return buf;
+
+fail:
+    close(alloc.fd);
+    return NULL;
+}
+
+unsigned int raw_src_count(const raw_src_t *const rs)
+{
+    return rs->n;
+}
+
+int raw_src_frame(raw_src_t *const rs, AVFrame *const frame, const unsigned int n)
+{
+    AVBufferRef *const buf = rs->bufs[n % rs->n];
+
+    av_frame_unref(frame);
+    if ((frame->buf[0] = av_buffer_ref(buf)) == NULL)
+        return AVERROR(ENOMEM);
+    frame->data[0] = buf->data;
+    frame->format = AV_PIX_FMT_DRM_PRIME;
+    frame->width = rs->width;
+    frame->height = rs->height;
+    return 0;
+}
+
+void raw_src_delete(raw_src_t **const prs)
+{
+    raw_src_t *const rs = *prs;
+    unsigned int i;
+
+    if (rs == NULL)
+        return;
+    *prs = NULL;
+
+    for (i = 0; i != rs->n; ++i)
+        av_buffer_unref(rs->bufs + i);
+    free(rs->bufs);
+    free(rs);
+}
+
+raw_src_t *raw_src_new(const char *const name, const char *const format,
+                       const unsigned int width, const unsigned int height,
+                       const unsigned int max_frames)
+{
+    raw_src_t *rs;
+    raw_layout_t rl;
+    struct stat st;
+    uint8_t *map = MAP_FAILED;
+    unsigned int n;
+    int heap_fd = -1;
+    int fd;
+
+    if (width == 0 || height == 0 || raw_layout(&rl, format, width, height) != 0)
+        return NULL;
+
+    if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", name, ERRSTR);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", name, ERRSTR);
+        goto fail_close;
+    }
+    if ((n = st.st_size / rl.file_size) == 0) {
+        fprintf(stderr, "%s is smaller than one %ux%u %s frame\n", name, width, height, format);
+        goto fail_close;
+    }
+    if (n > max_frames)
+        n = max_frames;
+
+    if ((rs = calloc(1, sizeof(*rs))) == NULL ||
+        (rs->bufs = calloc(n, sizeof(*rs->bufs))) == NULL)
+        goto fail_free;
+    rs->width = width;
+    rs->height = height;
+
+    if ((map = mmap(NULL, n * rl.file_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Failed to mmap %s: %s\n", name, ERRSTR);
+        goto fail_free;
+    }
+    if ((heap_fd = heap_open()) < 0)
+        goto fail_free;
+
+    for (rs->n = 0; rs->n != n; ++rs->n) {
+        if ((rs->bufs[rs->n] = raw_buf_new(heap_fd, &rl, map + rs->n * rl.file_size)) == NULL)
+            goto fail_free;
+    }
+
+    fprintf(stderr, "Raw: %u %ux%u %s frames from %s\n", n, width, height, format, name);
+    close(heap_fd);
+    munmap(map, n * rl.file_size);
+    close(fd);
+    return rs;
+
+fail_free:
+    if (heap_fd >= 0)
+        close(heap_fd);
+    if (map != MAP_FAILED)
+        munmap(map, n * rl.file_size);
+    raw_src_delete(&rs);
+fail_close:
+    close(fd);
+    return NULL;
+}
@@ -0,0 +1,15 @@
+struct AVFrame;
+typedef struct raw_src_s raw_src_t;
+
+// Number of frames loaded
+unsigned int raw_src_count(const raw_src_t * rs);
+// Set frame to a DRM_PRIME ref to loaded frame n (mod the count).  The
+// buffers are never written again so frames may be shown as many times as
+// wanted while still on screen.
+int raw_src_frame(raw_src_t * rs, struct AVFrame * frame, unsigned int n);
+// Frames still held elsewhere stay valid
+void raw_src_delete(raw_src_t ** prs);
+// Load up to max_frames frames of a raw (headerless) file of format
+// ("yuv420p", "nv12" or "sand128") width x height into dma-bufs
+raw_src_t * raw_src_new(const char * name, const char * format,
+                        unsigned int width, unsigned int height, unsigned int max_frames);
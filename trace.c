@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Events go into one global ring; a slot is claimed with a fetch_add so
+// any thread can record without locks.  Per-event log2 histograms are kept
+// alongside so the summary covers the whole run even if the ring wraps.
+// Dumps are only valid once the recording threads have stopped.
+
+#include "trace.h"
+
+#if ENABLE_TRACE
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#define HIST_BUCKETS 32     // bucket n: [2^(n-1), 2^n) us
+
+typedef struct trace_ent_s
+{
+    int64_t start;          // us, CLOCK_MONOTONIC
+    int64_t dur;            // < 0 => instant
+    int64_t val;
+    uint32_t tid;
+    uint32_t ev;
+} trace_ent_t;
+
+static const char * const ev_names[TRACE_EV_COUNT] = {
+    [TRACE_EV_DEMUX]         = "demux",
+    [TRACE_EV_SEND_PACKET]   = "send_packet",
+    [TRACE_EV_RECEIVE_FRAME] = "receive_frame",
+    [TRACE_EV_FILTER]        = "filter",
+    [TRACE_EV_QUEUE_PUT]     = "queue_put",
+    [TRACE_EV_QUEUE_GET]     = "queue_get",
+    [TRACE_EV_PACE]          = "pace",
+    [TRACE_EV_FB_IMPORT]     = "fb_import",
+    [TRACE_EV_FLIP_WAIT]     = "flip_wait",
+    [TRACE_EV_COMMIT]        = "commit",
+    [TRACE_EV_VBLANK_MISS]   = "vblank_miss",
+};
+
+static trace_ent_t *ring;
+static unsigned int ring_mask;
+static atomic_uint ring_n;
+
+static atomic_ullong hist[TRACE_EV_COUNT][HIST_BUCKETS];
+static atomic_ullong ev_count[TRACE_EV_COUNT];
+static atomic_ullong ev_total[TRACE_EV_COUNT];     // us, or sum of val for instants
+
+static __thread uint32_t my_tid;
+
+int64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_add(const enum trace_ev_e ev, const int64_t start, const int64_t val)
+{
+    const int64_t now = trace_now();
+    const int64_t dur = start < 0 ? -1 : now - start;
+    trace_ent_t *te;
+
+    if (dur >= 0) {
+        unsigned int b = 0;
+        while (b < HIST_BUCKETS - 1 && (dur >> b) != 0)
+            ++b;
+        atomic_fetch_add_explicit(&hist[ev][b], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&ev_total[ev], dur, memory_order_relaxed);
+    }
+    else {
+        atomic_fetch_add_explicit(&ev_total[ev], val, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&ev_count[ev], 1, memory_order_relaxed);
+
+    if (ring == NULL)
+        return;
+
+    if (my_tid == 0)
+        my_tid = syscall(SYS_gettid);
+
+    te = ring + (atomic_fetch_add_explicit(&ring_n, 1, memory_order_relaxed) & ring_mask);
+    te->start = start < 0 ? now : start;
+    te->dur = dur;
+    te->val = val;
+    te->tid = my_tid;
+    te->ev = ev;
+}
+
+int trace_init(const unsigned int n_events)
+{
+    unsigned int n = 1;
+
+    while (n < n_events)
+        n <<= 1;
+    if ((ring = calloc(n, sizeof(*ring))) == NULL)
+        return -1;
+    ring_mask = n - 1;
+    atomic_store(&ring_n, 0);
+    return 0;
+}
+
+void trace_write_chrome(FILE *const f)
+{
+    const unsigned int n = atomic_load(&ring_n);
+    const unsigned int first = n > ring_mask + 1 ? n - (ring_mask + 1) : 0;
+    const int pid = getpid();
+    unsigned int i;
+
+    if (ring == NULL)
+        return;
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (i = first; i != n; ++i) {
+        const trace_ent_t *const te = ring + (i & ring_mask);
+        if (te->dur < 0)
+            fprintf(f, "{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %" PRId64
+                    ", \"pid\": %d, \"tid\": %u, \"args\": {\"n\": %" PRId64 "}}",
+                    ev_names[te->ev], te->start, pid, te->tid, te->val);
+        else
+            fprintf(f, "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %" PRId64 ", \"dur\": %" PRId64
+                    ", \"pid\": %d, \"tid\": %u, \"args\": {\"pts\": %" PRId64 "}}",
+                    ev_names[te->ev], te->start, te->dur, pid, te->tid, te->val);
+        fputs(i + 1 == n ? "\n" : ",\n", f);
+    }
+    fprintf(f, "]}\n");
+}
+
+void trace_write_summary(FILE *const f)
+{
+    unsigned int ev, b;
+
+    for (ev = 0; ev != TRACE_EV_COUNT; ++ev) {
+        const unsigned long long count = atomic_load(&ev_count[ev]);
+        const unsigned long long total = atomic_load(&ev_total[ev]);
+        unsigned long long acc = 0;
+        unsigned int p50 = 0, p99 = 0;
+
+        if (count == 0)
+            continue;
+
+        if (ev == TRACE_EV_VBLANK_MISS) {
+            fprintf(f, "%-14s events %llu, vblanks missed %llu\n", ev_names[ev], count, total);
+            continue;
+        }
+
+        // Percentiles are bucket upper bounds
+        for (b = 0; b != HIST_BUCKETS; ++b) {
+            acc += atomic_load(&hist[ev][b]);
+            if (p50 == 0 && acc * 2 >= count)
+                p50 = 1U << b;
+            if (p99 == 0 && acc * 100 >= count * 99)
+                p99 = 1U << b;
+        }
+
+        fprintf(f, "%-14s n=%-8llu mean=%8.1fus p50<%-8uus p99<%-8uus |", ev_names[ev],
+                count, (double)total / count, p50, p99);
+        for (b = 0; b != HIST_BUCKETS; ++b) {
+            const unsigned long long h = atomic_load(&hist[ev][b]);
+            if (h != 0)
+                fprintf(f, " <%u:%llu", 1U << b, h);
+        }
+        fputc('\n', f);
+    }
+}
+
+void trace_uninit(void)
+{
+    free(ring);
+    ring = NULL;
+}
+
+#endif
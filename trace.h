@@ -0,0 +1,61 @@
+// Low overhead per-stage timing.  Build with "make TRACE=1" to enable;
+// otherwise every TRACE_ macro compiles to nothing.
+//
+// Usage:
+//     TRACE_BEGIN(t0);
+//     ...work...
+//     TRACE_END(TRACE_EV_FB_IMPORT, t0, frame->pts);
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum trace_ev_e {
+    TRACE_EV_DEMUX = 0,     // av_read_frame
+    TRACE_EV_SEND_PACKET,   // avcodec_send_packet
+    TRACE_EV_RECEIVE_FRAME, // avcodec_receive_frame (successful)
+    TRACE_EV_FILTER,        // buffersrc add + buffersink get
+    TRACE_EV_QUEUE_PUT,     // Decode side: drmprime_out_display incl. waiting for space
+    TRACE_EV_QUEUE_GET,     // Display side: waiting for a frame
+    TRACE_EV_PACE,          // Sleeping for the right vblank
+    TRACE_EV_FB_IMPORT,     // FB cache lookup (+ import on miss)
+    TRACE_EV_FLIP_WAIT,     // Waiting for the previous flip
+    TRACE_EV_COMMIT,        // Atomic commit / SetPlane
+    TRACE_EV_VBLANK_MISS,   // Instant: flip landed a vblank (or more) late
+    TRACE_EV_COUNT
+};
+
+#if ENABLE_TRACE
+
+int64_t trace_now(void);
+// Record an event that started at start (trace_now() time) and ends now.
+// start < 0 records an instant event.  val is pts or count.
+void trace_add(enum trace_ev_e ev, int64_t start, int64_t val);
+
+// Events kept (rounded up to a power of 2); oldest are overwritten
+int trace_init(unsigned int n_events);
+void trace_write_chrome(FILE * f);
+void trace_write_summary(FILE * f);
+void trace_uninit(void);
+
+#define TRACE_BEGIN(t) const int64_t t = trace_now()
+#define TRACE_END(ev, t, val) trace_add((ev), (t), (val))
+#define TRACE_INSTANT(ev, val) trace_add((ev), -1, (val))
+
+#else
+
+static inline int trace_init(unsigned int n_events) { (void)n_events; return -1; }
+static inline void trace_write_chrome(FILE * f) { (void)f; }
+static inline void trace_write_summary(FILE * f) { (void)f; }
+static inline void trace_uninit(void) {}
+
+#define TRACE_BEGIN(t)
+#define TRACE_END(ev, t, val) do { (void)(val); } while (0)
+#define TRACE_INSTANT(ev, val) do { (void)(val); } while (0)
+
+#endif
+
+#endif
+
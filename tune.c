@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+// Decoder settings picked from the stream, the machine and free CMA.  On
+// a Pi every decoded frame lives in CMA so the decoder's reference frames,
+// one per frame thread and everything the display holds on to all have to
+// fit at once.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+
+#include "tune.h"
+
+int64_t tune_cma_free_kb(void)
+{
+    FILE *const f = fopen("/proc/meminfo", "r");
+    char line[128];
+    int64_t kb = -1;
+
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "CmaFree: %" SCNd64, &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+unsigned int tune_dpb_frames(const AVCodecParameters *const par)
+{
+    const uint64_t pels = (uint64_t)par->width * par->height;
+
+    switch (par->codec_id) {
+        case AV_CODEC_ID_H264:
+        {
+            // Level 5.1 MaxDpbMbs
+            const uint64_t mbs = ((par->width + 15) / 16) * ((par->height + 15) / 16);
+            return mbs == 0 ? 16 : FFMAX(1, FFMIN(16, 184320 / mbs));
+        }
+        case AV_CODEC_ID_HEVC:
+            // Level 5.x MaxLumaPs & maxDpbSize
+            return pels > 8912896 / 4 * 3 ? 6 : pels > 8912896 / 2 ? 8 :
+                pels > 8912896 / 4 ? 12 : 16;
+        case AV_CODEC_ID_VP9:
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+// Size of one decoded frame, allowing for alignment and 10-bit packing
+static uint64_t frame_bytes(const AVCodecParameters *const par)
+{
+    const AVPixFmtDescriptor *const desc = av_pix_fmt_desc_get(par->format);
+    const uint64_t bytes = (uint64_t)((par->width + 31) & ~31) * ((par->height + 15) & ~15) * 3 / 2;
+
+    // SAND30 / P030 pack 3 10-bit samples in 32 bits
+    return desc != NULL && desc->comp[0].depth > 8 ? bytes * 4 / 3 : bytes;
+}
+
+int tune_decode(tune_t *const t, const AVCodecParameters *const par,
+                const unsigned int held, const int low_latency)
+{
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    const int big = par->width * par->height > 1920 * 1088;
+    const unsigned int dpb = tune_dpb_frames(par);
+    const uint64_t bytes = frame_bytes(par);
+    const int64_t cma_kb = tune_cma_free_kb();
+    const uint64_t cma = cma_kb < 0 ? 0 : (uint64_t)cma_kb * 1024;
+    // Keep some CMA back for everyone else
+    const uint64_t budget = cma / 8 * 7;
+    uint64_t need;
+
+    // Frame threads each hold a frame and add a frame of latency; past
+    // 1080p the parsing needs all the cores we can give it
+    t->threads = low_latency || cores <= 1 ? 1 : FFMIN(cores - 1 + big, big ? 4 : 3);
+    // Cover what the display holds so the decoder never waits for it
+    t->extra_frames = held;
+    t->v4l2_out = low_latency ? 2 : big ? 4 : 6;
+
+    need = (dpb + t->threads + t->extra_frames) * bytes;
+    if (cma != 0 && need > budget && t->threads > 1) {
+        t->threads = 1;
+        need = (dpb + t->threads + t->extra_frames) * bytes;
+    }
+    // Then as many extra frames as fit: the decoder may wait on the display
+    // now and then but won't fail to allocate
+    if (cma != 0 && need > budget) {
+        const uint64_t fit = budget / bytes;
+
+        if (fit < dpb + t->threads) {
+            fprintf(stderr, "Auto tune %dx%d: not enough CMA for this stream: %u reference frames "
+                    "need %" PRIu64 "MB, %" PRIu64 "MB CMA free\n", par->width, par->height,
+                    dpb, ((dpb + t->threads) * bytes) >> 20, cma >> 20);
+            return -1;
+        }
+        fprintf(stderr, "Auto tune %dx%d: only room in CMA for %u of %u extra frames: "
+                "try a smaller --queue or --retain\n", par->width, par->height,
+                (unsigned int)(fit - dpb - t->threads), t->extra_frames);
+        t->extra_frames = fit - dpb - t->threads;
+        need = (dpb + t->threads + t->extra_frames) * bytes;
+    }
+
+    fprintf(stderr, "Auto tune %dx%d: %u threads, %u extra frames, %u bitstream buffers: "
+            "%" PRIu64 "MB of frames", par->width, par->height,
+            t->threads, t->extra_frames, t->v4l2_out, need >> 20);
+    if (cma == 0)
+        fprintf(stderr, " (CMA free unknown)\n");
+    else
+        fprintf(stderr, ", %" PRIu64 "MB CMA free\n", cma >> 20);
+    return 0;
+}
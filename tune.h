@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+struct AVCodecParameters;
+
+typedef struct tune_s {
+    unsigned int threads;       // AVCodecContext.thread_count
+    unsigned int extra_frames;  // extra_hw_frames / v4l2dec CAPTURE buffers
+    unsigned int v4l2_out;      // v4l2dec / v4l2m2m OUTPUT buffers
+} tune_t;
+
+// CmaFree from /proc/meminfo in kB, -1 if there isn't one
+int64_t tune_cma_free_kb(void);
+
+// Worst case reference frames held by the decoder at this size (the
+// level limits of the highest level we are likely to see)
+unsigned int tune_dpb_frames(const struct AVCodecParameters * par);
+
+// Pick decode settings for a stream from its size & codec, the number of
+// cores and free CMA.  held is the most frames the outputs hold on to at
+// once (see drmprime_out_frames_held).  Reports what it chose to stderr.
+// If the frames won't fit in CMA the extra frames are cut to what does
+// and if not even the reference frames fit it fails with -1.
+int tune_decode(tune_t * t, const struct AVCodecParameters * par,
+                unsigned int held, int low_latency);
@@ -0,0 +1,813 @@
+/*
+ * Copyright (c) 2020 John Cox for Raspberry Pi Trading
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+// Minimal stateful V4L2 M2M decoder, talking to the device directly rather
+// than via h264_v4l2m2m so that we control the queue depths and when we
+// block.  CAPTURE buffers are exported once as dma-bufs and handed out as
+// DRM_PRIME frames so the FB cache sees the same few buffers go round.
+// Each CAPTURE allocation gets its own hw_frames_ctx so the FB cache (and
+// the dump) can tell when a resolution change has replaced it.
+//
+// Only single plane NV12 / YUV420 capture is handled.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/videodev2.h>
+#include <drm_fourcc.h>
+
+#include "libavcodec/avcodec.h"
+#include "libavcodec/bsf.h"
+#include "libavutil/frame.h"
+#include "libavutil/hwcontext.h"
+#include "libavutil/hwcontext_drm.h"
+
+#include "v4l2dec.h"
+
+#define ERRSTR strerror(errno)
+
+#define OUT_MAX 32
+#define CAP_MAX 32
+// In flight packets whose pts we remember - more than OUT_MAX + decoder delay
+#define PTS_MAP_SIZE 128
+
+typedef struct cap_buf_s
+{
+    struct v4l2dec_env_s *dec;
+    unsigned int index;
+    unsigned int gen;           // Allocation generation this belongs to
+    int held;                   // In a frame
+    AVDRMFrameDescriptor desc;
+} cap_buf_t;
+
+typedef struct out_buf_s
+{
+    void *map;
+    size_t size;
+    int queued;
+} out_buf_t;
+
+struct v4l2dec_env_s
+{
+    int fd;
+    atomic_int ref_count;       // Us + every frame out
+    pthread_mutex_t lock;       // CAPTURE state vs frames being freed
+
+    AVBSFContext *bsf;          // mp4 -> annex B if needed
+    AVPacket *pending;          // bsf output waiting for an OUTPUT buffer
+    AVPacket *bsf_in;           // Reused for the ref the bsf takes
+    int pending_valid;
+
+    unsigned int n_out;
+    out_buf_t out_bufs[OUT_MAX];
+
+    unsigned int n_cap_extra;
+    unsigned int n_cap;
+    cap_buf_t *cap_bufs[CAP_MAX];
+    unsigned int cap_gen;
+    AVBufferRef *hw_device;     // DRM device with no fd, for cap_frames
+    AVBufferRef *cap_frames;    // AVHWFramesContext of this cap_gen
+    int cap_streaming;
+
+    unsigned int width;
+    unsigned int height;
+    struct v4l2_rect visible;
+    uint32_t drm_fourcc;
+
+    int draining;
+    int eos;
+    unsigned int seq;
+    int64_t pts_map[PTS_MAP_SIZE];
+    int64_t opaque_map[PTS_MAP_SIZE];
+    int64_t reordered_opaque;   // For the next packet sent
+};
+
+static const struct {
+    enum AVCodecID codec_id;
+    uint32_t fourcc;
+} codec_map[] = {
+    {AV_CODEC_ID_H264,       V4L2_PIX_FMT_H264},
+    {AV_CODEC_ID_HEVC,       V4L2_PIX_FMT_HEVC},
+    {AV_CODEC_ID_MPEG2VIDEO, V4L2_PIX_FMT_MPEG2},
+    {AV_CODEC_ID_MPEG4,      V4L2_PIX_FMT_MPEG4},
+    {AV_CODEC_ID_VP8,        V4L2_PIX_FMT_VP8},
+    {AV_CODEC_ID_VP9,        V4L2_PIX_FMT_VP9},
+};
+
+static int xioctl(const int fd, const unsigned long req, void *const arg)
+{
+    int rv;
+    while ((rv = ioctl(fd, req, arg)) == -1 && errno == EINTR)
+        /* loop */;
+    return rv;
+}
+
+static void cap_buf_close(cap_buf_t *const cb)
+{
+    if (cb->desc.objects[0].fd >= 0)
+        close(cb->desc.objects[0].fd);
+    free(cb);
+}
+
+static void dec_unref(struct v4l2dec_env_s *const dec)
+{
+    unsigned int i;
+
+    if (atomic_fetch_sub(&dec->ref_count, 1) != 1)
+        return;
+
+    for (i = 0; i != CAP_MAX; ++i) {
+        if (dec->cap_bufs[i] != NULL)
+            cap_buf_close(dec->cap_bufs[i]);
+    }
+    av_buffer_unref(&dec->cap_frames);
+    av_buffer_unref(&dec->hw_device);
+    pthread_mutex_destroy(&dec->lock);
+    free(dec);
+}
+
+static int cap_queue(struct v4l2dec_env_s *const dec, const unsigned int index)
+{
+    struct v4l2_plane planes[VIDEO_MAX_PLANES] = {{0}};
+    struct v4l2_buffer buf = {
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+        .index = index,
+        .length = 1,
+        .m.planes = planes
+    };
+
+    if (xioctl(dec->fd, VIDIOC_QBUF, &buf) != 0) {
+        fprintf(stderr, "CAPTURE QBUF %u failed: %s\n", index, ERRSTR);
+        return -1;
+    }
+    return 0;
+}
+
+// AVBuffer free for a frame: give the buffer back to the decoder, or if it
+// is from an old allocation (or the decoder has gone) let it go
+static void cap_buf_free(void *opaque, uint8_t *data)
+{
+    cap_buf_t *const cb = opaque;
+    struct v4l2dec_env_s *const dec = cb->dec;
+
+    pthread_mutex_lock(&dec->lock);
+    cb->held = 0;
+    if (cb->gen != dec->cap_gen) {
+        cap_buf_close(cb);
+    }
+    else if (dec->cap_streaming && dec->fd >= 0) {
+        cap_queue(dec, cb->index);
+    }
+    pthread_mutex_unlock(&dec->lock);
+
+    dec_unref(dec);
+}
+
+// Drop all CAPTURE buffers we aren't holding in frames; held ones go when
+// their frames are freed.  Called with the lock held.
+static void cap_bufs_release(struct v4l2dec_env_s *const dec)
+{
+    unsigned int i;
+
+    ++dec->cap_gen;
+    for (i = 0; i != CAP_MAX; ++i) {
+        cap_buf_t *const cb = dec->cap_bufs[i];
+        if (cb == NULL)
+            continue;
+        dec->cap_bufs[i] = NULL;
+        if (!cb->held)
+            cap_buf_close(cb);
+    }
+    dec->n_cap = 0;
+}
+
+static void fill_desc(struct v4l2dec_env_s *const dec, cap_buf_t *const cb,
+                      const int fd, const size_t size, const unsigned int pitch)
+{
+    AVDRMFrameDescriptor *const desc = &cb->desc;
+    AVDRMLayerDescriptor *const layer = desc->layers + 0;
+    const unsigned int h = dec->height;
+
+    memset(desc, 0, sizeof(*desc));
+    desc->nb_objects = 1;
+    desc->objects[0].fd = fd;
+    desc->objects[0].size = size;
+    desc->objects[0].format_modifier = DRM_FORMAT_MOD_LINEAR;
+    desc->nb_layers = 1;
+    layer->format = dec->drm_fourcc;
+
+    layer->planes[0].offset = 0;
+    layer->planes[0].pitch = pitch;
+    if (dec->drm_fourcc == DRM_FORMAT_NV12) {
+        layer->nb_planes = 2;
+        layer->planes[1].offset = pitch * h;
+        layer->planes[1].pitch = pitch;
+    }
+    else {
+        layer->nb_planes = 3;
+        layer->planes[1].offset = pitch * h;
+        layer->planes[1].pitch = pitch / 2;
+        layer->planes[2].offset = pitch * h + (pitch / 2) * (h / 2);
+        layer->planes[2].pitch = pitch / 2;
+    }
+}
+
+// A frames context to mark this allocation's frames with.  It is never
+// asked for buffers; frames just hold a ref.
+static int cap_frames_new(struct v4l2dec_env_s *const dec)
+{
+    AVHWFramesContext *hwfc;
+    AVBufferRef *const frames = av_hwframe_ctx_alloc(dec->hw_device);
+
+    // New before old goes, so it can't get the old one's address
+    av_buffer_unref(&dec->cap_frames);
+    if ((dec->cap_frames = frames) == NULL)
+        return AVERROR(ENOMEM);
+    hwfc = (AVHWFramesContext *)dec->cap_frames->data;
+    hwfc->format = AV_PIX_FMT_DRM_PRIME;
+    hwfc->sw_format = dec->drm_fourcc == DRM_FORMAT_NV12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+    hwfc->width = dec->width;
+    hwfc->height = dec->height;
+    return av_hwframe_ctx_init(dec->cap_frames);
+}
+
+// (Re)build the CAPTURE queue after a source change event
+static int cap_setup(struct v4l2dec_env_s *const dec)
+{
+    struct v4l2_format fmt = {.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE};
+    struct v4l2_requestbuffers req = {
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+        .memory = V4L2_MEMORY_MMAP
+    };
+    struct v4l2_selection sel = {
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+        .target = V4L2_SEL_TGT_COMPOSE
+    };
+    struct v4l2_control ctrl = {.id = V4L2_CID_MIN_BUFFERS_FOR_CAPTURE};
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    unsigned int i;
+    int rv = -1;
+
+    pthread_mutex_lock(&dec->lock);
+
+    if (dec->cap_streaming) {
+        xioctl(dec->fd, VIDIOC_STREAMOFF, &type);
+        dec->cap_streaming = 0;
+    }
+    cap_bufs_release(dec);
+
+    // vb2 (since 5.0) orphans buffers still exported rather than failing;
+    // those the display holds are only freed once it lets go of them.
+    // The new cap_frames has the FB cache do that on the first new frame.
+    req.count = 0;
+    if (xioctl(dec->fd, VIDIOC_REQBUFS, &req) != 0) {
+        fprintf(stderr, "CAPTURE REQBUFS(0) failed: %s\n", ERRSTR);
+        goto fail;
+    }
+
+    if (xioctl(dec->fd, VIDIOC_G_FMT, &fmt) != 0) {
+        fprintf(stderr, "CAPTURE G_FMT failed: %s\n", ERRSTR);
+        goto fail;
+    }
+    if (fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_NV12 &&
+        fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_YUV420) {
+        fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_NV12;
+        if (xioctl(dec->fd, VIDIOC_S_FMT, &fmt) != 0 ||
+            (fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_NV12 &&
+             fmt.fmt.pix_mp.pixelformat != V4L2_PIX_FMT_YUV420)) {
+            fprintf(stderr, "Decoder can't produce NV12 or YUV420\n");
+            goto fail;
+        }
+    }
+    if (fmt.fmt.pix_mp.num_planes != 1) {
+        fprintf(stderr, "Multi-plane CAPTURE formats not supported\n");
+        goto fail;
+    }
+    dec->drm_fourcc = fmt.fmt.pix_mp.pixelformat == V4L2_PIX_FMT_NV12 ?
+        DRM_FORMAT_NV12 : DRM_FORMAT_YUV420;
+    dec->width = fmt.fmt.pix_mp.width;
+    dec->height = fmt.fmt.pix_mp.height;
+
+    dec->visible = (struct v4l2_rect){0, 0, dec->width, dec->height};
+    if (xioctl(dec->fd, VIDIOC_G_SELECTION, &sel) == 0)
+        dec->visible = sel.r;
+
+    if (cap_frames_new(dec) != 0) {
+        fprintf(stderr, "Failed to make CAPTURE frames context\n");
+        goto fail;
+    }
+
+    req.count = dec->n_cap_extra;
+    if (xioctl(dec->fd, VIDIOC_G_CTRL, &ctrl) == 0)
+        req.count += ctrl.value;
+    if (req.count > CAP_MAX)
+        req.count = CAP_MAX;
+    if (xioctl(dec->fd, VIDIOC_REQBUFS, &req) != 0) {
+        fprintf(stderr, "CAPTURE REQBUFS(%u) failed: %s\n", req.count, ERRSTR);
+        goto fail;
+    }
+    dec->n_cap = req.count > CAP_MAX ? CAP_MAX : req.count;
+
+    for (i = 0; i != dec->n_cap; ++i) {
+        struct v4l2_plane planes[VIDEO_MAX_PLANES] = {{0}};
+        struct v4l2_buffer buf = {
+            .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+            .memory = V4L2_MEMORY_MMAP,
+            .index = i,
+            .length = VIDEO_MAX_PLANES,
+            .m.planes = planes
+        };
+        struct v4l2_exportbuffer exp = {
+            .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+            .index = i,
+            .plane = 0,
+            .flags = O_RDWR | O_CLOEXEC
+        };
+        cap_buf_t *cb;
+
+        if (xioctl(dec->fd, VIDIOC_QUERYBUF, &buf) != 0 ||
+            xioctl(dec->fd, VIDIOC_EXPBUF, &exp) != 0) {
+            fprintf(stderr, "CAPTURE export %u failed: %s\n", i, ERRSTR);
+            goto fail;
+        }
+        if ((cb = calloc(1, sizeof(*cb))) == NULL) {
+            close(exp.fd);
+            goto fail;
+        }
+        cb->dec = dec;
+        cb->index = i;
+        cb->gen = dec->cap_gen;
+        fill_desc(dec, cb, exp.fd, planes[0].length, fmt.fmt.pix_mp.plane_fmt[0].bytesperline);
+        dec->cap_bufs[i] = cb;
+
+        if (cap_queue(dec, i) != 0)
+            goto fail;
+    }
+
+    if (xioctl(dec->fd, VIDIOC_STREAMON, &type) != 0) {
+        fprintf(stderr, "CAPTURE STREAMON failed: %s\n", ERRSTR);
+        goto fail;
+    }
+    dec->cap_streaming = 1;
+    rv = 0;
+
+fail:
+    pthread_mutex_unlock(&dec->lock);
+    return rv;
+}
+
+// Reclaim OUTPUT buffers the decoder has finished with
+static void out_reclaim(struct v4l2dec_env_s *const dec)
+{
+    for (;;) {
+        struct v4l2_plane planes[VIDEO_MAX_PLANES] = {{0}};
+        struct v4l2_buffer buf = {
+            .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+            .memory = V4L2_MEMORY_MMAP,
+            .length = 1,
+            .m.planes = planes
+        };
+
+        if (xioctl(dec->fd, VIDIOC_DQBUF, &buf) != 0)
+            break;
+        if (buf.index < dec->n_out)
+            dec->out_bufs[buf.index].queued = 0;
+    }
+}
+
+static int out_queue(struct v4l2dec_env_s *const dec, const AVPacket *const pkt)
+{
+    struct v4l2_plane planes[VIDEO_MAX_PLANES] = {{0}};
+    struct v4l2_buffer buf = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+        .length = 1,
+        .m.planes = planes
+    };
+    out_buf_t *ob = NULL;
+    unsigned int i;
+
+    out_reclaim(dec);
+    for (i = 0; i != dec->n_out; ++i) {
+        if (!dec->out_bufs[i].queued) {
+            ob = dec->out_bufs + i;
+            break;
+        }
+    }
+    if (ob == NULL)
+        return AVERROR(EAGAIN);
+
+    if (pkt->size > ob->size) {
+        fprintf(stderr, "Packet too big for OUTPUT buffer: %d > %zu\n", pkt->size, ob->size);
+        return AVERROR(ENOSPC);
+    }
+    memcpy(ob->map, pkt->data, pkt->size);
+
+    // The decoder copies the timestamp to the frame; use it as a tag to
+    // look the pts up by
+    ++dec->seq;
+    dec->pts_map[dec->seq % PTS_MAP_SIZE] = pkt->pts;
+    dec->opaque_map[dec->seq % PTS_MAP_SIZE] = dec->reordered_opaque;
+    buf.index = i;
+    buf.timestamp.tv_sec = dec->seq / 1000000;
+    buf.timestamp.tv_usec = dec->seq % 1000000;
+    planes[0].bytesused = pkt->size;
+    if (xioctl(dec->fd, VIDIOC_QBUF, &buf) != 0) {
+        fprintf(stderr, "OUTPUT QBUF failed: %s\n", ERRSTR);
+        return AVERROR(errno);
+    }
+    ob->queued = 1;
+    return 0;
+}
+
+static int start_drain(struct v4l2dec_env_s *const dec)
+{
+    struct v4l2_decoder_cmd cmd = {.cmd = V4L2_DEC_CMD_STOP};
+
+    if (dec->draining)
+        return 0;
+    dec->draining = 1;
+    if (xioctl(dec->fd, VIDIOC_DECODER_CMD, &cmd) != 0) {
+        fprintf(stderr, "DECODER_CMD STOP failed: %s\n", ERRSTR);
+        dec->eos = 1;
+    }
+    return 0;
+}
+
+int v4l2dec_send(v4l2dec_env_t *dec, const AVPacket *pkt)
+{
+    int rv;
+
+    if (dec->pending_valid) {
+        if ((rv = out_queue(dec, dec->pending)) != 0)
+            return rv;
+        av_packet_unref(dec->pending);
+        dec->pending_valid = 0;
+    }
+
+    if (pkt == NULL || pkt->size == 0) {
+        // Flush anything the bsf is holding before we stop
+        if (dec->bsf != NULL && !dec->draining) {
+            av_bsf_send_packet(dec->bsf, NULL);
+            while (av_bsf_receive_packet(dec->bsf, dec->pending) == 0) {
+                if ((rv = out_queue(dec, dec->pending)) != 0) {
+                    dec->pending_valid = 1;
+                    return rv;
+                }
+                av_packet_unref(dec->pending);
+            }
+        }
+        return start_drain(dec);
+    }
+
+    if (dec->bsf == NULL)
+        return out_queue(dec, pkt);
+
+    // The bsf takes the packet (it is left blank) so give it a ref
+    if ((rv = av_packet_ref(dec->bsf_in, pkt)) < 0)
+        return rv;
+    if ((rv = av_bsf_send_packet(dec->bsf, dec->bsf_in)) < 0) {
+        av_packet_unref(dec->bsf_in);
+        return rv;
+    }
+    while (av_bsf_receive_packet(dec->bsf, dec->pending) == 0) {
+        if ((rv = out_queue(dec, dec->pending)) != 0) {
+            // Packet has been taken - this one goes first next time
+            dec->pending_valid = 1;
+            return rv == AVERROR(EAGAIN) ? 0 : rv;
+        }
+        av_packet_unref(dec->pending);
+    }
+    return 0;
+}
+
+// Deal with any pending events.  Returns <0 on error.
+static int do_events(struct v4l2dec_env_s *const dec)
+{
+    struct v4l2_event ev;
+
+    while (xioctl(dec->fd, VIDIOC_DQEVENT, &ev) == 0) {
+        if (ev.type == V4L2_EVENT_SOURCE_CHANGE &&
+            (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION) != 0) {
+            if (cap_setup(dec) != 0)
+                return AVERROR(EIO);
+        }
+        else if (ev.type == V4L2_EVENT_EOS && dec->draining && !dec->cap_streaming) {
+            dec->eos = 1;
+        }
+    }
+    return 0;
+}
+
+// Try to take a frame off the CAPTURE queue
+static int cap_dequeue(struct v4l2dec_env_s *const dec, AVFrame *const frame)
+{
+    struct v4l2_plane planes[VIDEO_MAX_PLANES] = {{0}};
+    struct v4l2_buffer buf = {
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+        .length = 1,
+        .m.planes = planes
+    };
+    cap_buf_t *cb;
+    unsigned int seq;
+
+    if (!dec->cap_streaming)
+        return AVERROR(EAGAIN);
+
+    if (xioctl(dec->fd, VIDIOC_DQBUF, &buf) != 0) {
+        if (errno == EAGAIN)
+            return AVERROR(EAGAIN);
+        if (errno == EPIPE) {
+            dec->eos = 1;
+            return AVERROR_EOF;
+        }
+        fprintf(stderr, "CAPTURE DQBUF failed: %s\n", ERRSTR);
+        return AVERROR(errno);
+    }
+
+    if ((buf.flags & V4L2_BUF_FLAG_LAST) != 0)
+        dec->eos = 1;
+
+    pthread_mutex_lock(&dec->lock);
+    cb = buf.index < dec->n_cap ? dec->cap_bufs[buf.index] : NULL;
+    if (cb == NULL || planes[0].bytesused == 0 || (buf.flags & V4L2_BUF_FLAG_ERROR) != 0) {
+        // Nothing to show - straight back in
+        if (cb != NULL && !dec->eos)
+            cap_queue(dec, buf.index);
+        pthread_mutex_unlock(&dec->lock);
+        return dec->eos ? AVERROR_EOF : AVERROR(EAGAIN);
+    }
+    cb->held = 1;
+    pthread_mutex_unlock(&dec->lock);
+
+    atomic_fetch_add(&dec->ref_count, 1);
+    frame->buf[0] = av_buffer_create((uint8_t *)&cb->desc, sizeof(cb->desc),
+                                     cap_buf_free, cb, AV_BUFFER_FLAG_READONLY);
+    if (frame->buf[0] == NULL) {
+        cap_buf_free(cb, NULL);
+        return AVERROR(ENOMEM);
+    }
+    if ((frame->hw_frames_ctx = av_buffer_ref(dec->cap_frames)) == NULL) {
+        av_frame_unref(frame);
+        return AVERROR(ENOMEM);
+    }
+    frame->data[0] = (uint8_t *)&cb->desc;
+    frame->format = AV_PIX_FMT_DRM_PRIME;
+    frame->width = dec->width;
+    frame->height = dec->height;
+    frame->crop_left = dec->visible.left;
+    frame->crop_top = dec->visible.top;
+    frame->crop_right = dec->width - dec->visible.left - dec->visible.width;
+    frame->crop_bottom = dec->height - dec->visible.top - dec->visible.height;
+
+    seq = buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+    frame->pts = seq == 0 ? AV_NOPTS_VALUE : dec->pts_map[seq % PTS_MAP_SIZE];
+    frame->reordered_opaque = seq == 0 ? 0 : dec->opaque_map[seq % PTS_MAP_SIZE];
+    return 0;
+}
+
+void v4l2dec_set_reordered_opaque(v4l2dec_env_t *dec, const int64_t v)
+{
+    dec->reordered_opaque = v;
+}
+
+int v4l2dec_receive(v4l2dec_env_t *dec, AVFrame *frame, int timeout_ms)
+{
+    for (;;) {
+        struct pollfd pfd = {.fd = dec->fd};
+        int rv;
+
+        if (dec->eos)
+            return AVERROR_EOF;
+
+        if ((rv = cap_dequeue(dec, frame)) != AVERROR(EAGAIN))
+            return rv;
+
+        // Don't ask about data until CAPTURE is streaming or poll just
+        // reports an error
+        pfd.events = dec->cap_streaming ? POLLIN | POLLPRI : POLLPRI;
+        rv = poll(&pfd, 1, timeout_ms);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "poll failed: %s\n", ERRSTR);
+            return AVERROR(errno);
+        }
+        if ((pfd.revents & POLLPRI) != 0 && (rv = do_events(dec)) != 0)
+            return rv;
+        if ((pfd.revents & (POLLIN | POLLPRI)) == 0)
+            return AVERROR(EAGAIN);
+    }
+}
+
+void v4l2dec_delete(v4l2dec_env_t **pdec)
+{
+    v4l2dec_env_t *const dec = *pdec;
+    int type;
+    unsigned int i;
+
+    if (dec == NULL)
+        return;
+    *pdec = NULL;
+
+    pthread_mutex_lock(&dec->lock);
+    if (dec->fd >= 0) {
+        type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        xioctl(dec->fd, VIDIOC_STREAMOFF, &type);
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        xioctl(dec->fd, VIDIOC_STREAMOFF, &type);
+    }
+    dec->cap_streaming = 0;
+    cap_bufs_release(dec);
+    pthread_mutex_unlock(&dec->lock);
+
+    for (i = 0; i != dec->n_out; ++i) {
+        if (dec->out_bufs[i].map != NULL)
+            munmap(dec->out_bufs[i].map, dec->out_bufs[i].size);
+    }
+    if (dec->fd >= 0)
+        close(dec->fd);
+    dec->fd = -1;
+    av_bsf_free(&dec->bsf);
+    av_packet_free(&dec->pending);
+    av_packet_free(&dec->bsf_in);
+
+    dec_unref(dec);
+}
+
+// avcC / hvcC extradata means length prefixed NALs which V4L2 won't take
+static int bsf_init(struct v4l2dec_env_s *const dec, const AVCodecParameters *const par)
+{
+    const char *name;
+    const AVBitStreamFilter *f;
+
+    if (par->extradata_size == 0 || par->extradata[0] != 1)
+        return 0;
+    if (par->codec_id == AV_CODEC_ID_H264)
+        name = "h264_mp4toannexb";
+    else if (par->codec_id == AV_CODEC_ID_HEVC)
+        name = "hevc_mp4toannexb";
+    else
+        return 0;
+
+    if ((f = av_bsf_get_by_name(name)) == NULL ||
+        av_bsf_alloc(f, &dec->bsf) != 0 ||
+        avcodec_parameters_copy(dec->bsf->par_in, par) < 0 ||
+        av_bsf_init(dec->bsf) != 0) {
+        fprintf(stderr, "Failed to init %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+v4l2dec_env_t *v4l2dec_new(const char *dev, const AVCodecParameters *par,
+                           unsigned int n_output, unsigned int n_capture)
+{
+    struct v4l2dec_env_s *const dec = calloc(1, sizeof(*dec));
+    struct v4l2_capability cap = {{0}};
+    struct v4l2_format fmt = {.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE};
+    struct v4l2_requestbuffers req = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_MMAP
+    };
+    struct v4l2_event_subscription sub = {.type = V4L2_EVENT_SOURCE_CHANGE};
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    uint32_t fourcc = 0;
+    uint32_t caps;
+    unsigned int i;
+
+    if (dec == NULL)
+        return NULL;
+    dec->fd = -1;
+    atomic_init(&dec->ref_count, 1);
+    pthread_mutex_init(&dec->lock, NULL);
+    dec->n_cap_extra = n_capture;
+
+    for (i = 0; i != sizeof(codec_map) / sizeof(codec_map[0]); ++i) {
+        if (codec_map[i].codec_id == par->codec_id)
+            fourcc = codec_map[i].fourcc;
+    }
+    if (fourcc == 0) {
+        fprintf(stderr, "Codec %s not supported by V4L2 decode\n", avcodec_get_name(par->codec_id));
+        goto fail;
+    }
+
+    if ((dec->hw_device = av_hwdevice_ctx_alloc(AV_HWDEVICE_TYPE_DRM)) == NULL)
+        goto fail;
+    ((AVDRMDeviceContext *)((AVHWDeviceContext *)dec->hw_device->data)->hwctx)->fd = -1;
+    if (av_hwdevice_ctx_init(dec->hw_device) != 0)
+        goto fail;
+
+    if ((dec->pending = av_packet_alloc()) == NULL ||
+        (dec->bsf_in = av_packet_alloc()) == NULL ||
+        bsf_init(dec, par) != 0)
+        goto fail;
+
+    if ((dec->fd = open(dev, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", dev, ERRSTR);
+        goto fail;
+    }
+    if (xioctl(dec->fd, VIDIOC_QUERYCAP, &cap) != 0) {
+        fprintf(stderr, "%s: QUERYCAP failed: %s\n", dev, ERRSTR);
+        goto fail;
+    }
+    caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) != 0 ? cap.device_caps : cap.capabilities;
+    if ((caps & V4L2_CAP_VIDEO_M2M_MPLANE) == 0 || (caps & V4L2_CAP_STREAMING) == 0) {
+        fprintf(stderr, "%s is not a multiplanar M2M device\n", dev);
+        goto fail;
+    }
+
+    fmt.fmt.pix_mp.pixelformat = fourcc;
+    fmt.fmt.pix_mp.width = par->width;
+    fmt.fmt.pix_mp.height = par->height;
+    fmt.fmt.pix_mp.num_planes = 1;
+    // Big enough for any sane compressed frame
+    fmt.fmt.pix_mp.plane_fmt[0].sizeimage = par->width * par->height / 2 < (512 << 10) ?
+        (512 << 10) : par->width * par->height / 2;
+    if (xioctl(dec->fd, VIDIOC_S_FMT, &fmt) != 0 || fmt.fmt.pix_mp.pixelformat != fourcc) {
+        fprintf(stderr, "%s can't decode %s\n", dev, avcodec_get_name(par->codec_id));
+        goto fail;
+    }
+
+    req.count = n_output < 2 ? 2 : n_output > OUT_MAX ? OUT_MAX : n_output;
+    if (xioctl(dec->fd, VIDIOC_REQBUFS, &req) != 0) {
+        fprintf(stderr, "OUTPUT REQBUFS failed: %s\n", ERRSTR);
+        goto fail;
+    }
+    dec->n_out = req.count > OUT_MAX ? OUT_MAX : req.count;
+
+    for (i = 0; i != dec->n_out; ++i) {
+        struct v4l2_plane planes[VIDEO_MAX_PLANES] = {{0}};
+        struct v4l2_buffer buf = {
+            .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+            .memory = V4L2_MEMORY_MMAP,
+            .index = i,
+            .length = VIDEO_MAX_PLANES,
+            .m.planes = planes
+        };
+        void *map;
+
+        if (xioctl(dec->fd, VIDIOC_QUERYBUF, &buf) != 0) {
+            fprintf(stderr, "OUTPUT QUERYBUF failed: %s\n", ERRSTR);
+            goto fail;
+        }
+        map = mmap(NULL, planes[0].length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   dec->fd, planes[0].m.mem_offset);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "OUTPUT mmap failed: %s\n", ERRSTR);
+            goto fail;
+        }
+        dec->out_bufs[i].map = map;
+        dec->out_bufs[i].size = planes[0].length;
+    }
+
+    if (xioctl(dec->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) != 0) {
+        fprintf(stderr, "Failed to subscribe to source change: %s\n", ERRSTR);
+        goto fail;
+    }
+    sub.type = V4L2_EVENT_EOS;
+    xioctl(dec->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
+
+    if (xioctl(dec->fd, VIDIOC_STREAMON, &type) != 0) {
+        fprintf(stderr, "OUTPUT STREAMON failed: %s\n", ERRSTR);
+        goto fail;
+    }
+
+    return dec;
+
+fail:
+    {
+        v4l2dec_env_t *d = dec;
+        v4l2dec_delete(&d);
+    }
+    return NULL;
+}
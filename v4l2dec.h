@@ -0,0 +1,27 @@
+#include <stdint.h>
+
+struct AVCodecParameters;
+struct AVFrame;
+struct AVPacket;
+typedef struct v4l2dec_env_s v4l2dec_env_t;
+
+// Queue a packet for decode.  NULL (or an empty packet) starts draining.
+// Returns AVERROR(EAGAIN) if all the OUTPUT buffers are busy - receive
+// some frames and try again; the packet has not been used.
+int v4l2dec_send(v4l2dec_env_t * dec, const struct AVPacket * pkt);
+// As AVCodecContext.reordered_opaque: copied to the frames that come from
+// the packets sent after this
+void v4l2dec_set_reordered_opaque(v4l2dec_env_t * dec, int64_t v);
+// Get the next decoded frame as a DRM_PRIME frame referencing an exported
+// CAPTURE buffer.  The buffer goes back to the decoder when the frame is
+// freed.  Waits up to timeout_ms (0 = don't wait, -1 = forever).
+// Returns 0, AVERROR(EAGAIN) if nothing came in time, AVERROR_EOF once
+// drained, or another error.
+int v4l2dec_receive(v4l2dec_env_t * dec, struct AVFrame * frame, int timeout_ms);
+// Stops decode and closes the device.  Frames still held stay valid.
+void v4l2dec_delete(v4l2dec_env_t ** pdec);
+// Open a stateful V4L2 M2M decoder (e.g. /dev/video10) for the stream.
+// n_output OUTPUT (bitstream) buffers; n_capture CAPTURE buffers over the
+// minimum the decoder asks for, to cover what the display holds on to.
+v4l2dec_env_t * v4l2dec_new(const char * dev, const struct AVCodecParameters * par,
+                            unsigned int n_output, unsigned int n_capture);